@@ -1,27 +1,117 @@
+// Build: cc -O2 -pthread univariate-linear-regression.c -o
+//        univariate-linear-regression -lm
+// With a CBLAS (OpenBLAS, MKL, ...) for the multivariate gradient, add
+// -DLR_WITH_CBLAS and link it, e.g. -lopenblas. Keep its own threading off
+// (OPENBLAS_NUM_THREADS=1), the thread pool already splits the rows.
+// -DLR_WITH_OPENCL and -lOpenCL add the GPU backend of device opencl, see
+// OpenCL backend below.
+// glibc before 2.34 also needs -lrt for the shared memory dataset cache.
+// -DLR_BENCH builds the benchmark suite instead, see Benchmarks below.
+// -DLR_INSTRUMENT adds per-phase cycle counts, see Instrumentation below.
+// Profile-guided build: compile with -O2 -flto -fprofile-generate
+// -fprofile-update=atomic, train once on representative data and settings,
+// then compile again to the same output name with -O2 -flto -fprofile-use
+// -fprofile-partial-training (the profile file is named after the output).
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <math.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef LR_WITH_CBLAS
+#include <cblas.h>
+#endif
+
+#ifdef LR_WITH_OPENCL
+#define CL_TARGET_OPENCL_VERSION 120
+#include <CL/cl.h>
+#endif
+
+#ifdef LR_INSTRUMENT
+#include <inttypes.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_KERNELS 1
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#define HAVE_NEON_KERNEL 1
+#endif
+
+// Integer types a column can be stored as, see narrow_pairs()
+typedef enum { COLUMN_INT32, COLUMN_INT16, COLUMN_INT8 } ColumnType;
+
+// Size of an element of each type, indexed by ColumnType
+static const size_t column_sizes[] = {sizeof(int), sizeof(int16_t),
+                                      sizeof(int8_t)};
 
 // Struture to represent a dynamic vector for integers
 typedef struct {
-  int *data;       // Pointer to the dynamically allocated array
+  union {
+    int *data;       // Pointer to the dynamically allocated array
+    int16_t *data16; // The same array once narrowed to COLUMN_INT16
+    int8_t *data8;   // The same array once narrowed to COLUMN_INT8
+  };
   size_t size;     // Current number of elements in the vector
   size_t capacity; // Total allocated capacity of the vector
+  ColumnType type; // Type of the elements, COLUMN_INT32 unless narrowed
 } IntVec;
 
+/**
+ * Read one element of a vector of any element type.
+ *
+ * @param vec Pointer to the vector.
+ * @param i   Index of the element.
+ * @return int - The element.
+ */
+static inline int intvec_at(const IntVec *vec, size_t i) {
+  switch (vec->type) {
+  case COLUMN_INT16:
+    return vec->data16[i];
+  case COLUMN_INT8:
+    return vec->data8[i];
+  default:
+    return vec->data[i];
+  }
+}
+
 // Initial size for the dynamic vector
 #define INIT_SIZE 256
 
 /**
  * Create a new dynamic integer vector with an initial size.
  *
- * @return IntVec - A new integer vector with initialized fields.
+ * @return IntVec - A new integer vector with initialized fields, capacity 0
+ *                  if the memory could not be allocated.
  */
-inline IntVec new_intvec() {
+static inline IntVec new_intvec(void) {
   IntVec vec = {
       .data = malloc(INIT_SIZE * sizeof(int)), // Allocate memory for vector
       .size = 0,                               // Initialize size to 0
       .capacity = INIT_SIZE};                  // Set initial capacity
+  if (vec.data == NULL)
+    vec.capacity = 0; // The first append tries again
   return vec;
 }
 
@@ -30,14 +120,80 @@ inline IntVec new_intvec() {
  *
  * @param vec Pointer to the IntVec structure to which the value is appended.
  * @param i   Pointer to the integer to append.
+ * @return int - 0 on success, 1 if out of memory (the vector is unchanged).
  */
-inline void vec_append(IntVec *vec, int *i) {
+static inline int vec_append(IntVec *vec, int *i) {
   // Check if resizing is needed
   if (vec->size >= vec->capacity) {
-    vec->capacity *= 2; // Double the capacity
-    vec->data = realloc(vec->data, vec->capacity * sizeof(*vec->data));
+    // Double the capacity, keeping the old buffer if realloc fails
+    size_t capacity = vec->capacity > 0 ? vec->capacity * 2 : INIT_SIZE;
+    int *data = realloc(vec->data, capacity * sizeof(*data));
+    if (data == NULL)
+      return 1;
+    vec->data = data;
+    vec->capacity = capacity;
   }
   vec->data[vec->size++] = *i; // Add the new element and increase size
+  return 0;
+}
+
+// Alignment of the column blocks, a cache line and the widest vector load
+#define COLUMN_ALIGN 64
+
+/**
+ * Allocate the x and y columns of a data set from one aligned block.
+ *
+ * y starts at the first aligned offset after capacity elements of x. The
+ * block belongs to x.data, freeing x.data frees both columns.
+ *
+ * @param x        Pointer receiving the input column.
+ * @param y        Pointer receiving the target column.
+ * @param capacity Number of pairs the columns can hold.
+ * @param type     Element type of both columns.
+ * @return int - 0 on success, 1 if out of memory.
+ */
+static int columns_alloc(IntVec *x, IntVec *y, size_t capacity,
+                         ColumnType type) {
+  size_t stride = (capacity * column_sizes[type] + COLUMN_ALIGN - 1) /
+                  COLUMN_ALIGN * COLUMN_ALIGN;
+  if (stride == 0)
+    stride = COLUMN_ALIGN;
+  char *block = aligned_alloc(COLUMN_ALIGN, 2 * stride);
+  if (block == NULL)
+    return 1;
+  *x = (IntVec){.data = (int *)block, .capacity = capacity, .type = type};
+  *y = (IntVec){
+      .data = (int *)(block + stride), .capacity = capacity, .type = type};
+  return 0;
+}
+
+/**
+ * Make room for n more pairs in columns from columns_alloc().
+ *
+ * Full columns move to a new block of at least twice the capacity.
+ *
+ * @param x Pointer to the input column.
+ * @param y Pointer to the target column.
+ * @param n Number of pairs about to be appended.
+ * @return int - 0 on success, 1 if out of memory (the columns are unchanged).
+ */
+static int columns_reserve(IntVec *x, IntVec *y, size_t n) {
+  if (x->size + n <= x->capacity)
+    return 0;
+  size_t capacity = x->capacity > 0 ? x->capacity * 2 : INIT_SIZE;
+  while (x->size + n > capacity)
+    capacity *= 2;
+
+  IntVec nx, ny;
+  if (columns_alloc(&nx, &ny, capacity, x->type) != 0)
+    return 1;
+  memcpy(nx.data, x->data, x->size * column_sizes[x->type]);
+  memcpy(ny.data, y->data, y->size * column_sizes[y->type]);
+  nx.size = ny.size = x->size;
+  free(x->data);
+  *x = nx;
+  *y = ny;
+  return 0;
 }
 
 // Structure to hold weights for a linear model
@@ -46,187 +202,8555 @@ typedef struct {
   double b; // Bias term
 } Weights;
 
+/*
+ * Gradient kernels
+ *
+ * A kernel sums the unaveraged partial derivatives over n input-target pairs:
+ *   dj_dw = sum((w*x + b - y) * x), dj_db = sum(w*x + b - y)
+ * Every kernel keeps several independent accumulators so consecutive
+ * elements do not wait on the same add, and only reduces them at the end.
+ */
+typedef Weights (*GradientKernel)(const int *x, const int *y, size_t n,
+                                  double w, double b);
+
 /**
- * Compute the gradient of the cost function for linear regression.
+ * Portable gradient kernel, also used for the tails of the vector kernels.
  *
- * @param x  Pointer to the input vector of independent variables.
- * @param y  Pointer to the output vector of targets.
- * @param ws Pointer to the current weights (w, b) of the model.
- * @return Weights - The gradients for the weight and bias (dj_dw, dj_db).
+ * @param x Pointer to the inputs.
+ * @param y Pointer to the targets.
+ * @param n Number of input-target pairs.
+ * @param w Current weight.
+ * @param b Current bias.
+ * @return Weights - The summed gradients for the weight and bias.
  */
-Weights gradient(const IntVec *x, const IntVec *y, const Weights *ws) {
-  double dj_dw = 0, dj_db = 0; // Initalize gradients for weight and bias
+static Weights gradient_scalar(const int *x, const int *y, size_t n, double w,
+                               double b) {
+  double dw[4] = {0}, db[4] = {0}; // Four independent accumulator chains
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    for (int k = 0; k < 4; k++) {
+      double err = w * x[i + k] + b - y[i + k]; // Prediction error w*x + b - y
+      dw[k] += err * x[i + k];
+      db[k] += err;
+    }
+  }
+  for (; i < n; i++) {
+    double err = w * x[i] + b - y[i];
+    dw[0] += err * x[i];
+    db[0] += err;
+  }
+  Weights sums = {.w = (dw[0] + dw[1]) + (dw[2] + dw[3]),
+                  .b = (db[0] + db[1]) + (db[2] + db[3])};
+  return sums;
+}
 
-  // Compute the gradients for each data point
-  for (size_t i = 0; i < x->size; i++) {
-    double f_wb = ws->w * x->data[i] + ws->b; // Model prediction: w*x + b
-    double dj_dw_i =
-        (f_wb - y->data[i]) * x->data[i]; // Partial dervation w.r.t. w
-    double dj_db_i = f_wb - y->data[i];   // Partial dervation w.r.t. b
-    dj_dw += dj_dw_i;                     // Accumlate the gradient for w
-    dj_db += dj_db_i;                     // Accumlate the gradient for b
+#ifdef HAVE_X86_KERNELS
+/**
+ * AVX2 gradient kernel: 4 accumulators of 4 doubles, 16 pairs per step.
+ */
+__attribute__((target("avx2,fma"))) static Weights
+gradient_avx2(const int *x, const int *y, size_t n, double w, double b) {
+  __m256d vw = _mm256_set1_pd(w), vb = _mm256_set1_pd(b);
+  __m256d dw[4], db[4];
+  for (int k = 0; k < 4; k++)
+    dw[k] = db[k] = _mm256_setzero_pd();
+
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    for (int k = 0; k < 4; k++) {
+      // Widen 4 ints to 4 doubles and compute the error w*x + b - y
+      __m256d vx = _mm256_cvtepi32_pd(
+          _mm_loadu_si128((const __m128i *)(x + i + 4 * k)));
+      __m256d vy = _mm256_cvtepi32_pd(
+          _mm_loadu_si128((const __m128i *)(y + i + 4 * k)));
+      __m256d err = _mm256_sub_pd(_mm256_fmadd_pd(vw, vx, vb), vy);
+      dw[k] = _mm256_fmadd_pd(err, vx, dw[k]);
+      db[k] = _mm256_add_pd(db[k], err);
+    }
   }
 
-  // Average the gradients for each data point
-  dj_dw = dj_dw / x->size;
-  dj_db = dj_db / x->size;
+  // Reduce the accumulators to one vector, then the vector to a scalar
+  __m256d vdw = _mm256_add_pd(_mm256_add_pd(dw[0], dw[1]),
+                              _mm256_add_pd(dw[2], dw[3]));
+  __m256d vdb = _mm256_add_pd(_mm256_add_pd(db[0], db[1]),
+                              _mm256_add_pd(db[2], db[3]));
+  double lanes_dw[4], lanes_db[4];
+  _mm256_storeu_pd(lanes_dw, vdw);
+  _mm256_storeu_pd(lanes_db, vdb);
 
-  // Return the computed gradients as a Weights structure
-  Weights features = {.w = dj_dw, .b = dj_db};
-  return features;
+  Weights tail = gradient_scalar(x + i, y + i, n - i, w, b);
+  Weights sums = {
+      .w = (lanes_dw[0] + lanes_dw[1]) + (lanes_dw[2] + lanes_dw[3]) + tail.w,
+      .b = (lanes_db[0] + lanes_db[1]) + (lanes_db[2] + lanes_db[3]) + tail.b};
+  return sums;
 }
 
-// Main function
-int main(int argc, char **argv) {
+/**
+ * AVX-512 gradient kernel: 4 accumulators of 8 doubles, 32 pairs per step.
+ */
+__attribute__((target("avx512f"))) static Weights
+gradient_avx512(const int *x, const int *y, size_t n, double w, double b) {
+  __m512d vw = _mm512_set1_pd(w), vb = _mm512_set1_pd(b);
+  __m512d dw[4], db[4];
+  for (int k = 0; k < 4; k++)
+    dw[k] = db[k] = _mm512_setzero_pd();
 
-  // Check if correct number of arguments are provided
-  if (argc < 2 || argc > 3) {
-    // Error message explaining usage and input requirements
-    fprintf(
-        stderr,
-        "Error: Invalid number of arguments provided.\n\nUsage: %s "
-        "<input-target pairs file> or %s <input-target pairs file> <initial "
-        "setting file>\n<input-target pairs file> (input-target.txt) example: "
-        "\n1 2\n2 3\n3 4\n123 432\n10 1\n-10 37\n\n<initial settings file> "
-        "(settings.txt) example:\nw 0.0\nb 0.0\nalpha 0.00001\niterations "
-        "100000\noutput stdout\nlog-every 100\n\nSettings file explanation:\nw "
-        "= initial weight, b = initial bias, alpha = learning "
-        "rate,\niterations = number of iterations to train (inclusive) "
-        "starting from 0\n(e.g. 1000 would be 0..1000 or 1001 total, 10000 "
-        "would be 0..10000 or 10001 total),\nlog-every = number of iterations "
-        "to pass between before logging (e.g. log-every 100 would log 0 100 "
-        "200 ...),\noutput = file where the output will be written (left "
-        "unspecified uses stdout)\n\nIt is fine to not provide a initial "
-        "settings file, if one is not provided,\nthe settings listed in the "
-        "example will be used.\nFurthermore, you don't have to specify all the "
-        "settings in your <initial settings file>\nand the ordering of your "
-        "settings does not matter.\n\nAnother <initial settings file> "
-        "(settings.txt) example:\nlog-every 1000\nw 100\n\nIs also a valid "
-        "settings file.\n\nFiles should be txts with the format value <space> "
-        "value and should be in the same directory as the executable.\n",
-        argv[0], argv[0]);
-    return 1;
+  size_t i = 0;
+  for (; i + 32 <= n; i += 32) {
+    for (int k = 0; k < 4; k++) {
+      // Widen 8 ints to 8 doubles and compute the error w*x + b - y
+      __m512d vx = _mm512_cvtepi32_pd(
+          _mm256_loadu_si256((const __m256i *)(x + i + 8 * k)));
+      __m512d vy = _mm512_cvtepi32_pd(
+          _mm256_loadu_si256((const __m256i *)(y + i + 8 * k)));
+      __m512d err = _mm512_sub_pd(_mm512_fmadd_pd(vw, vx, vb), vy);
+      dw[k] = _mm512_fmadd_pd(err, vx, dw[k]);
+      db[k] = _mm512_add_pd(db[k], err);
+    }
   }
 
-  // Open the input-target pairs file
-  FILE *input_target_pair_file = fopen(argv[1], "r");
-  if (input_target_pair_file == NULL) {
-    // Error message if file can not be opened
-    perror("Error opening target-value file");
-    return 1;
+  Weights tail = gradient_scalar(x + i, y + i, n - i, w, b);
+  Weights sums = {
+      .w = _mm512_reduce_add_pd(_mm512_add_pd(_mm512_add_pd(dw[0], dw[1]),
+                                              _mm512_add_pd(dw[2], dw[3]))) +
+           tail.w,
+      .b = _mm512_reduce_add_pd(_mm512_add_pd(_mm512_add_pd(db[0], db[1]),
+                                              _mm512_add_pd(db[2], db[3]))) +
+           tail.b};
+  return sums;
+}
+#endif
+
+#ifdef HAVE_NEON_KERNEL
+/**
+ * NEON gradient kernel: 4 accumulators of 2 doubles, 8 pairs per step.
+ */
+static Weights gradient_neon(const int *x, const int *y, size_t n, double w,
+                             double b) {
+  float64x2_t vw = vdupq_n_f64(w), vb = vdupq_n_f64(b);
+  float64x2_t dw[4], db[4];
+  for (int k = 0; k < 4; k++)
+    dw[k] = db[k] = vdupq_n_f64(0);
+
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    for (int k = 0; k < 2; k++) {
+      // Widen 4 ints to two pairs of doubles
+      int32x4_t ix = vld1q_s32(x + i + 4 * k);
+      int32x4_t iy = vld1q_s32(y + i + 4 * k);
+      float64x2_t vx[2] = {vcvtq_f64_s64(vmovl_s32(vget_low_s32(ix))),
+                           vcvtq_f64_s64(vmovl_high_s32(ix))};
+      float64x2_t vy[2] = {vcvtq_f64_s64(vmovl_s32(vget_low_s32(iy))),
+                           vcvtq_f64_s64(vmovl_high_s32(iy))};
+      for (int h = 0; h < 2; h++) {
+        float64x2_t err = vsubq_f64(vfmaq_f64(vb, vw, vx[h]), vy[h]);
+        dw[2 * k + h] = vfmaq_f64(dw[2 * k + h], err, vx[h]);
+        db[2 * k + h] = vaddq_f64(db[2 * k + h], err);
+      }
+    }
   }
 
-  // Temporary variables to store pairs read from the file
-  int x_temp, y_temp;
+  Weights tail = gradient_scalar(x + i, y + i, n - i, w, b);
+  Weights sums = {
+      .w = vaddvq_f64(vaddq_f64(vaddq_f64(dw[0], dw[1]),
+                                vaddq_f64(dw[2], dw[3]))) +
+           tail.w,
+      .b = vaddvq_f64(vaddq_f64(vaddq_f64(db[0], db[1]),
+                                vaddq_f64(db[2], db[3]))) +
+           tail.b};
+  return sums;
+}
+#endif
+
+/*
+ * Single precision kernels
+ *
+ * With precision f32 the pairs are converted to floats instead of doubles,
+ * so a vector holds twice as many and the error and the products cost half
+ * the instructions; the sums are float as well. Precision mixed keeps the
+ * float products but sums them in float only over blocks of MIXED_BLOCK
+ * pairs and adds the block sums in double, a two level pairwise summation
+ * whose error no longer grows with n. Inputs up to 2^24 in magnitude
+ * convert exactly. Both precisions share one body per instruction set,
+ * f32 simply uses a single block.
+ */
 
-  // Initialize dynamic vectors for x (inputs) and y (targets)
-  IntVec x = new_intvec();
-  IntVec y = new_intvec();
+// Pairs summed in float before a mixed kernel adds the sums in double
+#define MIXED_BLOCK 4096
 
-  // Read pairs of integers from the file and store them in vectors
-  while (fscanf(input_target_pair_file, "%d %d", &x_temp, &y_temp) == 2) {
-    vec_append(&x, &x_temp); // Append the first integer to the x vector
-    vec_append(&y, &y_temp); // Append the second integer to the y vector
+/**
+ * Portable single precision body, also used for the tails.
+ *
+ * @param x     Pointer to the inputs.
+ * @param y     Pointer to the targets.
+ * @param n     Number of input-target pairs.
+ * @param w     Current weight.
+ * @param b     Current bias.
+ * @param block Pairs summed in float before the sums are added in double.
+ * @return Weights - The summed gradients for the weight and bias.
+ */
+static inline Weights gradient_f32_body(const int *x, const int *y, size_t n,
+                                        double w, double b, size_t block) {
+  float fw = (float)w, fb = (float)b;
+  Weights sums = {0};
+  for (size_t lo = 0; lo < n; lo += block) {
+    size_t hi = n - lo < block ? n : lo + block;
+    float dw[4] = {0}, db[4] = {0}; // Four independent accumulator chains
+    size_t i = lo;
+    for (; i + 4 <= hi; i += 4) {
+      for (int k = 0; k < 4; k++) {
+        float err = fw * (float)x[i + k] + fb - (float)y[i + k];
+        dw[k] += err * (float)x[i + k];
+        db[k] += err;
+      }
+    }
+    for (; i < hi; i++) {
+      float err = fw * (float)x[i] + fb - (float)y[i];
+      dw[0] += err * (float)x[i];
+      db[0] += err;
+    }
+    sums.w += (double)((dw[0] + dw[1]) + (dw[2] + dw[3]));
+    sums.b += (double)((db[0] + db[1]) + (db[2] + db[3]));
   }
+  return sums;
+}
 
-  // Close the input-target pairs file
-  fclose(input_target_pair_file);
+/**
+ * Portable single precision kernels.
+ */
+static Weights gradient_f32_scalar(const int *x, const int *y, size_t n,
+                                   double w, double b) {
+  return gradient_f32_body(x, y, n, w, b, n > 0 ? n : 1);
+}
 
-  // Default initial settings
-  double w = 0.0, b = 0.0, alpha = 0.00001;
-  int iterations = 100000, every = 100;
-  char output[101] = "";
-
-  // Check if optional initial settings file is provided
-  if (argc == 3) {
-    FILE *settings_file = fopen(argv[2], "r");
-    if (settings_file == NULL) {
-      // Error message if the settings file cannot be opened
-      perror("Error opening settings file");
-
-      // Free allocated memory before exiting
-      free(x.data);
-      free(y.data);
-      return 1;
-    }
+static Weights gradient_mixed_scalar(const int *x, const int *y, size_t n,
+                                     double w, double b) {
+  return gradient_f32_body(x, y, n, w, b, MIXED_BLOCK);
+}
 
-    // Temporary variables to store keys and values from the settings file
-    char key[11]; // Buffer to store the setting key (e.g., "w", "b", "alpha")
-    char value[101]; // Variable to store the corresponding value
+#ifdef HAVE_X86_KERNELS
+/**
+ * AVX2 single precision body: 4 accumulators of 8 floats, 32 pairs per step.
+ * The float sums of a block are widened and added to double accumulators.
+ */
+__attribute__((target("avx2,fma"), always_inline)) static inline Weights
+gradient_f32_body_avx2(const int *x, const int *y, size_t n, double w,
+                       double b, size_t block) {
+  __m256 vw = _mm256_set1_ps((float)w), vb = _mm256_set1_ps((float)b);
+  __m256d sw = _mm256_setzero_pd(), sb = sw;
 
-    // Read key-value pairs from the settings file
-    while (fscanf(settings_file, "%10s %100s", key, value) == 2) {
-      // Match the key and update the corresponding variable
-      if (strcmp(key, "w") == 0)
-        w = atof(value);
-      else if (strcmp(key, "b") == 0)
-        b = atof(value);
-      else if (strcmp(key, "alpha") == 0)
-        alpha = atof(value);
-      else if (strcmp(key, "iterations") == 0)
-        iterations = atof(value);
-      else if (strcmp(key, "log-every") == 0)
-        every = atof(value);
-      else if (strcmp(key, "output") == 0) {
-        strncpy(output, value, sizeof(output) - 1);
-        output[sizeof(output) - 1] = '\0';
-      } else
-        fprintf(stderr, "Unknown key: %s\n", key);
+  // Whole steps only, the tail goes to the portable body
+  size_t steps = n / 32 * 32;
+  block = (block + 31) / 32 * 32;
+  for (size_t lo = 0; lo < steps; lo += block) {
+    size_t hi = steps - lo < block ? steps : lo + block;
+    // Named accumulators, GCC keeps an array of vectors in memory
+    __m256 dw0 = _mm256_setzero_ps(), dw1 = dw0, dw2 = dw0, dw3 = dw0;
+    __m256 db0 = dw0, db1 = dw0, db2 = dw0, db3 = dw0;
+    for (size_t i = lo; i < hi; i += 32) {
+      // Convert 8 ints to 8 floats and compute the error w*x + b - y
+      __m256 x0 = _mm256_cvtepi32_ps(_mm256_loadu_si256((const void *)(x + i)));
+      __m256 x1 = _mm256_cvtepi32_ps(
+          _mm256_loadu_si256((const void *)(x + i + 8)));
+      __m256 x2 = _mm256_cvtepi32_ps(
+          _mm256_loadu_si256((const void *)(x + i + 16)));
+      __m256 x3 = _mm256_cvtepi32_ps(
+          _mm256_loadu_si256((const void *)(x + i + 24)));
+      __m256 e0 = _mm256_sub_ps(
+          _mm256_fmadd_ps(vw, x0, vb),
+          _mm256_cvtepi32_ps(_mm256_loadu_si256((const void *)(y + i))));
+      __m256 e1 = _mm256_sub_ps(
+          _mm256_fmadd_ps(vw, x1, vb),
+          _mm256_cvtepi32_ps(_mm256_loadu_si256((const void *)(y + i + 8))));
+      __m256 e2 = _mm256_sub_ps(
+          _mm256_fmadd_ps(vw, x2, vb),
+          _mm256_cvtepi32_ps(_mm256_loadu_si256((const void *)(y + i + 16))));
+      __m256 e3 = _mm256_sub_ps(
+          _mm256_fmadd_ps(vw, x3, vb),
+          _mm256_cvtepi32_ps(_mm256_loadu_si256((const void *)(y + i + 24))));
+      dw0 = _mm256_fmadd_ps(e0, x0, dw0);
+      dw1 = _mm256_fmadd_ps(e1, x1, dw1);
+      dw2 = _mm256_fmadd_ps(e2, x2, dw2);
+      dw3 = _mm256_fmadd_ps(e3, x3, dw3);
+      db0 = _mm256_add_ps(db0, e0);
+      db1 = _mm256_add_ps(db1, e1);
+      db2 = _mm256_add_ps(db2, e2);
+      db3 = _mm256_add_ps(db3, e3);
     }
 
-    // Close the settings file
-    fclose(settings_file);
+    // Reduce the block to one vector and widen both halves to doubles
+    __m256 vdw =
+        _mm256_add_ps(_mm256_add_ps(dw0, dw1), _mm256_add_ps(dw2, dw3));
+    __m256 vdb =
+        _mm256_add_ps(_mm256_add_ps(db0, db1), _mm256_add_ps(db2, db3));
+    sw = _mm256_add_pd(sw, _mm256_cvtps_pd(_mm256_castps256_ps128(vdw)));
+    sw = _mm256_add_pd(sw, _mm256_cvtps_pd(_mm256_extractf128_ps(vdw, 1)));
+    sb = _mm256_add_pd(sb, _mm256_cvtps_pd(_mm256_castps256_ps128(vdb)));
+    sb = _mm256_add_pd(sb, _mm256_cvtps_pd(_mm256_extractf128_ps(vdb, 1)));
   }
 
-  // Create output file pointer
-  FILE *output_file = NULL;
-  // If a specified output file was provided, open it
-  if (strcmp(output, "") != 0) {
-    output_file = fopen(output, "w");
-    // Error message if the output file could not be opened
-    if (output_file == NULL) {
-      perror("Error Opening File");
+  double lanes_dw[4], lanes_db[4];
+  _mm256_storeu_pd(lanes_dw, sw);
+  _mm256_storeu_pd(lanes_db, sb);
+  _mm256_zeroupper();
 
-      // Free allocated memeory before exiting
-      free(x.data);
-      free(y.data);
-      return 1;
+  Weights tail = gradient_f32_body(x + steps, y + steps, n - steps, w, b, 32);
+  Weights sums = {
+      .w = (lanes_dw[0] + lanes_dw[1]) + (lanes_dw[2] + lanes_dw[3]) + tail.w,
+      .b = (lanes_db[0] + lanes_db[1]) + (lanes_db[2] + lanes_db[3]) + tail.b};
+  return sums;
+}
+
+/**
+ * AVX2 single precision kernels.
+ */
+__attribute__((target("avx2,fma"))) static Weights
+gradient_f32_avx2(const int *x, const int *y, size_t n, double w, double b) {
+  return gradient_f32_body_avx2(x, y, n, w, b, n > 0 ? n : 1);
+}
+
+__attribute__((target("avx2,fma"))) static Weights
+gradient_mixed_avx2(const int *x, const int *y, size_t n, double w, double b) {
+  return gradient_f32_body_avx2(x, y, n, w, b, MIXED_BLOCK);
+}
+
+/**
+ * AVX-512 single precision body: 4 accumulators of 16 floats, 64 pairs per
+ * step. The float sums of a block are widened and added to double
+ * accumulators.
+ */
+__attribute__((target("avx512f"), always_inline)) static inline Weights
+gradient_f32_body_avx512(const int *x, const int *y, size_t n, double w,
+                         double b, size_t block) {
+  __m512 vw = _mm512_set1_ps((float)w), vb = _mm512_set1_ps((float)b);
+  __m512d sw = _mm512_setzero_pd(), sb = sw;
+
+  // Whole steps only, the tail goes to the portable body
+  size_t steps = n / 64 * 64;
+  block = (block + 63) / 64 * 64;
+  for (size_t lo = 0; lo < steps; lo += block) {
+    size_t hi = steps - lo < block ? steps : lo + block;
+    // Named accumulators, GCC keeps an array of vectors in memory
+    __m512 dw0 = _mm512_setzero_ps(), dw1 = dw0, dw2 = dw0, dw3 = dw0;
+    __m512 db0 = dw0, db1 = dw0, db2 = dw0, db3 = dw0;
+    for (size_t i = lo; i < hi; i += 64) {
+      // Convert 16 ints to 16 floats and compute the error w*x + b - y
+      __m512 x0 = _mm512_cvtepi32_ps(_mm512_loadu_si512(x + i));
+      __m512 x1 = _mm512_cvtepi32_ps(_mm512_loadu_si512(x + i + 16));
+      __m512 x2 = _mm512_cvtepi32_ps(_mm512_loadu_si512(x + i + 32));
+      __m512 x3 = _mm512_cvtepi32_ps(_mm512_loadu_si512(x + i + 48));
+      __m512 e0 = _mm512_sub_ps(_mm512_fmadd_ps(vw, x0, vb),
+                                _mm512_cvtepi32_ps(_mm512_loadu_si512(y + i)));
+      __m512 e1 = _mm512_sub_ps(
+          _mm512_fmadd_ps(vw, x1, vb),
+          _mm512_cvtepi32_ps(_mm512_loadu_si512(y + i + 16)));
+      __m512 e2 = _mm512_sub_ps(
+          _mm512_fmadd_ps(vw, x2, vb),
+          _mm512_cvtepi32_ps(_mm512_loadu_si512(y + i + 32)));
+      __m512 e3 = _mm512_sub_ps(
+          _mm512_fmadd_ps(vw, x3, vb),
+          _mm512_cvtepi32_ps(_mm512_loadu_si512(y + i + 48)));
+      dw0 = _mm512_fmadd_ps(e0, x0, dw0);
+      dw1 = _mm512_fmadd_ps(e1, x1, dw1);
+      dw2 = _mm512_fmadd_ps(e2, x2, dw2);
+      dw3 = _mm512_fmadd_ps(e3, x3, dw3);
+      db0 = _mm512_add_ps(db0, e0);
+      db1 = _mm512_add_ps(db1, e1);
+      db2 = _mm512_add_ps(db2, e2);
+      db3 = _mm512_add_ps(db3, e3);
     }
+
+    // Reduce the block to one vector and widen both halves to doubles
+    __m512 vdw =
+        _mm512_add_ps(_mm512_add_ps(dw0, dw1), _mm512_add_ps(dw2, dw3));
+    __m512 vdb =
+        _mm512_add_ps(_mm512_add_ps(db0, db1), _mm512_add_ps(db2, db3));
+    sw = _mm512_add_pd(sw, _mm512_cvtps_pd(_mm512_castps512_ps256(vdw)));
+    sw = _mm512_add_pd(sw, _mm512_cvtps_pd(_mm256_castpd_ps(
+                               _mm512_extractf64x4_pd(_mm512_castps_pd(vdw),
+                                                      1))));
+    sb = _mm512_add_pd(sb, _mm512_cvtps_pd(_mm512_castps512_ps256(vdb)));
+    sb = _mm512_add_pd(sb, _mm512_cvtps_pd(_mm256_castpd_ps(
+                               _mm512_extractf64x4_pd(_mm512_castps_pd(vdb),
+                                                      1))));
   }
 
-  // Initialize weights with the specified or default values
-  Weights weights = {.w = w, .b = b};
+  Weights tail = gradient_f32_body(x + steps, y + steps, n - steps, w, b, 64);
+  Weights sums = {.w = _mm512_reduce_add_pd(sw) + tail.w,
+                  .b = _mm512_reduce_add_pd(sb) + tail.b};
+  _mm256_zeroupper();
+  return sums;
+}
 
-  // Training loop to update weights over the specified number of iterations
-  for (int i = 0; i <= iterations; i++) {
-    // Compute the gradient for the current weights
-    Weights ws = gradient(&x, &y, &weights);
+/**
+ * AVX-512 single precision kernels.
+ */
+__attribute__((target("avx512f"))) static Weights
+gradient_f32_avx512(const int *x, const int *y, size_t n, double w,
+                    double b) {
+  return gradient_f32_body_avx512(x, y, n, w, b, n > 0 ? n : 1);
+}
 
-    // Update weights using the learning rate and gradient
-    weights.w = weights.w - alpha * ws.w;
-    weights.b = weights.b - alpha * ws.b;
+__attribute__((target("avx512f"))) static Weights
+gradient_mixed_avx512(const int *x, const int *y, size_t n, double w,
+                      double b) {
+  return gradient_f32_body_avx512(x, y, n, w, b, MIXED_BLOCK);
+}
+#endif
 
-    // Print the weights every specified number of iterations for progress
-    // tracking
-    if (i % every == 0) {
-      // Write to the output file if there is one open
-      if (output_file != NULL)
-        fprintf(output_file, "iteration: %d, w: %lf, b: %lf\n", i, weights.w,
-                weights.b);
-      // Otherwise write to stdout
-      else
-        fprintf(stdout, "iteration: %d, w: %lf, b: %lf\n", i, weights.w,
-                weights.b);
+#ifdef HAVE_NEON_KERNEL
+/**
+ * NEON single precision body: 4 accumulators of 4 floats, 16 pairs per
+ * step. The float sums of a block are widened and added to double
+ * accumulators.
+ */
+static inline Weights gradient_f32_body_neon(const int *x, const int *y,
+                                             size_t n, double w, double b,
+                                             size_t block) {
+  float32x4_t vw = vdupq_n_f32((float)w), vb = vdupq_n_f32((float)b);
+  float64x2_t sw = vdupq_n_f64(0), sb = sw;
+
+  // Whole steps only, the tail goes to the portable body
+  size_t steps = n / 16 * 16;
+  block = (block + 15) / 16 * 16;
+  for (size_t lo = 0; lo < steps; lo += block) {
+    size_t hi = steps - lo < block ? steps : lo + block;
+    float32x4_t dw0 = vdupq_n_f32(0), dw1 = dw0, dw2 = dw0, dw3 = dw0;
+    float32x4_t db0 = dw0, db1 = dw0, db2 = dw0, db3 = dw0;
+    for (size_t i = lo; i < hi; i += 16) {
+      float32x4_t x0 = vcvtq_f32_s32(vld1q_s32(x + i));
+      float32x4_t x1 = vcvtq_f32_s32(vld1q_s32(x + i + 4));
+      float32x4_t x2 = vcvtq_f32_s32(vld1q_s32(x + i + 8));
+      float32x4_t x3 = vcvtq_f32_s32(vld1q_s32(x + i + 12));
+      float32x4_t e0 = vsubq_f32(vfmaq_f32(vb, vw, x0),
+                                 vcvtq_f32_s32(vld1q_s32(y + i)));
+      float32x4_t e1 = vsubq_f32(vfmaq_f32(vb, vw, x1),
+                                 vcvtq_f32_s32(vld1q_s32(y + i + 4)));
+      float32x4_t e2 = vsubq_f32(vfmaq_f32(vb, vw, x2),
+                                 vcvtq_f32_s32(vld1q_s32(y + i + 8)));
+      float32x4_t e3 = vsubq_f32(vfmaq_f32(vb, vw, x3),
+                                 vcvtq_f32_s32(vld1q_s32(y + i + 12)));
+      dw0 = vfmaq_f32(dw0, e0, x0);
+      dw1 = vfmaq_f32(dw1, e1, x1);
+      dw2 = vfmaq_f32(dw2, e2, x2);
+      dw3 = vfmaq_f32(dw3, e3, x3);
+      db0 = vaddq_f32(db0, e0);
+      db1 = vaddq_f32(db1, e1);
+      db2 = vaddq_f32(db2, e2);
+      db3 = vaddq_f32(db3, e3);
     }
+
+    // Reduce the block to one vector and widen both halves to doubles
+    float32x4_t vdw = vaddq_f32(vaddq_f32(dw0, dw1), vaddq_f32(dw2, dw3));
+    float32x4_t vdb = vaddq_f32(vaddq_f32(db0, db1), vaddq_f32(db2, db3));
+    sw = vaddq_f64(sw, vcvt_f64_f32(vget_low_f32(vdw)));
+    sw = vaddq_f64(sw, vcvt_high_f64_f32(vdw));
+    sb = vaddq_f64(sb, vcvt_f64_f32(vget_low_f32(vdb)));
+    sb = vaddq_f64(sb, vcvt_high_f64_f32(vdb));
   }
 
-  // Close the output file
-  fclose(output_file);
+  Weights tail = gradient_f32_body(x + steps, y + steps, n - steps, w, b, 16);
+  Weights sums = {.w = vaddvq_f64(sw) + tail.w, .b = vaddvq_f64(sb) + tail.b};
+  return sums;
+}
 
-  // Free dynamically allocated memory for vectors
-  free(x.data);
-  free(y.data);
+/**
+ * NEON single precision kernels.
+ */
+static Weights gradient_f32_neon(const int *x, const int *y, size_t n,
+                                 double w, double b) {
+  return gradient_f32_body_neon(x, y, n, w, b, n > 0 ? n : 1);
+}
+
+static Weights gradient_mixed_neon(const int *x, const int *y, size_t n,
+                                   double w, double b) {
+  return gradient_f32_body_neon(x, y, n, w, b, MIXED_BLOCK);
+}
+#endif
+
+/*
+ * Narrow column kernels
+ *
+ * Columns whose values all fit in int16 or int8 are stored in that type
+ * (see narrow_pairs()), so every gradient pass reads half or a quarter of
+ * the bytes. The kernels below are the double precision kernels above
+ * instantiated per element type: they load narrow elements, sign extend
+ * them to int32 in register and then run the same arithmetic in the same
+ * order, so their results are bit-identical to the int32 kernels.
+ */
+typedef Weights (*NarrowKernel)(const void *x, const void *y, size_t n,
+                                double w, double b);
+
+// Portable kernel over elements of type T, see gradient_scalar(). Mainly
+// the tail of the vector kernels: GCC vectorizes the int32 loop of
+// gradient_scalar() but not this one, so it is slower than the int32 kernel
+// and main() does not narrow the columns for the scalar kernel.
+#define NARROW_SCALAR_KERNEL(name, T)                                          \
+  static Weights name(const void *px, const void *py, size_t n, double w,     \
+                      double b) {                                              \
+    const T *x = px, *y = py;                                                  \
+    double dw[4] = {0}, db[4] = {0};                                           \
+    size_t i = 0;                                                              \
+    for (; i + 4 <= n; i += 4) {                                               \
+      for (int k = 0; k < 4; k++) {                                            \
+        double err = w * x[i + k] + b - y[i + k];                              \
+        dw[k] += err * x[i + k];                                               \
+        db[k] += err;                                                          \
+      }                                                                        \
+    }                                                                          \
+    for (; i < n; i++) {                                                       \
+      double err = w * x[i] + b - y[i];                                        \
+      dw[0] += err * x[i];                                                     \
+      db[0] += err;                                                            \
+    }                                                                          \
+    Weights sums = {.w = (dw[0] + dw[1]) + (dw[2] + dw[3]),                    \
+                    .b = (db[0] + db[1]) + (db[2] + db[3])};                   \
+    return sums;                                                               \
+  }
+
+NARROW_SCALAR_KERNEL(gradient_i16_scalar, int16_t)
+NARROW_SCALAR_KERNEL(gradient_i8_scalar, int8_t)
+
+#ifdef HAVE_X86_KERNELS
+// Sign extend 4 (SSE) or 8 (AVX) narrow elements at p to int32
+#define WIDEN4_I16(p) _mm_cvtepi16_epi32(_mm_loadl_epi64((const void *)(p)))
+#define WIDEN4_I8(p) _mm_cvtepi8_epi32(_mm_loadu_si32(p))
+#define WIDEN8_I16(p) _mm256_cvtepi16_epi32(_mm_loadu_si128((const void *)(p)))
+#define WIDEN8_I8(p) _mm256_cvtepi8_epi32(_mm_loadl_epi64((const void *)(p)))
+
+// AVX2 kernel over elements of type T, see gradient_avx2()
+#define NARROW_AVX2_KERNEL(name, T, widen, tail_kernel)                        \
+  __attribute__((target("avx2,fma"))) static Weights name(                     \
+      const void *px, const void *py, size_t n, double w, double b) {          \
+    const T *x = px, *y = py;                                                  \
+    __m256d vw = _mm256_set1_pd(w), vb = _mm256_set1_pd(b);                    \
+    __m256d dw[4], db[4];                                                      \
+    for (int k = 0; k < 4; k++)                                                \
+      dw[k] = db[k] = _mm256_setzero_pd();                                     \
+                                                                               \
+    size_t i = 0;                                                              \
+    for (; i + 16 <= n; i += 16) {                                             \
+      for (int k = 0; k < 4; k++) {                                            \
+        __m256d vx = _mm256_cvtepi32_pd(widen(x + i + 4 * k));                 \
+        __m256d vy = _mm256_cvtepi32_pd(widen(y + i + 4 * k));                 \
+        __m256d err = _mm256_sub_pd(_mm256_fmadd_pd(vw, vx, vb), vy);          \
+        dw[k] = _mm256_fmadd_pd(err, vx, dw[k]);                               \
+        db[k] = _mm256_add_pd(db[k], err);                                     \
+      }                                                                        \
+    }                                                                          \
+                                                                               \
+    __m256d vdw = _mm256_add_pd(_mm256_add_pd(dw[0], dw[1]),                   \
+                                _mm256_add_pd(dw[2], dw[3]));                  \
+    __m256d vdb = _mm256_add_pd(_mm256_add_pd(db[0], db[1]),                   \
+                                _mm256_add_pd(db[2], db[3]));                  \
+    double lanes_dw[4], lanes_db[4];                                           \
+    _mm256_storeu_pd(lanes_dw, vdw);                                           \
+    _mm256_storeu_pd(lanes_db, vdb);                                           \
+                                                                               \
+    Weights tail = tail_kernel(x + i, y + i, n - i, w, b);                     \
+    Weights sums = {.w = (lanes_dw[0] + lanes_dw[1]) +                         \
+                         (lanes_dw[2] + lanes_dw[3]) + tail.w,                 \
+                    .b = (lanes_db[0] + lanes_db[1]) +                         \
+                         (lanes_db[2] + lanes_db[3]) + tail.b};                \
+    return sums;                                                               \
+  }
+
+// AVX-512 kernel over elements of type T, see gradient_avx512()
+#define NARROW_AVX512_KERNEL(name, T, widen, tail_kernel)                      \
+  __attribute__((target("avx512f"))) static Weights name(                      \
+      const void *px, const void *py, size_t n, double w, double b) {          \
+    const T *x = px, *y = py;                                                  \
+    __m512d vw = _mm512_set1_pd(w), vb = _mm512_set1_pd(b);                    \
+    __m512d dw[4], db[4];                                                      \
+    for (int k = 0; k < 4; k++)                                                \
+      dw[k] = db[k] = _mm512_setzero_pd();                                     \
+                                                                               \
+    size_t i = 0;                                                              \
+    for (; i + 32 <= n; i += 32) {                                             \
+      for (int k = 0; k < 4; k++) {                                            \
+        __m512d vx = _mm512_cvtepi32_pd(widen(x + i + 8 * k));                 \
+        __m512d vy = _mm512_cvtepi32_pd(widen(y + i + 8 * k));                 \
+        __m512d err = _mm512_sub_pd(_mm512_fmadd_pd(vw, vx, vb), vy);          \
+        dw[k] = _mm512_fmadd_pd(err, vx, dw[k]);                               \
+        db[k] = _mm512_add_pd(db[k], err);                                     \
+      }                                                                        \
+    }                                                                          \
+                                                                               \
+    Weights tail = tail_kernel(x + i, y + i, n - i, w, b);                     \
+    Weights sums = {                                                           \
+        .w = _mm512_reduce_add_pd(_mm512_add_pd(                               \
+                 _mm512_add_pd(dw[0], dw[1]), _mm512_add_pd(dw[2], dw[3]))) + \
+             tail.w,                                                           \
+        .b = _mm512_reduce_add_pd(_mm512_add_pd(                               \
+                 _mm512_add_pd(db[0], db[1]), _mm512_add_pd(db[2], db[3]))) + \
+             tail.b};                                                          \
+    return sums;                                                               \
+  }
+
+NARROW_AVX2_KERNEL(gradient_i16_avx2, int16_t, WIDEN4_I16, gradient_i16_scalar)
+NARROW_AVX2_KERNEL(gradient_i8_avx2, int8_t, WIDEN4_I8, gradient_i8_scalar)
+NARROW_AVX512_KERNEL(gradient_i16_avx512, int16_t, WIDEN8_I16,
+                     gradient_i16_scalar)
+NARROW_AVX512_KERNEL(gradient_i8_avx512, int8_t, WIDEN8_I8, gradient_i8_scalar)
+#endif
+
+#ifdef HAVE_NEON_KERNEL
+// Sign extend the 8 narrow elements at p to two vectors of 4 int32
+#define WIDEN8_I16_NEON(p, h)                                                  \
+  vmovl_s16((h) ? vld1_s16((p) + 4) : vld1_s16(p))
+#define WIDEN8_I8_NEON(p, h)                                                   \
+  vmovl_s16((h) ? vget_high_s16(vmovl_s8(vld1_s8(p)))                          \
+                : vget_low_s16(vmovl_s8(vld1_s8(p))))
+
+// NEON kernel over elements of type T, see gradient_neon()
+#define NARROW_NEON_KERNEL(name, T, widen, tail_kernel)                        \
+  static Weights name(const void *px, const void *py, size_t n, double w,     \
+                      double b) {                                              \
+    const T *x = px, *y = py;                                                  \
+    float64x2_t vw = vdupq_n_f64(w), vb = vdupq_n_f64(b);                      \
+    float64x2_t dw[4], db[4];                                                  \
+    for (int k = 0; k < 4; k++)                                                \
+      dw[k] = db[k] = vdupq_n_f64(0);                                          \
+                                                                               \
+    size_t i = 0;                                                              \
+    for (; i + 8 <= n; i += 8) {                                               \
+      for (int k = 0; k < 2; k++) {                                            \
+        int32x4_t ix = widen(x + i, k);                                        \
+        int32x4_t iy = widen(y + i, k);                                        \
+        float64x2_t vx[2] = {vcvtq_f64_s64(vmovl_s32(vget_low_s32(ix))),       \
+                             vcvtq_f64_s64(vmovl_high_s32(ix))};               \
+        float64x2_t vy[2] = {vcvtq_f64_s64(vmovl_s32(vget_low_s32(iy))),       \
+                             vcvtq_f64_s64(vmovl_high_s32(iy))};               \
+        for (int h = 0; h < 2; h++) {                                          \
+          float64x2_t err = vsubq_f64(vfmaq_f64(vb, vw, vx[h]), vy[h]);        \
+          dw[2 * k + h] = vfmaq_f64(dw[2 * k + h], err, vx[h]);                \
+          db[2 * k + h] = vaddq_f64(db[2 * k + h], err);                       \
+        }                                                                      \
+      }                                                                        \
+    }                                                                          \
+                                                                               \
+    Weights tail = tail_kernel(x + i, y + i, n - i, w, b);                     \
+    Weights sums = {.w = vaddvq_f64(vaddq_f64(vaddq_f64(dw[0], dw[1]),         \
+                                              vaddq_f64(dw[2], dw[3]))) +      \
+                         tail.w,                                               \
+                    .b = vaddvq_f64(vaddq_f64(vaddq_f64(db[0], db[1]),         \
+                                              vaddq_f64(db[2], db[3]))) +      \
+                         tail.b};                                              \
+    return sums;                                                               \
+  }
+
+NARROW_NEON_KERNEL(gradient_i16_neon, int16_t, WIDEN8_I16_NEON,
+                   gradient_i16_scalar)
+NARROW_NEON_KERNEL(gradient_i8_neon, int8_t, WIDEN8_I8_NEON,
+                   gradient_i8_scalar)
+#endif
+
+// Gradient kernels that can be selected in the settings file
+typedef enum {
+  KERNEL_AUTO,   // Pick the widest kernel the CPU supports
+  KERNEL_SCALAR, // Portable C kernel
+  KERNEL_AVX2,   // x86 AVX2 + FMA
+  KERNEL_AVX512, // x86 AVX-512F
+  KERNEL_NEON    // AArch64 Advanced SIMD
+} Kernel;
+
+// Names of the kernels, indexed by Kernel
+static const char *const kernel_names[] = {"auto", "scalar", "avx2", "avx512",
+                                           "neon"};
+
+/**
+ * Look up the kernel implementing the requested kernel kind.
+ *
+ * KERNEL_AUTO is resolved by CPU feature detection, the other kinds only
+ * succeed if the running CPU supports them.
+ *
+ * @param kind Requested kernel kind.
+ * @return GradientKernel - The kernel, or NULL if it is not supported here.
+ */
+static GradientKernel select_kernel(Kernel kind) {
+  switch (kind) {
+  case KERNEL_AUTO:
+#ifdef HAVE_X86_KERNELS
+    if (__builtin_cpu_supports("avx512f"))
+      return gradient_avx512;
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+      return gradient_avx2;
+#endif
+#ifdef HAVE_NEON_KERNEL
+    return gradient_neon;
+#endif
+    return gradient_scalar;
+  case KERNEL_SCALAR:
+    return gradient_scalar;
+#ifdef HAVE_X86_KERNELS
+  case KERNEL_AVX2:
+    return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")
+               ? gradient_avx2
+               : NULL;
+  case KERNEL_AVX512:
+    return __builtin_cpu_supports("avx512f") ? gradient_avx512 : NULL;
+#endif
+#ifdef HAVE_NEON_KERNEL
+  case KERNEL_NEON:
+    return gradient_neon;
+#endif
+  default:
+    return NULL;
+  }
+}
+
+// Arithmetic precision of the univariate gradient kernels
+typedef enum {
+  PRECISION_F64,  // Double products and sums
+  PRECISION_F32,  // Float products and sums
+  PRECISION_MIXED // Float products, blocks of float sums added in double
+} Precision;
+
+// Names of the precisions, indexed by Precision
+static const char *const precision_names[] = {"f64", "f32", "mixed"};
+
+/**
+ * Look up the sibling of a double precision kernel for another precision.
+ *
+ * @param kernel    Double precision kernel returned by select_kernel().
+ * @param precision Requested precision.
+ * @return GradientKernel - The kernel of the same instruction set.
+ */
+static GradientKernel select_precision(GradientKernel kernel,
+                                       Precision precision) {
+  int f32 = precision == PRECISION_F32;
+  if (precision == PRECISION_F64)
+    return kernel;
+#ifdef HAVE_X86_KERNELS
+  if (kernel == gradient_avx512)
+    return f32 ? gradient_f32_avx512 : gradient_mixed_avx512;
+  if (kernel == gradient_avx2)
+    return f32 ? gradient_f32_avx2 : gradient_mixed_avx2;
+#endif
+#ifdef HAVE_NEON_KERNEL
+  if (kernel == gradient_neon)
+    return f32 ? gradient_f32_neon : gradient_mixed_neon;
+#endif
+  return f32 ? gradient_f32_scalar : gradient_mixed_scalar;
+}
+
+/**
+ * Look up the sibling of a double precision kernel for narrow columns.
+ *
+ * @param kernel Double precision kernel returned by select_kernel().
+ * @param type   Element type of the columns, COLUMN_INT16 or COLUMN_INT8.
+ * @return NarrowKernel - The kernel of the same instruction set.
+ */
+static NarrowKernel select_narrow(GradientKernel kernel, ColumnType type) {
+  int i8 = type == COLUMN_INT8;
+#ifdef HAVE_X86_KERNELS
+  if (kernel == gradient_avx512)
+    return i8 ? gradient_i8_avx512 : gradient_i16_avx512;
+  if (kernel == gradient_avx2)
+    return i8 ? gradient_i8_avx2 : gradient_i16_avx2;
+#endif
+#ifdef HAVE_NEON_KERNEL
+  if (kernel == gradient_neon)
+    return i8 ? gradient_i8_neon : gradient_i16_neon;
+#endif
+  (void)kernel;
+  return i8 ? gradient_i8_scalar : gradient_i16_scalar;
+}
+
+// Kernel used by gradient(), chosen once at startup
+static GradientKernel gradient_kernel = gradient_scalar;
+
+// Kernel used by gradient() on narrow columns, chosen after loading
+static NarrowKernel narrow_kernel = gradient_i16_scalar;
+
+/*
+ * Fused cost kernels
+ *
+ * The same passes as the double precision kernels that also sum the
+ * squared errors, so the cost comes out of the gradient pass: the residual
+ * w*x + b - y is computed once and feeds dj_dw, dj_db and the squared
+ * error. Each kernel keeps the accumulators, step and tail of its gradient
+ * kernel, so the gradient it returns is bit-identical and logging the cost
+ * does not change the training. They are only run on iterations that log.
+ */
+typedef Weights (*CostKernel)(const void *x, const void *y, size_t n,
+                              double w, double b, double *sse);
+
+// Portable kernel over elements of type T, see gradient_scalar()
+#define COST_SCALAR_KERNEL(name, T)                                            \
+  static Weights name(const void *px, const void *py, size_t n, double w,     \
+                      double b, double *sse) {                                 \
+    const T *x = px, *y = py;                                                  \
+    double dw[4] = {0}, db[4] = {0}, se[4] = {0};                              \
+    size_t i = 0;                                                              \
+    for (; i + 4 <= n; i += 4) {                                               \
+      for (int k = 0; k < 4; k++) {                                            \
+        double err = w * x[i + k] + b - y[i + k];                              \
+        dw[k] += err * x[i + k];                                               \
+        db[k] += err;                                                          \
+        se[k] += err * err;                                                    \
+      }                                                                        \
+    }                                                                          \
+    for (; i < n; i++) {                                                       \
+      double err = w * x[i] + b - y[i];                                        \
+      dw[0] += err * x[i];                                                     \
+      db[0] += err;                                                            \
+      se[0] += err * err;                                                      \
+    }                                                                          \
+    *sse = (se[0] + se[1]) + (se[2] + se[3]);                                  \
+    Weights sums = {.w = (dw[0] + dw[1]) + (dw[2] + dw[3]),                    \
+                    .b = (db[0] + db[1]) + (db[2] + db[3])};                   \
+    return sums;                                                               \
+  }
+
+COST_SCALAR_KERNEL(gradient_cost_scalar, int)
+COST_SCALAR_KERNEL(gradient_cost_i16_scalar, int16_t)
+COST_SCALAR_KERNEL(gradient_cost_i8_scalar, int8_t)
+
+#ifdef HAVE_X86_KERNELS
+// Load 4 (SSE) or 8 (AVX) int32 elements at p, the int32 "widening"
+#define WIDEN4_I32(p) _mm_loadu_si128((const __m128i *)(p))
+#define WIDEN8_I32(p) _mm256_loadu_si256((const __m256i *)(p))
+
+// AVX2 kernel over elements of type T, see gradient_avx2()
+#define COST_AVX2_KERNEL(name, T, widen, tail_kernel)                          \
+  __attribute__((target("avx2,fma"))) static Weights name(                     \
+      const void *px, const void *py, size_t n, double w, double b,            \
+      double *sse) {                                                           \
+    const T *x = px, *y = py;                                                  \
+    __m256d vw = _mm256_set1_pd(w), vb = _mm256_set1_pd(b);                    \
+    __m256d dw[4], db[4], se[4];                                               \
+    for (int k = 0; k < 4; k++)                                                \
+      dw[k] = db[k] = se[k] = _mm256_setzero_pd();                             \
+                                                                               \
+    size_t i = 0;                                                              \
+    for (; i + 16 <= n; i += 16) {                                             \
+      for (int k = 0; k < 4; k++) {                                            \
+        __m256d vx = _mm256_cvtepi32_pd(widen(x + i + 4 * k));                 \
+        __m256d vy = _mm256_cvtepi32_pd(widen(y + i + 4 * k));                 \
+        __m256d err = _mm256_sub_pd(_mm256_fmadd_pd(vw, vx, vb), vy);          \
+        dw[k] = _mm256_fmadd_pd(err, vx, dw[k]);                               \
+        db[k] = _mm256_add_pd(db[k], err);                                     \
+        se[k] = _mm256_fmadd_pd(err, err, se[k]);                              \
+      }                                                                        \
+    }                                                                          \
+                                                                               \
+    __m256d vdw = _mm256_add_pd(_mm256_add_pd(dw[0], dw[1]),                   \
+                                _mm256_add_pd(dw[2], dw[3]));                  \
+    __m256d vdb = _mm256_add_pd(_mm256_add_pd(db[0], db[1]),                   \
+                                _mm256_add_pd(db[2], db[3]));                  \
+    __m256d vse = _mm256_add_pd(_mm256_add_pd(se[0], se[1]),                   \
+                                _mm256_add_pd(se[2], se[3]));                  \
+    double lanes_dw[4], lanes_db[4], lanes_se[4];                              \
+    _mm256_storeu_pd(lanes_dw, vdw);                                           \
+    _mm256_storeu_pd(lanes_db, vdb);                                           \
+    _mm256_storeu_pd(lanes_se, vse);                                           \
+                                                                               \
+    double tail_se;                                                            \
+    Weights tail = tail_kernel(x + i, y + i, n - i, w, b, &tail_se);           \
+    *sse = (lanes_se[0] + lanes_se[1]) + (lanes_se[2] + lanes_se[3]) +         \
+           tail_se;                                                            \
+    Weights sums = {.w = (lanes_dw[0] + lanes_dw[1]) +                         \
+                         (lanes_dw[2] + lanes_dw[3]) + tail.w,                 \
+                    .b = (lanes_db[0] + lanes_db[1]) +                         \
+                         (lanes_db[2] + lanes_db[3]) + tail.b};                \
+    return sums;                                                               \
+  }
+
+// AVX-512 kernel over elements of type T, see gradient_avx512()
+#define COST_AVX512_KERNEL(name, T, widen, tail_kernel)                        \
+  __attribute__((target("avx512f"))) static Weights name(                      \
+      const void *px, const void *py, size_t n, double w, double b,            \
+      double *sse) {                                                           \
+    const T *x = px, *y = py;                                                  \
+    __m512d vw = _mm512_set1_pd(w), vb = _mm512_set1_pd(b);                    \
+    __m512d dw[4], db[4], se[4];                                               \
+    for (int k = 0; k < 4; k++)                                                \
+      dw[k] = db[k] = se[k] = _mm512_setzero_pd();                             \
+                                                                               \
+    size_t i = 0;                                                              \
+    for (; i + 32 <= n; i += 32) {                                             \
+      for (int k = 0; k < 4; k++) {                                            \
+        __m512d vx = _mm512_cvtepi32_pd(widen(x + i + 8 * k));                 \
+        __m512d vy = _mm512_cvtepi32_pd(widen(y + i + 8 * k));                 \
+        __m512d err = _mm512_sub_pd(_mm512_fmadd_pd(vw, vx, vb), vy);          \
+        dw[k] = _mm512_fmadd_pd(err, vx, dw[k]);                               \
+        db[k] = _mm512_add_pd(db[k], err);                                     \
+        se[k] = _mm512_fmadd_pd(err, err, se[k]);                              \
+      }                                                                        \
+    }                                                                          \
+                                                                               \
+    double tail_se;                                                            \
+    Weights tail = tail_kernel(x + i, y + i, n - i, w, b, &tail_se);           \
+    *sse = _mm512_reduce_add_pd(_mm512_add_pd(_mm512_add_pd(se[0], se[1]),     \
+                                              _mm512_add_pd(se[2], se[3]))) +  \
+           tail_se;                                                            \
+    Weights sums = {                                                           \
+        .w = _mm512_reduce_add_pd(_mm512_add_pd(                               \
+                 _mm512_add_pd(dw[0], dw[1]), _mm512_add_pd(dw[2], dw[3]))) + \
+             tail.w,                                                           \
+        .b = _mm512_reduce_add_pd(_mm512_add_pd(                               \
+                 _mm512_add_pd(db[0], db[1]), _mm512_add_pd(db[2], db[3]))) + \
+             tail.b};                                                          \
+    return sums;                                                               \
+  }
+
+COST_AVX2_KERNEL(gradient_cost_avx2, int, WIDEN4_I32, gradient_cost_scalar)
+COST_AVX2_KERNEL(gradient_cost_i16_avx2, int16_t, WIDEN4_I16,
+                 gradient_cost_i16_scalar)
+COST_AVX2_KERNEL(gradient_cost_i8_avx2, int8_t, WIDEN4_I8,
+                 gradient_cost_i8_scalar)
+COST_AVX512_KERNEL(gradient_cost_avx512, int, WIDEN8_I32,
+                   gradient_cost_scalar)
+COST_AVX512_KERNEL(gradient_cost_i16_avx512, int16_t, WIDEN8_I16,
+                   gradient_cost_i16_scalar)
+COST_AVX512_KERNEL(gradient_cost_i8_avx512, int8_t, WIDEN8_I8,
+                   gradient_cost_i8_scalar)
+#endif
+
+#ifdef HAVE_NEON_KERNEL
+// Load the 8 int32 elements at p as two vectors of 4
+#define WIDEN8_I32_NEON(p, h) vld1q_s32((p) + 4 * (h))
+
+// NEON kernel over elements of type T, see gradient_neon()
+#define COST_NEON_KERNEL(name, T, widen, tail_kernel)                          \
+  static Weights name(const void *px, const void *py, size_t n, double w,     \
+                      double b, double *sse) {                                 \
+    const T *x = px, *y = py;                                                  \
+    float64x2_t vw = vdupq_n_f64(w), vb = vdupq_n_f64(b);                      \
+    float64x2_t dw[4], db[4], se[4];                                           \
+    for (int k = 0; k < 4; k++)                                                \
+      dw[k] = db[k] = se[k] = vdupq_n_f64(0);                                  \
+                                                                               \
+    size_t i = 0;                                                              \
+    for (; i + 8 <= n; i += 8) {                                               \
+      for (int k = 0; k < 2; k++) {                                            \
+        int32x4_t ix = widen(x + i, k);                                        \
+        int32x4_t iy = widen(y + i, k);                                        \
+        float64x2_t vx[2] = {vcvtq_f64_s64(vmovl_s32(vget_low_s32(ix))),       \
+                             vcvtq_f64_s64(vmovl_high_s32(ix))};               \
+        float64x2_t vy[2] = {vcvtq_f64_s64(vmovl_s32(vget_low_s32(iy))),       \
+                             vcvtq_f64_s64(vmovl_high_s32(iy))};               \
+        for (int h = 0; h < 2; h++) {                                          \
+          float64x2_t err = vsubq_f64(vfmaq_f64(vb, vw, vx[h]), vy[h]);        \
+          dw[2 * k + h] = vfmaq_f64(dw[2 * k + h], err, vx[h]);                \
+          db[2 * k + h] = vaddq_f64(db[2 * k + h], err);                       \
+          se[2 * k + h] = vfmaq_f64(se[2 * k + h], err, err);                  \
+        }                                                                      \
+      }                                                                        \
+    }                                                                          \
+                                                                               \
+    double tail_se;                                                            \
+    Weights tail = tail_kernel(x + i, y + i, n - i, w, b, &tail_se);           \
+    *sse = vaddvq_f64(vaddq_f64(vaddq_f64(se[0], se[1]),                       \
+                                vaddq_f64(se[2], se[3]))) +                    \
+           tail_se;                                                            \
+    Weights sums = {.w = vaddvq_f64(vaddq_f64(vaddq_f64(dw[0], dw[1]),         \
+                                              vaddq_f64(dw[2], dw[3]))) +      \
+                         tail.w,                                               \
+                    .b = vaddvq_f64(vaddq_f64(vaddq_f64(db[0], db[1]),         \
+                                              vaddq_f64(db[2], db[3]))) +      \
+                         tail.b};                                              \
+    return sums;                                                               \
+  }
+
+COST_NEON_KERNEL(gradient_cost_neon, int, WIDEN8_I32_NEON,
+                 gradient_cost_scalar)
+COST_NEON_KERNEL(gradient_cost_i16_neon, int16_t, WIDEN8_I16_NEON,
+                 gradient_cost_i16_scalar)
+COST_NEON_KERNEL(gradient_cost_i8_neon, int8_t, WIDEN8_I8_NEON,
+                 gradient_cost_i8_scalar)
+#endif
+
+/**
+ * Look up the fused cost kernel matching a double precision kernel and an
+ * element type.
+ *
+ * @param kernel Kernel returned by select_precision().
+ * @param type   Element type of the columns.
+ * @return CostKernel - The kernel of the same instruction set, NULL for the
+ *                      single and mixed precision kernels, which have none.
+ */
+static CostKernel select_cost_kernel(GradientKernel kernel, ColumnType type) {
+  int i = type;
+#ifdef HAVE_X86_KERNELS
+  static const CostKernel avx512[] = {gradient_cost_avx512,
+                                      gradient_cost_i16_avx512,
+                                      gradient_cost_i8_avx512};
+  static const CostKernel avx2[] = {gradient_cost_avx2, gradient_cost_i16_avx2,
+                                    gradient_cost_i8_avx2};
+  if (kernel == gradient_avx512)
+    return avx512[i];
+  if (kernel == gradient_avx2)
+    return avx2[i];
+#endif
+#ifdef HAVE_NEON_KERNEL
+  static const CostKernel neon[] = {gradient_cost_neon, gradient_cost_i16_neon,
+                                    gradient_cost_i8_neon};
+  if (kernel == gradient_neon)
+    return neon[i];
+#endif
+  static const CostKernel scalar[] = {gradient_cost_scalar,
+                                      gradient_cost_i16_scalar,
+                                      gradient_cost_i8_scalar};
+  return kernel == gradient_scalar ? scalar[i] : NULL;
+}
+
+// Kernel used by gradient_cost(), chosen after loading, NULL if none fits
+static CostKernel cost_kernel = NULL;
+
+/*
+ * Thread pool
+ *
+ * The workers are started once and then parked on a barrier between tasks,
+ * so running a task costs two barrier crossings instead of a thread create
+ * and join. The calling thread takes part in every task as worker 0.
+ */
+
+// Number of busy-wait rounds before a waiting thread starts yielding
+#define SPIN_LIMIT 256
+
+// Hint to the CPU that the thread is busy-waiting
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax() _mm_pause()
+#elif defined(__aarch64__)
+#define cpu_relax() __asm__ volatile("yield")
+#else
+#define cpu_relax() ((void)0)
+#endif
+
+// Sense-reversing barrier, all waiting threads spin on one shared flag
+typedef struct {
+  atomic_int count; // Number of threads that still have to arrive
+  atomic_int sense; // Flipped by the last thread to open the barrier
+  int nthreads;     // Number of threads taking part
+} Barrier;
+
+/**
+ * Wait until all threads have arrived at the barrier.
+ *
+ * @param bar         Pointer to the barrier.
+ * @param local_sense Pointer to the calling thread's own sense flag.
+ */
+static void barrier_wait(Barrier *bar, int *local_sense) {
+  int sense = !*local_sense;
+  *local_sense = sense;
+  if (atomic_fetch_sub(&bar->count, 1) == 1) {
+    // Last one in: reset the count for the next round and release the others
+    atomic_store(&bar->count, bar->nthreads);
+    atomic_store(&bar->sense, sense);
+    return;
+  }
+  for (int spins = 0; atomic_load(&bar->sense) != sense; spins++) {
+    if (spins < SPIN_LIMIT)
+      cpu_relax();
+    else
+      sched_yield(); // Do not starve the thread we are waiting for
+  }
+}
+
+// Task run by every thread of the pool, tid is in 0..nthreads-1
+typedef void (*PoolTask)(void *ctx, int tid, int nthreads);
+
+// Structure to hold a pool of persistent worker threads
+typedef struct {
+  pthread_t *threads; // Worker threads 1..nthreads-1
+  int nthreads;       // Number of threads including the caller
+  Barrier barrier;    // Crossed once to start a task and once to finish it
+  int sense;          // Sense flag of the calling thread
+  PoolTask task;      // Current task, NULL asks the workers to exit
+  void *ctx;          // Argument of the current task
+} ThreadPool;
+
+// Argument of a worker thread
+typedef struct {
+  ThreadPool *pool;
+  int tid;
+} PoolWorker;
+
+// Pool used by gradient(), a single thread runs every task inline
+static ThreadPool thread_pool = {.nthreads = 1};
+
+/**
+ * Main loop of a worker thread: wait for a task, run it, report completion.
+ */
+static void *pool_worker(void *arg) {
+  PoolWorker worker = *(PoolWorker *)arg;
+  ThreadPool *pool = worker.pool;
+  int sense = 0;
+  free(arg);
+
+  for (;;) {
+    barrier_wait(&pool->barrier, &sense);
+    if (pool->task == NULL)
+      break;
+    pool->task(pool->ctx, worker.tid, pool->nthreads);
+    barrier_wait(&pool->barrier, &sense);
+  }
+  return NULL;
+}
+
+/**
+ * Start the worker threads of a pool.
+ *
+ * @param pool     Pointer to the pool to start.
+ * @param nthreads Number of threads including the calling thread.
+ * @return int - 0 on success, 1 if the threads could not be started.
+ */
+static int pool_start(ThreadPool *pool, int nthreads) {
+  pool->nthreads = nthreads;
+  pool->sense = 0;
+  pool->task = NULL;
+  atomic_init(&pool->barrier.count, nthreads);
+  atomic_init(&pool->barrier.sense, 0);
+  pool->barrier.nthreads = nthreads;
+  if (nthreads == 1)
+    return 0;
 
-  // Exit successfully
+  pool->threads = malloc((nthreads - 1) * sizeof(*pool->threads));
+  if (pool->threads == NULL)
+    return 1;
+  for (int t = 1; t < nthreads; t++) {
+    PoolWorker *worker = malloc(sizeof(*worker));
+    if (worker != NULL) {
+      worker->pool = pool;
+      worker->tid = t;
+    }
+    if (worker == NULL ||
+        pthread_create(&pool->threads[t - 1], NULL, pool_worker, worker) != 0) {
+      // Keep the threads that did start, the pool simply runs narrower. The
+      // missing threads are counted as arrived; the round cannot open before
+      // the caller arrives, so the smaller count is in place by then.
+      free(worker);
+      pool->nthreads = pool->barrier.nthreads = t;
+      atomic_fetch_sub(&pool->barrier.count, nthreads - t);
+      if (t == 1)
+        free(pool->threads);
+      return t == 1 ? 1 : 0;
+    }
+  }
   return 0;
 }
+
+/**
+ * Run a task on every thread of the pool and wait for all of them.
+ *
+ * @param pool Pointer to the pool.
+ * @param task Task to run, called once per thread.
+ * @param ctx  Argument passed to the task.
+ */
+static void pool_run(ThreadPool *pool, PoolTask task, void *ctx) {
+  if (pool->nthreads == 1) {
+    task(ctx, 0, 1);
+    return;
+  }
+  pool->task = task;
+  pool->ctx = ctx;
+  barrier_wait(&pool->barrier, &pool->sense);
+  task(ctx, 0, pool->nthreads);
+  barrier_wait(&pool->barrier, &pool->sense);
+}
+
+/**
+ * Stop and join the worker threads of a pool.
+ *
+ * @param pool Pointer to the pool.
+ */
+static void pool_stop(ThreadPool *pool) {
+  if (pool->nthreads > 1) {
+    pool->task = NULL;
+    barrier_wait(&pool->barrier, &pool->sense);
+    for (int t = 1; t < pool->nthreads; t++)
+      pthread_join(pool->threads[t - 1], NULL);
+    free(pool->threads);
+  }
+  pool->nthreads = 1;
+}
+
+// Padded per-thread result, keeps each partial sum on its own cache line
+typedef struct {
+  Weights sums;
+  double sse; // Sum of the squared errors, only set by the cost kernels
+  char pad[64 - sizeof(Weights) - sizeof(double)];
+} PartialSums;
+
+// Gradient task shared by all threads of the pool
+typedef struct {
+  const void *x, *y;     // Data to reduce
+  ColumnType type;       // Element type of x and y
+  size_t n;              // Number of input-target pairs
+  double w, b;           // Current weights
+  int cost;              // Also sum the squared errors with cost_kernel
+  PartialSums *partials; // One result slot per thread (or per range)
+  size_t blocks;         // Deterministic: blocks of REDUCE_BLOCK pairs
+  size_t span;           // Deterministic: blocks per range, a power of two
+  size_t ranges;         // Deterministic: number of ranges
+} GradientTask;
+
+/**
+ * Sum the gradient over the pairs [lo, hi) with the selected kernel.
+ */
+static void gradient_range(const GradientTask *task, size_t lo, size_t hi,
+                           PartialSums *out) {
+  size_t size = column_sizes[task->type];
+  const char *x = (const char *)task->x + lo * size;
+  const char *y = (const char *)task->y + lo * size;
+  if (task->cost)
+    out->sums = cost_kernel(x, y, hi - lo, task->w, task->b, &out->sse);
+  else
+    out->sums = task->type == COLUMN_INT32
+                    ? gradient_kernel((const int *)x, (const int *)y,
+                                      hi - lo, task->w, task->b)
+                    : narrow_kernel(x, y, hi - lo, task->w, task->b);
+}
+
+/**
+ * Sum the gradient over this thread's contiguous chunk of the data.
+ */
+static void gradient_task(void *ctx, int tid, int nthreads) {
+  GradientTask *task = ctx;
+  size_t lo = task->n * tid / nthreads;
+  size_t hi = task->n * (tid + 1) / nthreads;
+  gradient_range(task, lo, hi, &task->partials[tid]);
+}
+
+/*
+ * Deterministic reduction
+ *
+ * The chunks of gradient_task() depend on the thread count, and so do the
+ * rounding errors of their sums. With the deterministic setting the pairs
+ * are cut into fixed blocks of REDUCE_BLOCK pairs instead, every block is
+ * summed by the kernel on its own and the block sums are added up along a
+ * fixed pairwise tree (neighbours first, then neighbouring pairs, ...),
+ * whose shape only depends on the number of blocks. The result is the same
+ * for every thread count, and across the blocks the rounding error only
+ * grows with the logarithm of their number.
+ *
+ * The threads split the blocks into ranges of a power of two blocks, each
+ * range a subtree of the pairwise tree. A thread reduces its ranges with a
+ * carry stack (a binary counter: merging the two newest subtrees whenever
+ * they have the same size), so no block sums are stored, and the range
+ * sums are then added with the same tree. Ranges are small enough for
+ * every thread to get several, which keeps the load balanced.
+ */
+
+// Pairs per block of a deterministic reduction
+#define REDUCE_BLOCK 4096
+
+// Least number of ranges per thread of a deterministic reduction (the
+// number of range slots is 8 times the number of threads)
+#define REDUCE_RANGES 4
+
+// Reduce every gradient in fixed blocks, see Deterministic reduction
+static int deterministic = 0;
+
+// One slot per range of a deterministic reduction, 8 per thread
+static PartialSums *reduce_partials = NULL;
+
+/**
+ * Add b into a, the sums and the squared errors.
+ */
+static inline void partials_add(PartialSums *a, const PartialSums *b) {
+  a->sums.w += b->sums.w;
+  a->sums.b += b->sums.b;
+  a->sse += b->sse;
+}
+
+/**
+ * Add up count sums along the fixed pairwise tree, into s[0].
+ */
+static void reduce_pairwise(PartialSums *s, size_t count) {
+  for (size_t step = 1; step < count; step *= 2)
+    for (size_t i = 0; i + step < count; i += 2 * step)
+      partials_add(&s[i], &s[i + step]);
+}
+
+/**
+ * Reduce this thread's ranges of blocks, each into its own slot.
+ */
+static void reduce_task(void *ctx, int tid, int nthreads) {
+  GradientTask *task = ctx;
+  size_t first = task->ranges * tid / nthreads;
+  size_t last = task->ranges * (tid + 1) / nthreads;
+  for (size_t r = first; r < last; r++) {
+    size_t lo = r * task->span;
+    size_t hi = lo + task->span < task->blocks ? lo + task->span : task->blocks;
+
+    // The stack holds subtrees of decreasing size, block j completes the
+    // subtrees of the trailing one bits of j
+    PartialSums stack[64];
+    int top = 0;
+    for (size_t j = 0; j < hi - lo; j++) {
+      size_t start = (lo + j) * REDUCE_BLOCK;
+      size_t end = start + REDUCE_BLOCK < task->n ? start + REDUCE_BLOCK
+                                                  : task->n;
+      PartialSums sum = {.sse = 0};
+      gradient_range(task, start, end, &sum);
+      for (size_t c = j; c & 1; c >>= 1) {
+        partials_add(&stack[top - 1], &sum);
+        sum = stack[--top];
+      }
+      stack[top++] = sum;
+    }
+
+    // A short last range ends like the tree does, smallest subtrees first
+    while (top > 1) {
+      partials_add(&stack[top - 2], &stack[top - 1]);
+      top--;
+    }
+    task->partials[r] = stack[0];
+  }
+}
+
+// Per-thread result slots of the gradient task, one per pool thread
+static PartialSums *gradient_partials = NULL;
+
+/**
+ * Sum the partial derivatives, and with sse the squared errors, over every
+ * data point. The work is split the same way with and without sse.
+ */
+static Weights gradient_sums(const IntVec *x, const IntVec *y,
+                             const Weights *ws, double *sse) {
+  Weights features;
+  if (deterministic) {
+    GradientTask task = {.x = x->data,
+                         .y = y->data,
+                         .type = x->type,
+                         .n = x->size,
+                         .w = ws->w,
+                         .b = ws->b,
+                         .cost = sse != NULL,
+                         .partials = reduce_partials,
+                         .blocks = (x->size + REDUCE_BLOCK - 1) / REDUCE_BLOCK,
+                         .span = 1};
+    size_t share = REDUCE_RANGES * thread_pool.nthreads;
+    while (task.span * 2 * share <= task.blocks)
+      task.span *= 2;
+    task.ranges = (task.blocks + task.span - 1) / task.span;
+    if (task.ranges == 0) {
+      if (sse != NULL)
+        *sse = 0;
+      return (Weights){.w = 0, .b = 0};
+    }
+    pool_run(&thread_pool, reduce_task, &task);
+    reduce_pairwise(reduce_partials, task.ranges);
+    if (sse != NULL)
+      *sse = reduce_partials[0].sse;
+    return reduce_partials[0].sums;
+  }
+  if (thread_pool.nthreads == 1)
+    features = sse != NULL ? cost_kernel(x->data, y->data, x->size, ws->w,
+                                         ws->b, sse)
+               : x->type == COLUMN_INT32
+                   ? gradient_kernel(x->data, y->data, x->size, ws->w, ws->b)
+                   : narrow_kernel(x->data, y->data, x->size, ws->w, ws->b);
+  else {
+    // Every thread reduces one chunk, the partials are combined in thread
+    // order so a given thread count always produces the same result
+    GradientTask task = {.x = x->data,
+                         .y = y->data,
+                         .type = x->type,
+                         .n = x->size,
+                         .w = ws->w,
+                         .b = ws->b,
+                         .cost = sse != NULL,
+                         .partials = gradient_partials};
+    pool_run(&thread_pool, gradient_task, &task);
+    features = gradient_partials[0].sums;
+    for (int t = 1; t < thread_pool.nthreads; t++) {
+      features.w += gradient_partials[t].sums.w;
+      features.b += gradient_partials[t].sums.b;
+    }
+    if (sse != NULL) {
+      *sse = gradient_partials[0].sse;
+      for (int t = 1; t < thread_pool.nthreads; t++)
+        *sse += gradient_partials[t].sse;
+    }
+  }
+  return features;
+}
+
+/**
+ * Compute the gradient of the cost function for linear regression.
+ *
+ * @param x  Pointer to the input vector of independent variables.
+ * @param y  Pointer to the output vector of targets.
+ * @param ws Pointer to the current weights (w, b) of the model.
+ * @return Weights - The gradients for the weight and bias (dj_dw, dj_db).
+ */
+Weights gradient(const IntVec *x, const IntVec *y, const Weights *ws) {
+  Weights features = gradient_sums(x, y, ws, NULL);
+
+  // Average the gradients for each data point
+  features.w = features.w / x->size;
+  features.b = features.b / x->size;
+  return features;
+}
+
+/**
+ * Compute the cost (half the mean squared error) with a pass over the data.
+ *
+ * @param x  Pointer to the input vector of independent variables.
+ * @param y  Pointer to the output vector of targets.
+ * @param ws Pointer to the weights (w, b) of the model.
+ * @return double - The cost of the weights.
+ */
+double data_cost(const IntVec *x, const IntVec *y, const Weights *ws) {
+  double sse = 0;
+  for (size_t i = 0; i < x->size; i++) {
+    double err = ws->w * intvec_at(x, i) + ws->b - intvec_at(y, i);
+    sse += err * err;
+  }
+  return sse / (2 * x->size);
+}
+
+/**
+ * Compute the gradient and the cost at the same weights in one data pass.
+ *
+ * The gradient is bit-identical to gradient(). Without a fused kernel for
+ * the selected precision the cost takes a second pass.
+ *
+ * @param x    Pointer to the input vector of independent variables.
+ * @param y    Pointer to the output vector of targets.
+ * @param ws   Pointer to the current weights (w, b) of the model.
+ * @param cost Pointer receiving the cost of the weights.
+ * @return Weights - The gradients for the weight and bias (dj_dw, dj_db).
+ */
+Weights gradient_cost(const IntVec *x, const IntVec *y, const Weights *ws,
+                      double *cost) {
+  if (cost_kernel == NULL) {
+    *cost = data_cost(x, y, ws);
+    return gradient(x, y, ws);
+  }
+  double sse;
+  Weights features = gradient_sums(x, y, ws, &sse);
+  features.w = features.w / x->size;
+  features.b = features.b / x->size;
+  *cost = sse / (2 * x->size);
+  return features;
+}
+
+/*
+ * Sweep gradient
+ *
+ * A hyperparameter sweep trains K univariate models on the same data. One
+ * pass converts a block of pairs to doubles once and then runs every model
+ * over it while it is in the L1 cache, with the models rather than the
+ * pairs spread across the SIMD lanes: each lane holds one model's (w, b)
+ * and every pair is broadcast to all lanes. The memory traffic of a pass is
+ * then shared by all K models.
+ */
+
+// Pairs converted and reused by all models at a time, 16 KiB of doubles
+#define SWEEP_BLOCK 1024
+
+// Adds the unaveraged gradients of k models over n <= SWEEP_BLOCK pairs to
+// dw and db
+typedef void (*SweepKernel)(const int *x, const int *y, size_t n,
+                            const double *w, const double *b, double *dw,
+                            double *db, size_t k);
+
+/**
+ * Run k models over a block of converted pairs, one model at a time. Also
+ * used for the models the NEON kernel leaves.
+ */
+static void sweep_models_scalar(const double *x, const double *y, size_t n,
+                                const double *w, const double *b, double *dw,
+                                double *db, size_t k) {
+  for (size_t m = 0; m < k; m++) {
+    double sw[4] = {0}, sb[4] = {0}; // Four independent accumulator chains
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4)
+      for (int j = 0; j < 4; j++) {
+        double err = w[m] * x[i + j] + b[m] - y[i + j];
+        sw[j] += err * x[i + j];
+        sb[j] += err;
+      }
+    for (; i < n; i++) {
+      double err = w[m] * x[i] + b[m] - y[i];
+      sw[0] += err * x[i];
+      sb[0] += err;
+    }
+    dw[m] += (sw[0] + sw[1]) + (sw[2] + sw[3]);
+    db[m] += (sb[0] + sb[1]) + (sb[2] + sb[3]);
+  }
+}
+
+/**
+ * Portable sweep kernel.
+ */
+static void sweep_scalar(const int *x, const int *y, size_t n,
+                         const double *w, const double *b, double *dw,
+                         double *db, size_t k) {
+  double xd[SWEEP_BLOCK], yd[SWEEP_BLOCK];
+  for (size_t i = 0; i < n; i++) {
+    xd[i] = x[i];
+    yd[i] = y[i];
+  }
+  sweep_models_scalar(xd, yd, n, w, b, dw, db, k);
+}
+
+#ifdef HAVE_X86_KERNELS
+/**
+ * Run k models over a block of converted pairs, 4 models per vector with 2
+ * accumulators each. The last vector is masked, so every model is covered.
+ */
+__attribute__((target("avx2,fma"))) static void
+sweep_models_avx2(const double *x, const double *y, size_t n, const double *w,
+                  const double *b, double *dw, double *db, size_t k) {
+  for (size_t m = 0; m < k; m += 4) {
+    // Lanes past the last model load zeros and are never stored
+    __m256i mask = _mm256_cmpgt_epi64(_mm256_set1_epi64x(k - m),
+                                      _mm256_setr_epi64x(0, 1, 2, 3));
+    __m256d vw = _mm256_maskload_pd(w + m, mask);
+    __m256d vb = _mm256_maskload_pd(b + m, mask);
+    // Two pairs per step, each with its own accumulators. Named variables
+    // rather than arrays, GCC keeps those in registers.
+    __m256d sw0 = _mm256_setzero_pd(), sw1 = sw0, sb0 = sw0, sb1 = sw0;
+    size_t i = 0;
+    for (; i + 2 <= n; i += 2) {
+      __m256d x0 = _mm256_broadcast_sd(x + i);
+      __m256d x1 = _mm256_broadcast_sd(x + i + 1);
+      __m256d e0 = _mm256_sub_pd(_mm256_fmadd_pd(vw, x0, vb),
+                                 _mm256_broadcast_sd(y + i));
+      __m256d e1 = _mm256_sub_pd(_mm256_fmadd_pd(vw, x1, vb),
+                                 _mm256_broadcast_sd(y + i + 1));
+      sw0 = _mm256_fmadd_pd(e0, x0, sw0);
+      sw1 = _mm256_fmadd_pd(e1, x1, sw1);
+      sb0 = _mm256_add_pd(sb0, e0);
+      sb1 = _mm256_add_pd(sb1, e1);
+    }
+    if (i < n) {
+      __m256d x0 = _mm256_broadcast_sd(x + i);
+      __m256d e0 = _mm256_sub_pd(_mm256_fmadd_pd(vw, x0, vb),
+                                 _mm256_broadcast_sd(y + i));
+      sw0 = _mm256_fmadd_pd(e0, x0, sw0);
+      sb0 = _mm256_add_pd(sb0, e0);
+    }
+    __m256d tw = _mm256_add_pd(sw0, sw1), tb = _mm256_add_pd(sb0, sb1);
+    _mm256_maskstore_pd(
+        dw + m, mask, _mm256_add_pd(_mm256_maskload_pd(dw + m, mask), tw));
+    _mm256_maskstore_pd(
+        db + m, mask, _mm256_add_pd(_mm256_maskload_pd(db + m, mask), tb));
+  }
+}
+
+/**
+ * AVX2 sweep kernel: widen the block 4 pairs at a time, then run the models.
+ */
+__attribute__((target("avx2,fma"))) static void
+sweep_avx2(const int *x, const int *y, size_t n, const double *w,
+           const double *b, double *dw, double *db, size_t k) {
+  double xd[SWEEP_BLOCK], yd[SWEEP_BLOCK];
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    _mm256_storeu_pd(xd + i, _mm256_cvtepi32_pd(
+                                 _mm_loadu_si128((const __m128i *)(x + i))));
+    _mm256_storeu_pd(yd + i, _mm256_cvtepi32_pd(
+                                 _mm_loadu_si128((const __m128i *)(y + i))));
+  }
+  for (; i < n; i++) {
+    xd[i] = x[i];
+    yd[i] = y[i];
+  }
+  sweep_models_avx2(xd, yd, n, w, b, dw, db, k);
+  _mm256_zeroupper();
+}
+
+/**
+ * Run k models over a block of converted pairs, 8 models per vector with 2
+ * accumulators each. The last vector is masked, so every model is covered.
+ */
+__attribute__((target("avx512f"))) static void
+sweep_models_avx512(const double *x, const double *y, size_t n,
+                    const double *w, const double *b, double *dw, double *db,
+                    size_t k) {
+  for (size_t m = 0; m < k; m += 8) {
+    // Lanes past the last model load zeros and are never stored
+    __mmask8 mask = k - m >= 8 ? 0xff : (1u << (k - m)) - 1;
+    __m512d vw = _mm512_maskz_loadu_pd(mask, w + m);
+    __m512d vb = _mm512_maskz_loadu_pd(mask, b + m);
+    // Two pairs per step, as in sweep_avx2()
+    __m512d sw0 = _mm512_setzero_pd(), sw1 = sw0, sb0 = sw0, sb1 = sw0;
+    size_t i = 0;
+    for (; i + 2 <= n; i += 2) {
+      __m512d x0 = _mm512_set1_pd(x[i]), x1 = _mm512_set1_pd(x[i + 1]);
+      __m512d e0 =
+          _mm512_sub_pd(_mm512_fmadd_pd(vw, x0, vb), _mm512_set1_pd(y[i]));
+      __m512d e1 = _mm512_sub_pd(_mm512_fmadd_pd(vw, x1, vb),
+                                 _mm512_set1_pd(y[i + 1]));
+      sw0 = _mm512_fmadd_pd(e0, x0, sw0);
+      sw1 = _mm512_fmadd_pd(e1, x1, sw1);
+      sb0 = _mm512_add_pd(sb0, e0);
+      sb1 = _mm512_add_pd(sb1, e1);
+    }
+    if (i < n) {
+      __m512d x0 = _mm512_set1_pd(x[i]);
+      __m512d e0 =
+          _mm512_sub_pd(_mm512_fmadd_pd(vw, x0, vb), _mm512_set1_pd(y[i]));
+      sw0 = _mm512_fmadd_pd(e0, x0, sw0);
+      sb0 = _mm512_add_pd(sb0, e0);
+    }
+    __m512d tw = _mm512_add_pd(sw0, sw1), tb = _mm512_add_pd(sb0, sb1);
+    _mm512_mask_storeu_pd(
+        dw + m, mask, _mm512_add_pd(_mm512_maskz_loadu_pd(mask, dw + m), tw));
+    _mm512_mask_storeu_pd(
+        db + m, mask, _mm512_add_pd(_mm512_maskz_loadu_pd(mask, db + m), tb));
+  }
+}
+
+/**
+ * AVX-512 sweep kernel: widen the block 8 pairs at a time, then run the
+ * models.
+ */
+__attribute__((target("avx512f"))) static void
+sweep_avx512(const int *x, const int *y, size_t n, const double *w,
+             const double *b, double *dw, double *db, size_t k) {
+  double xd[SWEEP_BLOCK], yd[SWEEP_BLOCK];
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    _mm512_storeu_pd(xd + i, _mm512_cvtepi32_pd(
+                                 _mm256_loadu_si256((const __m256i *)(x + i))));
+    _mm512_storeu_pd(yd + i, _mm512_cvtepi32_pd(
+                                 _mm256_loadu_si256((const __m256i *)(y + i))));
+  }
+  for (; i < n; i++) {
+    xd[i] = x[i];
+    yd[i] = y[i];
+  }
+  sweep_models_avx512(xd, yd, n, w, b, dw, db, k);
+  _mm256_zeroupper();
+}
+#endif
+
+#ifdef HAVE_NEON_KERNEL
+/**
+ * NEON sweep kernel: widen the block, then run 2 models per vector with 2
+ * accumulators each, the last odd model by the scalar loop.
+ */
+static void sweep_neon(const int *x, const int *y, size_t n, const double *w,
+                       const double *b, double *dw, double *db, size_t k) {
+  double xd[SWEEP_BLOCK], yd[SWEEP_BLOCK];
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    int32x4_t ix = vld1q_s32(x + i), iy = vld1q_s32(y + i);
+    vst1q_f64(xd + i, vcvtq_f64_s64(vmovl_s32(vget_low_s32(ix))));
+    vst1q_f64(xd + i + 2, vcvtq_f64_s64(vmovl_high_s32(ix)));
+    vst1q_f64(yd + i, vcvtq_f64_s64(vmovl_s32(vget_low_s32(iy))));
+    vst1q_f64(yd + i + 2, vcvtq_f64_s64(vmovl_high_s32(iy)));
+  }
+  for (; i < n; i++) {
+    xd[i] = x[i];
+    yd[i] = y[i];
+  }
+
+  size_t m = 0;
+  for (; m + 2 <= k; m += 2) {
+    float64x2_t vw = vld1q_f64(w + m), vb = vld1q_f64(b + m);
+    // Two pairs per step, as in sweep_models_avx2()
+    float64x2_t sw0 = vdupq_n_f64(0), sw1 = sw0, sb0 = sw0, sb1 = sw0;
+    for (i = 0; i + 2 <= n; i += 2) {
+      float64x2_t x0 = vdupq_n_f64(xd[i]), x1 = vdupq_n_f64(xd[i + 1]);
+      float64x2_t e0 = vsubq_f64(vfmaq_f64(vb, vw, x0), vdupq_n_f64(yd[i]));
+      float64x2_t e1 =
+          vsubq_f64(vfmaq_f64(vb, vw, x1), vdupq_n_f64(yd[i + 1]));
+      sw0 = vfmaq_f64(sw0, e0, x0);
+      sw1 = vfmaq_f64(sw1, e1, x1);
+      sb0 = vaddq_f64(sb0, e0);
+      sb1 = vaddq_f64(sb1, e1);
+    }
+    if (i < n) {
+      float64x2_t x0 = vdupq_n_f64(xd[i]);
+      float64x2_t e0 = vsubq_f64(vfmaq_f64(vb, vw, x0), vdupq_n_f64(yd[i]));
+      sw0 = vfmaq_f64(sw0, e0, x0);
+      sb0 = vaddq_f64(sb0, e0);
+    }
+    vst1q_f64(dw + m, vaddq_f64(vld1q_f64(dw + m), vaddq_f64(sw0, sw1)));
+    vst1q_f64(db + m, vaddq_f64(vld1q_f64(db + m), vaddq_f64(sb0, sb1)));
+  }
+  sweep_models_scalar(xd, yd, n, w + m, b + m, dw + m, db + m, k - m);
+}
+#endif
+
+/**
+ * Look up the sweep kernel of the same instruction set as a gradient
+ * kernel returned by select_kernel().
+ *
+ * @param kernel The selected gradient kernel.
+ * @return SweepKernel - The matching sweep kernel.
+ */
+static SweepKernel select_sweep_kernel(GradientKernel kernel) {
+#ifdef HAVE_X86_KERNELS
+  if (kernel == gradient_avx512)
+    return sweep_avx512;
+  if (kernel == gradient_avx2)
+    return sweep_avx2;
+#endif
+#ifdef HAVE_NEON_KERNEL
+  if (kernel == gradient_neon)
+    return sweep_neon;
+#endif
+  (void)kernel;
+  return sweep_scalar;
+}
+
+// Sweep gradient task shared by all threads of the pool
+typedef struct {
+  const int *x, *y;   // Data to reduce
+  size_t n;           // Number of input-target pairs
+  const double *w;    // Weight of every model
+  const double *b;    // Bias of every model
+  size_t k;           // Number of models
+  SweepKernel kernel; // Kernel of the selected instruction set
+  double *partials;   // One slot of stride doubles per thread, dw then db
+  size_t stride;      // 2 * k rounded up to whole cache lines
+} SweepTask;
+
+/**
+ * Sum the gradients of all models over this thread's chunk of the data.
+ */
+static void sweep_task(void *ctx, int tid, int nthreads) {
+  SweepTask *task = ctx;
+  size_t lo = task->n * tid / nthreads;
+  size_t hi = task->n * (tid + 1) / nthreads;
+  double *dw = task->partials + tid * task->stride, *db = dw + task->k;
+  memset(dw, 0, 2 * task->k * sizeof(*dw));
+
+  for (size_t i = lo; i < hi; i += SWEEP_BLOCK) {
+    size_t n = hi - i < SWEEP_BLOCK ? hi - i : SWEEP_BLOCK;
+    task->kernel(task->x + i, task->y + i, n, task->w, task->b, dw, db,
+                 task->k);
+  }
+}
+
+/**
+ * Compute the averaged gradients of k univariate models in one data pass.
+ *
+ * @param x    Pointer to the input vector of independent variables.
+ * @param y    Pointer to the output vector of targets.
+ * @param task Pointer to the task holding the models and the thread slots,
+ *             set up by the caller.
+ * @param dw   Pointer receiving the k weight gradients.
+ * @param db   Pointer receiving the k bias gradients.
+ */
+void sweep_gradient(const IntVec *x, const IntVec *y, SweepTask *task,
+                    double *dw, double *db) {
+  task->x = x->data;
+  task->y = y->data;
+  task->n = x->size;
+  pool_run(&thread_pool, sweep_task, task);
+
+  // Combine the slots in thread order and average
+  for (size_t m = 0; m < task->k; m++)
+    dw[m] = db[m] = 0;
+  for (int t = 0; t < thread_pool.nthreads; t++) {
+    const double *slot = task->partials + t * task->stride;
+    for (size_t m = 0; m < task->k; m++) {
+      dw[m] += slot[m];
+      db[m] += slot[task->k + m];
+    }
+  }
+  for (size_t m = 0; m < task->k; m++) {
+    dw[m] /= x->size;
+    db[m] /= x->size;
+  }
+}
+
+/*
+ * Prediction kernels
+ *
+ * A prediction kernel writes w*x + b for n inputs, reading the same int32
+ * columns as the gradient kernels. The product and the sum are rounded
+ * separately (no fused multiply-add), so every kernel writes exactly the
+ * predictions of the scalar one.
+ */
+typedef void (*PredictKernel)(const int *x, size_t n, double w, double b,
+                              double *out);
+
+/**
+ * Portable prediction kernel, also used for the tails of the vector kernels.
+ *
+ * @param x   Pointer to the inputs.
+ * @param n   Number of inputs.
+ * @param w   Weight of the model.
+ * @param b   Bias of the model.
+ * @param out Pointer receiving the n predictions.
+ */
+static void predict_scalar(const int *x, size_t n, double w, double b,
+                           double *out) {
+  for (size_t i = 0; i < n; i++) {
+    double wx = w * x[i]; // Rounded on its own, like the vector kernels
+    out[i] = wx + b;
+  }
+}
+
+#ifdef HAVE_X86_KERNELS
+/**
+ * AVX2 prediction kernel: 4 vectors of 4 doubles, 16 inputs per step.
+ */
+__attribute__((target("avx2"))) static void
+predict_avx2(const int *x, size_t n, double w, double b, double *out) {
+  __m256d vw = _mm256_set1_pd(w), vb = _mm256_set1_pd(b);
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16)
+    for (int k = 0; k < 4; k++) {
+      __m256d vx = _mm256_cvtepi32_pd(
+          _mm_loadu_si128((const __m128i *)(x + i + 4 * k)));
+      _mm256_storeu_pd(out + i + 4 * k,
+                       _mm256_add_pd(_mm256_mul_pd(vw, vx), vb));
+    }
+  predict_scalar(x + i, n - i, w, b, out + i);
+}
+
+/**
+ * AVX-512 prediction kernel: 4 vectors of 8 doubles, 32 inputs per step.
+ */
+__attribute__((target("avx512f"))) static void
+predict_avx512(const int *x, size_t n, double w, double b, double *out) {
+  __m512d vw = _mm512_set1_pd(w), vb = _mm512_set1_pd(b);
+  size_t i = 0;
+  for (; i + 32 <= n; i += 32)
+    for (int k = 0; k < 4; k++) {
+      __m512d vx = _mm512_cvtepi32_pd(
+          _mm256_loadu_si256((const __m256i *)(x + i + 8 * k)));
+      _mm512_storeu_pd(out + i + 8 * k,
+                       _mm512_add_pd(_mm512_mul_pd(vw, vx), vb));
+    }
+  predict_scalar(x + i, n - i, w, b, out + i);
+}
+#endif
+
+#ifdef HAVE_NEON_KERNEL
+/**
+ * NEON prediction kernel: 4 vectors of 2 doubles, 8 inputs per step.
+ */
+static void predict_neon(const int *x, size_t n, double w, double b,
+                         double *out) {
+  float64x2_t vw = vdupq_n_f64(w), vb = vdupq_n_f64(b);
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8)
+    for (int k = 0; k < 2; k++) {
+      int32x4_t ix = vld1q_s32(x + i + 4 * k);
+      float64x2_t lo = vcvtq_f64_s64(vmovl_s32(vget_low_s32(ix)));
+      float64x2_t hi = vcvtq_f64_s64(vmovl_high_s32(ix));
+      vst1q_f64(out + i + 4 * k, vaddq_f64(vmulq_f64(vw, lo), vb));
+      vst1q_f64(out + i + 4 * k + 2, vaddq_f64(vmulq_f64(vw, hi), vb));
+    }
+  predict_scalar(x + i, n - i, w, b, out + i);
+}
+#endif
+
+/**
+ * Look up the prediction kernel of the same instruction set as a gradient
+ * kernel returned by select_kernel().
+ *
+ * @param kernel The selected gradient kernel.
+ * @return PredictKernel - The matching prediction kernel.
+ */
+static PredictKernel select_predict_kernel(GradientKernel kernel) {
+#ifdef HAVE_X86_KERNELS
+  if (kernel == gradient_avx512)
+    return predict_avx512;
+  if (kernel == gradient_avx2)
+    return predict_avx2;
+#endif
+#ifdef HAVE_NEON_KERNEL
+  if (kernel == gradient_neon)
+    return predict_neon;
+#endif
+  (void)kernel;
+  return predict_scalar;
+}
+
+// Prediction kernel of the selected instruction set, see main()
+static PredictKernel predict_kernel = predict_scalar;
+
+// Smallest batch split across the pool, waking the threads costs more than
+// scoring fewer inputs on one
+#define PREDICT_PARALLEL_MIN (64 << 10)
+
+// Prediction task shared by all threads of the pool
+typedef struct {
+  const int *x; // Inputs to score
+  size_t n;     // Number of inputs
+  double w, b;  // Weights of the model
+  double *out;  // Predictions, one per input
+} PredictTask;
+
+/**
+ * Score this thread's contiguous chunk of the inputs.
+ */
+static void predict_task(void *ctx, int tid, int nthreads) {
+  PredictTask *task = ctx;
+  size_t lo = task->n * tid / nthreads;
+  size_t hi = task->n * (tid + 1) / nthreads;
+  predict_kernel(task->x + lo, hi - lo, task->w, task->b, task->out + lo);
+}
+
+/**
+ * Score a batch of inputs with a univariate model.
+ *
+ * @param x   Pointer to the input vector (int32 elements).
+ * @param ws  Pointer to the weights (w, b) of the model.
+ * @param out Pointer receiving one prediction per input.
+ */
+void predict(const IntVec *x, const Weights *ws, double *out) {
+  if (thread_pool.nthreads == 1 || x->size < PREDICT_PARALLEL_MIN)
+    predict_kernel(x->data, x->size, ws->w, ws->b, out);
+  else {
+    PredictTask task = {
+        .x = x->data, .n = x->size, .w = ws->w, .b = ws->b, .out = out};
+    pool_run(&thread_pool, predict_task, &task);
+  }
+}
+
+// Structure to hold the sufficient statistics of a univariate data set
+typedef struct {
+  double n;   // Number of data points
+  double sx;  // Sum of x
+  double sy;  // Sum of y
+  double sxx; // Sum of x*x
+  double sxy; // Sum of x*y
+  double syy; // Sum of y*y
+  double l1;  // Lasso penalty l1 |w| of the cost, the bias is not penalized
+  double l2;  // Ridge penalty l2 / 2 w^2 of the cost
+} SuffStats;
+
+/**
+ * Accumulate one input-target pair into the sufficient statistics.
+ *
+ * The pairs are integers, so every product is exact and the sums stay exact
+ * as long as they are below 2^53.
+ *
+ * @param st Pointer to the statistics to update.
+ * @param x  Input value.
+ * @param y  Target value.
+ */
+static inline void stats_add(SuffStats *st, int x, int y) {
+  st->n += 1;
+  st->sx += x;
+  st->sy += y;
+  st->sxx += (double)x * x;
+  st->sxy += (double)x * y;
+  st->syy += (double)y * y;
+}
+
+/**
+ * Take one input-target pair back out of the sufficient statistics.
+ *
+ * Exact for integer pairs that were added before, which lets a sliding
+ * window drop its oldest pairs without a rescan.
+ *
+ * @param st Pointer to the statistics to update.
+ * @param x  Input value.
+ * @param y  Target value.
+ */
+static inline void stats_remove(SuffStats *st, int x, int y) {
+  st->n -= 1;
+  st->sx -= x;
+  st->sy -= y;
+  st->sxx -= (double)x * x;
+  st->sxy -= (double)x * y;
+  st->syy -= (double)y * y;
+}
+
+/**
+ * Scale every sum of the sufficient statistics, i.e. reweight all pairs
+ * collected so far. A factor below 1 lets old data decay exponentially.
+ *
+ * @param st     Pointer to the statistics to update.
+ * @param factor Weight the existing pairs are multiplied by.
+ */
+static inline void stats_scale(SuffStats *st, double factor) {
+  st->n *= factor;
+  st->sx *= factor;
+  st->sy *= factor;
+  st->sxx *= factor;
+  st->sxy *= factor;
+  st->syy *= factor;
+}
+
+/**
+ * Add the pairs of other statistics (sign 1) or take them back out (sign
+ * -1). Exact for integer pairs, like stats_remove().
+ *
+ * @param st    Pointer to the statistics to update.
+ * @param other Pointer to the statistics of the other pairs.
+ * @param sign  1 to add the pairs, -1 to remove them.
+ */
+static inline void stats_merge(SuffStats *st, const SuffStats *other,
+                               double sign) {
+  st->n += sign * other->n;
+  st->sx += sign * other->sx;
+  st->sy += sign * other->sy;
+  st->sxx += sign * other->sxx;
+  st->sxy += sign * other->sxy;
+  st->syy += sign * other->syy;
+}
+
+/**
+ * Compute the gradient of the cost function from the sufficient statistics.
+ *
+ * Expanding the sums in gradient() gives
+ *   dj_dw = (w * sxx + b * sx - sxy) / n
+ *   dj_db = (w * sx  + b * n  - sy)  / n
+ * so every step costs O(1) instead of a pass over the data. The ridge
+ * penalty adds l2 * w to dj_dw, the lasso penalty has no gradient and is
+ * left to closed_form().
+ *
+ * @param st Pointer to the sufficient statistics of the data set.
+ * @param ws Pointer to the current weights (w, b) of the model.
+ * @return Weights - The gradients for the weight and bias (dj_dw, dj_db).
+ */
+Weights stats_gradient(const SuffStats *st, const Weights *ws) {
+  Weights features = {
+      .w = (ws->w * st->sxx + ws->b * st->sx - st->sxy) / st->n,
+      .b = (ws->w * st->sx + ws->b * st->n - st->sy) / st->n};
+  features.w += st->l2 * ws->w;
+  return features;
+}
+
+/**
+ * Compute the cost (half the mean squared error plus the penalties) from
+ * the statistics.
+ *
+ * @param st Pointer to the sufficient statistics of the data set.
+ * @param ws Pointer to the weights (w, b) of the model.
+ * @return double - The cost of the weights.
+ */
+double stats_cost(const SuffStats *st, const Weights *ws) {
+  double sse = ws->w * ws->w * st->sxx + 2 * ws->w * ws->b * st->sx +
+               ws->b * ws->b * st->n - 2 * ws->w * st->sxy -
+               2 * ws->b * st->sy + st->syy;
+  // Cancellation can push an almost perfect fit slightly below zero
+  return (sse > 0 ? sse / (2 * st->n) : 0) + st->l1 * fabs(ws->w) +
+         st->l2 / 2 * ws->w * ws->w;
+}
+
+/**
+ * Soft threshold S(z, t) = sign(z) max(|z| - t, 0), the minimizer of
+ * (u - z)^2 / 2 + t |u|.
+ */
+static inline double soft_threshold(double z, double t) {
+  return z > t ? z - t : z < -t ? z + t : 0;
+}
+
+/**
+ * Solve the least squares problem exactly (ordinary least squares, or the
+ * elastic net with the penalties of the statistics).
+ *
+ * The bias is not penalized, so it always centers the fit and the weight
+ * minimizes var w^2 / 2 - cov w + l2 w^2 / 2 + l1 |w| over the centered
+ * sums: w = S(cov, l1) / (var + l2).
+ *
+ * @param st Pointer to the sufficient statistics of the data set.
+ * @param ws Pointer to the weights that receive the solution.
+ * @return int - 0 on success, 1 if the data set has no variance in x and
+ *               no ridge penalty.
+ */
+int closed_form(const SuffStats *st, Weights *ws) {
+  if (st->n == 0)
+    return 1;
+
+  // Center the sums around the means to keep the cancellation small
+  double sxx = st->sxx - st->sx * st->sx / st->n;
+  double sxy = st->sxy - st->sx * st->sy / st->n;
+  if (sxx == 0 && st->l2 == 0)
+    return 1;
+  ws->w = st->l1 == 0 && st->l2 == 0
+              ? sxy / sxx
+              : soft_threshold(sxy / st->n, st->l1) / (sxx / st->n + st->l2);
+  ws->b = (st->sy - ws->w * st->sx) / st->n;
+  return 0;
+}
+
+/*
+ * Binary data sets
+ *
+ * A binary data set is a 64 byte header followed by the x column and then
+ * the y column, both stored contiguously in host byte order. The header
+ * size keeps both columns 64 byte aligned inside a page aligned mapping, so
+ * the trainer maps the file and runs the kernels on it directly.
+ */
+
+// Magic bytes at the start of every binary data set
+static const char binary_magic[8] = "LRPAIRS";
+
+// Version of the binary layout written by --convert
+#define BINARY_VERSION 1
+
+// Element types of the binary columns
+typedef enum {
+  DTYPE_I32 = 1, // 32-bit signed integers (pair files)
+  DTYPE_F64 = 2  // 64-bit floats (multivariate data sets)
+} DType;
+
+// Header of a binary data set
+typedef struct {
+  char magic[8];     // binary_magic
+  uint32_t version;  // BINARY_VERSION
+  uint32_t dtype;    // DType of both columns
+  uint64_t count;    // Number of input-target pairs
+  uint64_t checksum; // column_checksum() of the x column followed by y
+  uint64_t features; // Number of feature columns, 0 for pair files
+  char reserved[24]; // Zero (a CacheKey in cache segments), pads the header
+                     // to 64 bytes
+} BinaryHeader;
+
+/**
+ * Checksum a column, eight bytes at a time.
+ *
+ * @param hash  Checksum of the preceding columns (or the seed).
+ * @param data  Pointer to the column.
+ * @param bytes Size of the column in bytes.
+ * @return uint64_t - The updated checksum.
+ */
+static uint64_t column_checksum(uint64_t hash, const void *data, size_t bytes) {
+  const unsigned char *p = data;
+  size_t i = 0;
+  for (; i + 8 <= bytes; i += 8) {
+    uint64_t word;
+    memcpy(&word, p + i, sizeof(word));
+    hash = (hash ^ word) * 0x100000001b3ULL; // FNV-1a step on a whole word
+  }
+  for (; i < bytes; i++)
+    hash = (hash ^ p[i]) * 0x100000001b3ULL;
+  return hash;
+}
+
+// Seed of column_checksum() (the FNV-1a offset basis)
+#define CHECKSUM_SEED 0xcbf29ce484222325ULL
+
+/**
+ * Write input-target pairs as a binary data set.
+ *
+ * @param path Path of the binary file to create.
+ * @param x    Pointer to the inputs.
+ * @param y    Pointer to the targets.
+ * @return int - 0 on success, 1 on error (the error has been reported).
+ */
+int write_binary(const char *path, const IntVec *x, const IntVec *y) {
+  size_t bytes = x->size * sizeof(*x->data);
+  BinaryHeader header = {.version = BINARY_VERSION,
+                         .dtype = DTYPE_I32,
+                         .count = x->size};
+  memcpy(header.magic, binary_magic, sizeof(header.magic));
+  header.checksum = column_checksum(CHECKSUM_SEED, x->data, bytes);
+  header.checksum = column_checksum(header.checksum, y->data, bytes);
+
+  FILE *file = fopen(path, "wb");
+  if (file == NULL) {
+    perror("Error opening binary file");
+    return 1;
+  }
+  int ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+           fwrite(x->data, 1, bytes, file) == bytes &&
+           fwrite(y->data, 1, bytes, file) == bytes;
+  if (fclose(file) != 0 || !ok) {
+    perror("Error writing binary file");
+    return 1;
+  }
+  return 0;
+}
+
+/*
+ * Multivariate data sets
+ *
+ * A multivariate text file starts with a "features <d>" line, every other
+ * non-blank line holds d feature values followed by the target. Its binary
+ * form uses the same header with features = d and dtype DTYPE_F64: the d
+ * feature columns follow the header one after the other, then the target
+ * column, and the checksum runs over all of them in one go. Pair files
+ * have features = 0.
+ */
+
+// Memory layouts of a feature matrix
+typedef enum {
+  LAYOUT_ROW_MAJOR,   // The features of one sample are contiguous
+  LAYOUT_COLUMN_MAJOR // The samples of one feature are contiguous
+} Layout;
+
+// Names of the layouts, indexed by Layout
+static const char *const layout_names[] = {"row-major", "column-major"};
+
+// Structure to hold a feature matrix and its targets
+typedef struct {
+  double *x;       // rows * features values, (i, j) at x[i * features + j]
+                   // in row-major and at x[j * rows + i] in column-major
+  double *y;       // Targets, one per row
+  size_t rows;     // Number of samples
+  size_t features; // Number of features d
+  Layout layout;   // Layout of x
+  int owns_x;      // x was allocated, not mapped
+  int owns_y;      // y was allocated, not mapped
+} FeatureMatrix;
+
+/**
+ * Release the parts of a feature matrix that were allocated.
+ *
+ * @param m Pointer to the feature matrix.
+ */
+void free_matrix(FeatureMatrix *m) {
+  if (m->owns_x)
+    free(m->x);
+  if (m->owns_y)
+    free(m->y);
+  *m = (FeatureMatrix){0};
+}
+
+/**
+ * Change the layout of a feature matrix, copying x into a new buffer.
+ *
+ * @param m      Pointer to the feature matrix.
+ * @param layout Layout wanted.
+ * @return int - 0 on success, 1 if out of memory.
+ */
+int matrix_relayout(FeatureMatrix *m, Layout layout) {
+  if (m->layout == layout)
+    return 0;
+  double *x = malloc(m->rows * m->features * sizeof(*x));
+  if (x == NULL)
+    return 1;
+  size_t rows = m->rows, d = m->features;
+  for (size_t i = 0; i < rows; i++)
+    for (size_t j = 0; j < d; j++) {
+      if (layout == LAYOUT_ROW_MAJOR)
+        x[i * d + j] = m->x[j * rows + i];
+      else
+        x[j * rows + i] = m->x[i * d + j];
+    }
+  if (m->owns_x)
+    free(m->x);
+  m->x = x;
+  m->owns_x = 1;
+  m->layout = layout;
+  return 0;
+}
+
+/**
+ * Check whether an open text file is a multivariate data set.
+ *
+ * @param fd Open descriptor of the text file (its offset is not moved).
+ * @return int - 1 if the first non-blank text is the "features" header.
+ */
+int is_matrix_text(int fd) {
+  char head[64];
+  ssize_t got = pread(fd, head, sizeof(head) - 1, 0);
+  if (got <= 0)
+    return 0;
+  head[got] = '\0';
+  const char *p = head;
+  while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')
+    p++;
+  return strncmp(p, "features", 8) == 0;
+}
+
+/**
+ * Parse a multivariate text file into a row-major feature matrix.
+ *
+ * @param fd   Open descriptor of the text file.
+ * @param path Path of the file, for error messages.
+ * @param m    Pointer to the feature matrix to fill.
+ * @return int - 0 on success, 1 on error (the error has been reported).
+ */
+static int parse_matrix_text(int fd, const char *path, FeatureMatrix *m) {
+  FILE *file = fdopen(dup(fd), "r");
+  if (file == NULL) {
+    perror("Error reading target-value file");
+    return 1;
+  }
+
+  char *line = NULL;
+  size_t line_capacity = 0, line_number = 0, capacity = 0;
+  int status = 0;
+  *m = (FeatureMatrix){.layout = LAYOUT_ROW_MAJOR, .owns_x = 1, .owns_y = 1};
+
+  while (status == 0 && getline(&line, &line_capacity, file) != -1) {
+    line_number++;
+    char *p = line, *end;
+    while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')
+      p++;
+    if (*p == '\0')
+      continue;
+
+    // The header fixes the number of values on every other line. The first
+    // buffer of INIT_SIZE rows has to fit in a size_t.
+    if (m->features == 0) {
+      long d;
+      if (sscanf(p, "features %ld", &d) != 1 || d < 1 ||
+          (unsigned long)d > SIZE_MAX / sizeof(double) / INIT_SIZE) {
+        fprintf(stderr, "Error: %s:%zu: expected features <count>\n", path,
+                line_number);
+        status = 1;
+      } else
+        m->features = d;
+      continue;
+    }
+
+    // Grow both buffers by doubling, like vec_append()
+    if (m->rows == capacity) {
+      if (capacity > SIZE_MAX / 2 / sizeof(double) / m->features) {
+        fprintf(stderr, "Error: out of memory parsing %s\n", path);
+        status = 1;
+        break;
+      }
+      capacity = capacity == 0 ? INIT_SIZE : capacity * 2;
+      double *x = realloc(m->x, capacity * m->features * sizeof(*x));
+      double *y = x == NULL ? NULL : realloc(m->y, capacity * sizeof(*y));
+      if (x != NULL)
+        m->x = x;
+      if (y == NULL) {
+        fprintf(stderr, "Error: out of memory parsing %s\n", path);
+        status = 1;
+        break;
+      }
+      m->y = y;
+    }
+
+    // d features, then the target
+    double *row = m->x + m->rows * m->features;
+    for (size_t j = 0; j <= m->features && status == 0; j++) {
+      double v = strtod(p, &end);
+      if (end == p) {
+        fprintf(stderr, "Error: %s:%zu: expected %zu values\n", path,
+                line_number, m->features + 1);
+        status = 1;
+      }
+      if (j < m->features)
+        row[j] = v;
+      else
+        m->y[m->rows] = v;
+      p = end;
+    }
+    while (status == 0 && (*p == ' ' || *p == '\t' || *p == '\r'))
+      p++;
+    if (status == 0 && *p != '\n' && *p != '\0') {
+      fprintf(stderr, "Error: %s:%zu: expected %zu values\n", path,
+              line_number, m->features + 1);
+      status = 1;
+    }
+    m->rows++;
+  }
+
+  if (status == 0 && m->features == 0) {
+    fprintf(stderr, "Error: %s has no features header\n", path);
+    status = 1;
+  }
+  free(line);
+  fclose(file);
+  if (status != 0)
+    free_matrix(m);
+  return status;
+}
+
+/**
+ * Write a feature matrix as a binary data set.
+ *
+ * @param path Path of the binary file to create.
+ * @param m    Pointer to the feature matrix, its layout is changed to
+ *             column-major.
+ * @return int - 0 on success, 1 on error (the error has been reported).
+ */
+int write_matrix_binary(const char *path, FeatureMatrix *m) {
+  if (matrix_relayout(m, LAYOUT_COLUMN_MAJOR) != 0) {
+    fprintf(stderr, "Error: out of memory converting %s\n", path);
+    return 1;
+  }
+  size_t x_bytes = m->rows * m->features * sizeof(double);
+  size_t y_bytes = m->rows * sizeof(double);
+  BinaryHeader header = {.version = BINARY_VERSION,
+                         .dtype = DTYPE_F64,
+                         .count = m->rows,
+                         .features = m->features};
+  memcpy(header.magic, binary_magic, sizeof(header.magic));
+  header.checksum = column_checksum(CHECKSUM_SEED, m->x, x_bytes);
+  header.checksum = column_checksum(header.checksum, m->y, y_bytes);
+
+  FILE *file = fopen(path, "wb");
+  if (file == NULL) {
+    perror("Error opening binary file");
+    return 1;
+  }
+  int ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+           fwrite(m->x, 1, x_bytes, file) == x_bytes &&
+           fwrite(m->y, 1, y_bytes, file) == y_bytes;
+  if (fclose(file) != 0 || !ok) {
+    perror("Error writing binary file");
+    return 1;
+  }
+  return 0;
+}
+
+/*
+ * Multivariate gradient
+ *
+ * The weights of a multivariate model are one vector of d weights followed
+ * by the bias, the gradient has the same shape. It is computed as two
+ * matrix-vector products over the feature matrix X:
+ *   r = X w + b - y, g = X^T r
+ * Every pool thread runs both on a contiguous range of rows into its own
+ * slot, and the slots are combined in thread order. Built with
+ * LR_WITH_CBLAS the products are dgemv calls of the BLAS. Otherwise the
+ * range is cut into blocks of rows small enough to stay in the L2 cache, so
+ * g = X^T r reads the block that r = X w has just loaded instead of going
+ * back to memory, and the inner loops are vectorized dot and axpy kernels
+ * matching the selected gradient kernel.
+ */
+
+// Bytes of the feature matrix one block of the fallback kernel covers
+#define GEMV_BLOCK_BYTES (128 << 10)
+
+// Vector primitives of the fallback matrix-vector products
+typedef struct {
+  // Dot product of a and b
+  double (*dot)(const double *a, const double *b, size_t n);
+  // y += a * x
+  void (*axpy)(double a, const double *x, double *y, size_t n);
+} VectorOps;
+
+/**
+ * Portable dot product with four independent accumulators, also used for
+ * the tails of the vector kernels.
+ */
+static double dot_scalar(const double *a, const double *b, size_t n) {
+  double s[4] = {0};
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4)
+    for (int k = 0; k < 4; k++)
+      s[k] += a[i + k] * b[i + k];
+  for (; i < n; i++)
+    s[0] += a[i] * b[i];
+  return (s[0] + s[1]) + (s[2] + s[3]);
+}
+
+/**
+ * Portable axpy, also used for the tails of the vector kernels.
+ */
+static void axpy_scalar(double a, const double *x, double *y, size_t n) {
+  for (size_t i = 0; i < n; i++)
+    y[i] += a * x[i];
+}
+
+#ifdef HAVE_X86_KERNELS
+/**
+ * AVX2 dot product: 4 accumulators of 4 doubles, 16 elements per step.
+ */
+__attribute__((target("avx2,fma"))) static double
+dot_avx2(const double *a, const double *b, size_t n) {
+  __m256d s[4];
+  for (int k = 0; k < 4; k++)
+    s[k] = _mm256_setzero_pd();
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16)
+    for (int k = 0; k < 4; k++)
+      s[k] = _mm256_fmadd_pd(_mm256_loadu_pd(a + i + 4 * k),
+                             _mm256_loadu_pd(b + i + 4 * k), s[k]);
+  double lanes[4];
+  _mm256_storeu_pd(lanes, _mm256_add_pd(_mm256_add_pd(s[0], s[1]),
+                                        _mm256_add_pd(s[2], s[3])));
+  // GCC leaves the upper halves dirty here, which slows down the SSE code
+  // of the caller
+  _mm256_zeroupper();
+  return (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]) +
+         dot_scalar(a + i, b + i, n - i);
+}
+
+/**
+ * AVX2 axpy, 4 doubles per step.
+ */
+__attribute__((target("avx2,fma"))) static void
+axpy_avx2(double a, const double *x, double *y, size_t n) {
+  __m256d va = _mm256_set1_pd(a);
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4)
+    _mm256_storeu_pd(y + i, _mm256_fmadd_pd(va, _mm256_loadu_pd(x + i),
+                                            _mm256_loadu_pd(y + i)));
+  axpy_scalar(a, x + i, y + i, n - i);
+}
+
+/**
+ * AVX-512 dot product: 4 accumulators of 8 doubles, 32 elements per step.
+ */
+__attribute__((target("avx512f"))) static double
+dot_avx512(const double *a, const double *b, size_t n) {
+  __m512d s[4];
+  for (int k = 0; k < 4; k++)
+    s[k] = _mm512_setzero_pd();
+  size_t i = 0;
+  for (; i + 32 <= n; i += 32)
+    for (int k = 0; k < 4; k++)
+      s[k] = _mm512_fmadd_pd(_mm512_loadu_pd(a + i + 8 * k),
+                             _mm512_loadu_pd(b + i + 8 * k), s[k]);
+  double sum = _mm512_reduce_add_pd(
+      _mm512_add_pd(_mm512_add_pd(s[0], s[1]), _mm512_add_pd(s[2], s[3])));
+  _mm256_zeroupper();
+  return sum + dot_scalar(a + i, b + i, n - i);
+}
+
+/**
+ * AVX-512 axpy, 8 doubles per step.
+ */
+__attribute__((target("avx512f"))) static void
+axpy_avx512(double a, const double *x, double *y, size_t n) {
+  __m512d va = _mm512_set1_pd(a);
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8)
+    _mm512_storeu_pd(y + i, _mm512_fmadd_pd(va, _mm512_loadu_pd(x + i),
+                                            _mm512_loadu_pd(y + i)));
+  axpy_scalar(a, x + i, y + i, n - i);
+}
+#endif
+
+#ifdef HAVE_NEON_KERNEL
+/**
+ * NEON dot product: 4 accumulators of 2 doubles, 8 elements per step.
+ */
+static double dot_neon(const double *a, const double *b, size_t n) {
+  float64x2_t s[4];
+  for (int k = 0; k < 4; k++)
+    s[k] = vdupq_n_f64(0);
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8)
+    for (int k = 0; k < 4; k++)
+      s[k] = vfmaq_f64(s[k], vld1q_f64(a + i + 2 * k),
+                       vld1q_f64(b + i + 2 * k));
+  return vaddvq_f64(vaddq_f64(vaddq_f64(s[0], s[1]), vaddq_f64(s[2], s[3]))) +
+         dot_scalar(a + i, b + i, n - i);
+}
+
+/**
+ * NEON axpy, 2 doubles per step.
+ */
+static void axpy_neon(double a, const double *x, double *y, size_t n) {
+  float64x2_t va = vdupq_n_f64(a);
+  size_t i = 0;
+  for (; i + 2 <= n; i += 2)
+    vst1q_f64(y + i, vfmaq_f64(vld1q_f64(y + i), va, vld1q_f64(x + i)));
+  axpy_scalar(a, x + i, y + i, n - i);
+}
+#endif
+
+/**
+ * Look up the vector primitives of the same instruction set as a gradient
+ * kernel returned by select_kernel().
+ *
+ * @param kernel The selected gradient kernel.
+ * @return VectorOps - The matching dot and axpy kernels.
+ */
+static VectorOps select_vector_ops(GradientKernel kernel) {
+#ifdef HAVE_X86_KERNELS
+  if (kernel == gradient_avx512)
+    return (VectorOps){dot_avx512, axpy_avx512};
+  if (kernel == gradient_avx2)
+    return (VectorOps){dot_avx2, axpy_avx2};
+#endif
+#ifdef HAVE_NEON_KERNEL
+  if (kernel == gradient_neon)
+    return (VectorOps){dot_neon, axpy_neon};
+#endif
+  (void)kernel;
+  return (VectorOps){dot_scalar, axpy_scalar};
+}
+
+// Primitives used by matrix_gradient(), chosen once at startup
+static VectorOps vector_ops = {dot_scalar, axpy_scalar};
+
+// Structure to hold the scratch memory of matrix_gradient()
+typedef struct {
+  double *residual; // Residual of every row
+  double *partials; // One slot of stride doubles per thread, or per block
+                    // of rows of a deterministic reduction
+  size_t stride;    // d + 2 (gradient, bias, squared error), cache aligned
+  size_t slots;     // Number of slots
+} MatrixWork;
+
+// Matrix gradient task shared by all threads of the pool
+typedef struct {
+  const FeatureMatrix *m; // Data to reduce
+  const double *w;        // d weights followed by the bias
+  MatrixWork *work;       // Scratch memory
+} MatrixTask;
+
+/**
+ * Run r = X w + b - y and g += X^T r on n rows of the feature matrix.
+ *
+ * @param m  Pointer to the feature matrix.
+ * @param lo First row.
+ * @param n  Number of rows.
+ * @param w  Pointer to the d weights followed by the bias.
+ * @param r  Pointer to the n residuals to fill.
+ * @param g  Pointer to the d gradient sums to add to.
+ */
+static void matrix_gemv(const FeatureMatrix *m, size_t lo, size_t n,
+                        const double *w, double *r, double *g) {
+  size_t d = m->features, rows = m->rows;
+  double b = w[d];
+  for (size_t i = 0; i < n; i++)
+    r[i] = b - m->y[lo + i];
+
+#ifdef LR_WITH_CBLAS
+  // The rows [lo, lo + n) are a submatrix with the leading dimension of the
+  // whole matrix in either layout
+  int row_major = m->layout == LAYOUT_ROW_MAJOR;
+  const double *a = row_major ? m->x + lo * d : m->x + lo;
+  int lda = row_major ? (int)d : (int)rows;
+  CBLAS_ORDER order = row_major ? CblasRowMajor : CblasColMajor;
+  cblas_dgemv(order, CblasNoTrans, (int)n, (int)d, 1.0, a, lda, w, 1, 1.0, r,
+              1);
+  cblas_dgemv(order, CblasTrans, (int)n, (int)d, 1.0, a, lda, r, 1, 1.0, g,
+              1);
+#else
+  VectorOps ops = vector_ops;
+  if (m->layout == LAYOUT_ROW_MAJOR) {
+    for (size_t i = 0; i < n; i++)
+      r[i] += ops.dot(m->x + (lo + i) * d, w, d);
+    for (size_t i = 0; i < n; i++)
+      ops.axpy(r[i], m->x + (lo + i) * d, g, d);
+  } else {
+    for (size_t j = 0; j < d; j++)
+      ops.axpy(w[j], m->x + j * rows + lo, r, n);
+    for (size_t j = 0; j < d; j++)
+      g[j] += ops.dot(m->x + j * rows + lo, r, n);
+  }
+#endif
+}
+
+/**
+ * Get the number of rows of one block of the fallback kernel, also the
+ * rows of one block of a deterministic reduction.
+ */
+static size_t gemv_block(size_t d) {
+  size_t block = GEMV_BLOCK_BYTES / (d * sizeof(double));
+  return block < 64 ? 64 : block;
+}
+
+/**
+ * Sum the gradient, the bias gradient and the squared error over the rows
+ * [lo, hi) into the slot g, block rows at a time.
+ */
+static void matrix_rows(MatrixTask *task, size_t lo, size_t hi, size_t block,
+                        double *g) {
+  const FeatureMatrix *m = task->m;
+  size_t d = m->features;
+  double *r = task->work->residual;
+  memset(g, 0, d * sizeof(*g));
+  for (size_t i = lo; i < hi; i += block) {
+    size_t n = hi - i < block ? hi - i : block;
+    matrix_gemv(m, i, n, task->w, r + i, g);
+  }
+
+  // The bias gradient and the cost come from the residuals alone
+  double gb = 0;
+  for (size_t i = lo; i < hi; i++)
+    gb += r[i];
+  g[d] = gb;
+  g[d + 1] = vector_ops.dot(r + lo, r + lo, hi - lo);
+}
+
+/**
+ * Sum the gradient over this thread's rows of the feature matrix.
+ */
+static void matrix_task(void *ctx, int tid, int nthreads) {
+  MatrixTask *task = ctx;
+  size_t rows = task->m->rows;
+  size_t lo = rows * tid / nthreads, hi = rows * (tid + 1) / nthreads;
+#ifdef LR_WITH_CBLAS
+  // The BLAS does its own blocking
+  size_t block = hi - lo;
+#else
+  size_t block = gemv_block(task->m->features);
+#endif
+  matrix_rows(task, lo, hi, block,
+              task->work->partials + tid * task->work->stride);
+}
+
+/**
+ * Sum this thread's share of the fixed blocks of rows, each into its own
+ * slot (deterministic reduction).
+ */
+static void matrix_block_task(void *ctx, int tid, int nthreads) {
+  MatrixTask *task = ctx;
+  size_t rows = task->m->rows, block = gemv_block(task->m->features);
+  size_t slots = task->work->slots;
+  for (size_t s = slots * tid / nthreads; s < slots * (tid + 1) / nthreads;
+       s++) {
+    size_t lo = s * block, hi = lo + block < rows ? lo + block : rows;
+    matrix_rows(task, lo, hi, block,
+                task->work->partials + s * task->work->stride);
+  }
+}
+
+/**
+ * Allocate the scratch memory of matrix_gradient() for the thread pool.
+ *
+ * @param work Pointer to the scratch memory to allocate.
+ * @param m    Pointer to the feature matrix it will be used with.
+ * @return int - 0 on success, 1 if out of memory.
+ */
+int matrix_work_alloc(MatrixWork *work, const FeatureMatrix *m) {
+  // Round each slot up to whole cache lines so threads do not share one
+  work->stride = (m->features + 2 + 7) / 8 * 8;
+  size_t block = gemv_block(m->features);
+  work->slots = deterministic ? (m->rows + block - 1) / block
+                              : (size_t)thread_pool.nthreads;
+  if (work->slots == 0)
+    work->slots = 1; // An empty matrix still sums into one zero slot
+  work->partials =
+      aligned_alloc(64, work->slots * work->stride * sizeof(double));
+  work->residual = malloc(m->rows * sizeof(double));
+  return work->partials == NULL || work->residual == NULL;
+}
+
+/**
+ * Free the scratch memory of matrix_gradient().
+ *
+ * @param work Pointer to the scratch memory.
+ */
+void matrix_work_free(MatrixWork *work) {
+  free(work->partials);
+  free(work->residual);
+}
+
+/**
+ * Compute the gradient and the cost of a multivariate linear model.
+ *
+ * @param m    Pointer to the feature matrix.
+ * @param w    Pointer to the d weights followed by the bias.
+ * @param g    Pointer receiving the d + 1 averaged gradients.
+ * @param work Pointer to the scratch memory from matrix_work_alloc().
+ * @return double - The cost (half the mean squared error) at w.
+ */
+double matrix_gradient(const FeatureMatrix *m, const double *w, double *g,
+                       MatrixWork *work) {
+  MatrixTask task = {.m = m, .w = w, .work = work};
+  size_t d = m->features;
+  double sse = 0;
+  if (deterministic) {
+    // Add the blocks up along the fixed pairwise tree
+    size_t count = work->slots;
+    pool_run(&thread_pool, matrix_block_task, &task);
+    for (size_t step = 1; step < count; step *= 2)
+      for (size_t i = 0; i + step < count; i += 2 * step) {
+        double *a = work->partials + i * work->stride;
+        const double *b = a + step * work->stride;
+        for (size_t j = 0; j < d + 2; j++)
+          a[j] += b[j];
+      }
+    memcpy(g, work->partials, (d + 1) * sizeof(double));
+    sse = work->partials[d + 1];
+  } else {
+    // Combine the slots in thread order
+    pool_run(&thread_pool, matrix_task, &task);
+    for (size_t j = 0; j <= d; j++)
+      g[j] = 0;
+    for (int t = 0; t < thread_pool.nthreads; t++) {
+      const double *slot = work->partials + t * work->stride;
+      for (size_t j = 0; j <= d; j++)
+        g[j] += slot[j];
+      sse += slot[d + 1];
+    }
+  }
+  for (size_t j = 0; j <= d; j++)
+    g[j] /= m->rows;
+  return sse / (2 * m->rows);
+}
+
+/*
+ * Direct solver
+ *
+ * With the bias as a constant last feature, least squares solves the normal
+ * equations G theta = c with G = [X 1]^T [X 1] and c = [X 1]^T y. One pass
+ * over the data builds the upper triangle of G, c and y^T y, every pool
+ * thread summing its rows into its own slot, and the slots are combined in
+ * thread order. G is then factored with Cholesky in O(d^3). Forming G
+ * squares the condition number of X, so when a pivot shows that G has lost
+ * too much precision the system is solved through a QR factorization of
+ * [X 1] itself instead: every thread folds its rows into a triangular R
+ * with Givens rotations, then the threads' R factors are folded into one.
+ */
+
+// Relative size below which a Cholesky pivot means G is ill-conditioned
+#define CHOLESKY_PIVOT_LIMIT 1e-10
+
+// Relative size below which a diagonal entry of R counts as zero
+#define RANK_LIMIT 1e-12
+
+// Direct solver task shared by all threads of the pool
+typedef struct {
+  const FeatureMatrix *m; // Data to reduce
+  double *slots;          // One slot of stride doubles per thread
+  size_t stride;          // k * k + 2 * k + 1 for k = d + 1, cache aligned
+} DirectTask;
+
+/**
+ * Sum this thread's rows into G (k * k, upper triangle), c (k) and y^T y.
+ */
+static void gram_task(void *ctx, int tid, int nthreads) {
+  DirectTask *task = ctx;
+  const FeatureMatrix *m = task->m;
+  size_t d = m->features, k = d + 1, rows = m->rows;
+  size_t lo = rows * tid / nthreads, hi = rows * (tid + 1) / nthreads;
+  double *g = task->slots + tid * task->stride, *c = g + k * k;
+  memset(g, 0, task->stride * sizeof(*g));
+
+  if (m->layout == LAYOUT_ROW_MAJOR) {
+    // One rank one update per row, the bias column is row[j] * 1
+    for (size_t i = lo; i < hi; i++) {
+      const double *row = m->x + i * d;
+      for (size_t j = 0; j < d; j++) {
+        vector_ops.axpy(row[j], row + j, g + j * k + j, d - j);
+        g[j * k + d] += row[j];
+        c[j] += row[j] * m->y[i];
+      }
+    }
+  } else {
+    // Dot products of column pairs, on blocks of rows that stay in cache
+    size_t block = GEMV_BLOCK_BYTES / (d * sizeof(double));
+    if (block < 64)
+      block = 64;
+    for (size_t i = lo; i < hi; i += block) {
+      size_t n = hi - i < block ? hi - i : block;
+      for (size_t j = 0; j < d; j++) {
+        const double *col = m->x + j * rows + i;
+        for (size_t l = j; l < d; l++)
+          g[j * k + l] += vector_ops.dot(col, m->x + l * rows + i, n);
+        for (size_t r = 0; r < n; r++)
+          g[j * k + d] += col[r];
+        c[j] += vector_ops.dot(col, m->y + i, n);
+      }
+    }
+  }
+  for (size_t i = lo; i < hi; i++)
+    c[d] += m->y[i];
+  g[d * k + d] = hi - lo;
+  c[k] = vector_ops.dot(m->y + lo, m->y + lo, hi - lo);
+}
+
+/**
+ * Factor G = R^T R in place (upper triangle) and solve G theta = c.
+ *
+ * @param g     Pointer to the k * k matrix, its upper triangle is used.
+ * @param theta Pointer to c on entry, the solution on return.
+ * @param k     Size of the system.
+ * @return int - 0 on success, 1 if G is too ill-conditioned for Cholesky.
+ */
+static int cholesky_solve(double *g, double *theta, size_t k) {
+  for (size_t j = 0; j < k; j++) {
+    double *rj = g + j * k;
+    double pivot = rj[j];
+    for (size_t i = 0; i < j; i++)
+      pivot -= g[i * k + j] * g[i * k + j];
+    // The pivot is the part of column j that the previous columns do not
+    // explain, relative to the whole column
+    if (!(pivot > CHOLESKY_PIVOT_LIMIT * rj[j]))
+      return 1;
+    rj[j] = sqrt(pivot);
+    for (size_t l = j + 1; l < k; l++) {
+      double s = rj[l];
+      for (size_t i = 0; i < j; i++)
+        s -= g[i * k + j] * g[i * k + l];
+      rj[l] = s / rj[j];
+    }
+  }
+
+  // Forward substitution with R^T, then back substitution with R
+  for (size_t j = 0; j < k; j++) {
+    for (size_t i = 0; i < j; i++)
+      theta[j] -= g[i * k + j] * theta[i];
+    theta[j] /= g[j * k + j];
+  }
+  for (size_t j = k; j-- > 0;) {
+    for (size_t l = j + 1; l < k; l++)
+      theta[j] -= g[j * k + l] * theta[l];
+    theta[j] /= g[j * k + j];
+  }
+  return 0;
+}
+
+/**
+ * Fold one row [a | y] into the triangular factor R and z = Q^T y with
+ * Givens rotations. What is left of an entry after the rotations is
+ * treated as zero once it is down to rounding noise, so linearly dependent
+ * columns keep an exactly zero row in R instead of absorbing the others.
+ *
+ * @param r   Pointer to the k * k upper triangular R.
+ * @param z   Pointer to the k entries of z.
+ * @param sse Pointer to the squared residual left over by the rows so far.
+ * @param a   Pointer to the k entries of the row, overwritten.
+ * @param y   Target of the row.
+ * @param k   Number of columns.
+ */
+static void givens_fold(double *r, double *z, double *sse, double *a,
+                        double y, size_t k) {
+  double scale = 0;
+  for (size_t j = 0; j < k; j++)
+    scale = fmax(scale, fabs(a[j]));
+  for (size_t j = 0; j < k; j++) {
+    if (fabs(a[j]) <= RANK_LIMIT * scale)
+      continue;
+    double *rj = r + j * k;
+    double h = hypot(rj[j], a[j]), c = rj[j] / h, s = a[j] / h;
+    for (size_t l = j; l < k; l++) {
+      double u = rj[l], v = a[l];
+      rj[l] = c * u + s * v;
+      a[l] = c * v - s * u;
+    }
+    double u = z[j];
+    z[j] = c * u + s * y;
+    y = c * y - s * u;
+  }
+  *sse += y * y;
+}
+
+/**
+ * Fold this thread's rows into its own R (k * k), z (k), sse and row (k).
+ */
+static void qr_task(void *ctx, int tid, int nthreads) {
+  DirectTask *task = ctx;
+  const FeatureMatrix *m = task->m;
+  size_t d = m->features, k = d + 1, rows = m->rows;
+  size_t lo = rows * tid / nthreads, hi = rows * (tid + 1) / nthreads;
+  double *r = task->slots + tid * task->stride, *z = r + k * k;
+  double *sse = z + k, *a = sse + 1;
+  memset(r, 0, task->stride * sizeof(*r));
+
+  for (size_t i = lo; i < hi; i++) {
+    for (size_t j = 0; j < d; j++)
+      a[j] = m->layout == LAYOUT_ROW_MAJOR ? m->x[i * d + j]
+                                           : m->x[j * rows + i];
+    a[d] = 1;
+    givens_fold(r, z, sse, a, m->y[i], k);
+  }
+}
+
+/**
+ * Solve the least squares problem through the QR factorization of [X 1].
+ *
+ * A ridge penalty is d more rows sqrt(n l2) e_j with target 0.
+ *
+ * @param task  Pointer to the task, its slots are overwritten.
+ * @param l2    Ridge penalty of the weights.
+ * @param theta Pointer receiving the d weights followed by the bias.
+ * @return double - The sum of the squared residuals at theta, including
+ *                  those of the penalty rows.
+ */
+static double qr_solve(DirectTask *task, double l2, double *theta) {
+  size_t k = task->m->features + 1;
+  pool_run(&thread_pool, qr_task, task);
+
+  // Fold the other threads' R factors into the first one
+  double *r = task->slots, *z = r + k * k, *sse = z + k, *a = sse + 1;
+  for (int t = 1; t < thread_pool.nthreads; t++) {
+    double *rt = task->slots + t * task->stride, *zt = rt + k * k;
+    *sse += zt[k];
+    for (size_t i = 0; i < k; i++) {
+      memcpy(a, rt + i * k, k * sizeof(*a));
+      givens_fold(r, z, sse, a, zt[i], k);
+    }
+  }
+  for (size_t j = 0; l2 > 0 && j + 1 < k; j++) {
+    memset(a, 0, k * sizeof(*a));
+    a[j] = sqrt(task->m->rows * l2);
+    givens_fold(r, z, sse, a, 0, k);
+  }
+
+  // Back substitution, directions the data does not determine get weight 0
+  double largest = 0;
+  for (size_t j = 0; j < k; j++)
+    largest = fmax(largest, fabs(r[j * k + j]));
+  int deficient = 0;
+  for (size_t j = k; j-- > 0;) {
+    if (fabs(r[j * k + j]) <= RANK_LIMIT * largest) {
+      theta[j] = 0;
+      deficient = 1;
+      continue;
+    }
+    theta[j] = z[j];
+    for (size_t l = j + 1; l < k; l++)
+      theta[j] -= r[j * k + l] * theta[l];
+    theta[j] /= r[j * k + j];
+  }
+  if (deficient)
+    fprintf(stderr, "Warning: the features are linearly dependent, the "
+                    "weights of the redundant ones are set to 0\n");
+  return *sse;
+}
+
+/**
+ * Solve multivariate least squares exactly in one pass over the data.
+ *
+ * A ridge penalty l2 / 2 |w|^2 on the cost adds n l2 to the diagonal of G
+ * except for the bias, which also keeps G better conditioned.
+ *
+ * @param m     Pointer to the feature matrix.
+ * @param l2    Ridge penalty of the weights, 0 for ordinary least squares.
+ * @param theta Pointer receiving the d weights followed by the bias.
+ * @param cost  Pointer receiving the cost (half the mean squared error plus
+ *              the penalty).
+ * @return int - 0 on success, 1 on error (the error has been reported).
+ */
+int solve_direct(const FeatureMatrix *m, double l2, double *theta,
+                 double *cost) {
+  if (m->rows == 0) {
+    fprintf(stderr, "Error: closed-form needs at least one row\n");
+    return 1;
+  }
+  size_t k = m->features + 1;
+  DirectTask task = {.m = m, .stride = (k * k + 2 * k + 1 + 7) / 8 * 8};
+  task.slots = aligned_alloc(
+      64, thread_pool.nthreads * task.stride * sizeof(double));
+  double *c = malloc(k * sizeof(double));
+  if (task.slots == NULL || c == NULL) {
+    perror("Error allocating memory");
+    free(task.slots);
+    free(c);
+    return 1;
+  }
+
+  // Build the normal equations and combine the slots in thread order
+  pool_run(&thread_pool, gram_task, &task);
+  double *g = task.slots;
+  for (int t = 1; t < thread_pool.nthreads; t++) {
+    const double *slot = task.slots + t * task.stride;
+    for (size_t j = 0; j < k * k + k + 1; j++)
+      g[j] += slot[j];
+  }
+  memcpy(c, g + k * k, k * sizeof(double));
+  double yy = g[k * k + k];
+  for (size_t j = 0; j + 1 < k; j++)
+    g[j * k + j] += m->rows * l2;
+
+  // At the solution the squared residual (with the penalty) is
+  // y^T y - theta^T c
+  memcpy(theta, c, k * sizeof(double));
+  double sse;
+  if (cholesky_solve(g, theta, k) == 0)
+    sse = fmax(0, yy - dot_scalar(theta, c, k));
+  else
+    sse = qr_solve(&task, l2, theta);
+  *cost = sse / (2 * m->rows);
+
+  free(task.slots);
+  free(c);
+  return 0;
+}
+
+// Structure to hold a loaded data set
+typedef struct {
+  IntVec x, y;          // Inputs and targets, one block from columns_alloc()
+                        // (x.data owns it) or views into a binary mapping
+  FeatureMatrix matrix; // Multivariate data, matrix.features is 0 otherwise
+  SuffStats stats;      // Sufficient statistics, only filled when requested
+  void *mapping;        // Mapping of a binary data set, NULL for text files
+  size_t mapping_size;  // Size of the mapping in bytes
+} Dataset;
+
+/**
+ * Map a binary data set and point the columns of the data set into it.
+ *
+ * @param fd     Open descriptor of the binary file.
+ * @param path   Path of the file, for error messages.
+ * @param layout Layout of the feature matrix of multivariate data sets.
+ * @param verify Check the columns against the checksum of the header.
+ * @param data   Pointer to the data set to fill.
+ * @return int - 0 on success, 1 on error (the error has been reported).
+ */
+static int map_binary(int fd, const char *path, Layout layout, int verify,
+                      Dataset *data) {
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    perror("Error reading binary file");
+    return 1;
+  }
+  if ((size_t)st.st_size < sizeof(BinaryHeader)) {
+    fprintf(stderr, "Error: %s is truncated\n", path);
+    return 1;
+  }
+  void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (map == MAP_FAILED) {
+    perror("Error mapping binary file");
+    return 1;
+  }
+
+  // A multivariate data set maps its columns into the feature matrix
+  const BinaryHeader *header = map;
+  if (header->features != 0) {
+    size_t rows = header->count, d = header->features;
+    size_t x_bytes = rows * d * sizeof(double), y_bytes = rows * sizeof(double);
+    if (header->version != BINARY_VERSION || header->dtype != DTYPE_F64 ||
+        d > SIZE_MAX / sizeof(double) / (rows + 1) ||
+        (size_t)st.st_size != sizeof(*header) + x_bytes + y_bytes) {
+      fprintf(stderr, "Error: %s is not a valid version %d binary data set\n",
+              path, BINARY_VERSION);
+      munmap(map, st.st_size);
+      return 1;
+    }
+    madvise(map, st.st_size, MADV_WILLNEED);
+    data->mapping = map;
+    data->mapping_size = st.st_size;
+    data->matrix = (FeatureMatrix){.x = (double *)(header + 1),
+                                   .y = (double *)(header + 1) + rows * d,
+                                   .rows = rows,
+                                   .features = d,
+                                   .layout = LAYOUT_COLUMN_MAJOR};
+    if (verify) {
+      uint64_t checksum =
+          column_checksum(CHECKSUM_SEED, data->matrix.x, x_bytes);
+      checksum = column_checksum(checksum, data->matrix.y, y_bytes);
+      if (checksum != header->checksum) {
+        fprintf(stderr, "Error: checksum mismatch in %s\n", path);
+        return 1;
+      }
+    }
+    if (matrix_relayout(&data->matrix, layout) != 0) {
+      fprintf(stderr, "Error: out of memory loading %s\n", path);
+      return 1;
+    }
+    return 0;
+  }
+
+  // Check the header before trusting the column sizes
+  size_t bytes = header->count * sizeof(int);
+  if (header->version != BINARY_VERSION || header->dtype != DTYPE_I32 ||
+      header->count > (SIZE_MAX - sizeof(*header)) / (2 * sizeof(int)) ||
+      (size_t)st.st_size != sizeof(*header) + 2 * bytes) {
+    fprintf(stderr, "Error: %s is not a valid version %d binary data set\n",
+            path, BINARY_VERSION);
+    munmap(map, st.st_size);
+    return 1;
+  }
+
+  // The columns are read over and over while training, page them in ahead
+  madvise(map, st.st_size, MADV_WILLNEED);
+
+  data->mapping = map;
+  data->mapping_size = st.st_size;
+  data->x = (IntVec){.data = (int *)(header + 1), .size = header->count};
+  data->y =
+      (IntVec){.data = data->x.data + header->count, .size = header->count};
+
+  if (verify) {
+    uint64_t checksum = column_checksum(CHECKSUM_SEED, data->x.data, bytes);
+    checksum = column_checksum(checksum, data->y.data, bytes);
+    if (checksum != header->checksum) {
+      fprintf(stderr, "Error: checksum mismatch in %s\n", path);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/**
+ * Release the memory or mapping behind a data set.
+ *
+ * @param data Pointer to the data set.
+ */
+void free_dataset(Dataset *data) {
+  free_matrix(&data->matrix);
+  if (data->mapping != NULL)
+    munmap(data->mapping, data->mapping_size);
+  else
+    free(data->x.data); // Holds both columns
+  *data = (Dataset){0};
+}
+
+/**
+ * Store the columns of a univariate data set in the narrowest integer type
+ * that holds every input and target, both columns in the same type.
+ *
+ * Allocated columns are narrowed in place: x moves to the front of its
+ * block and y right behind it, every element is written at or before the
+ * offset it is read from. Mapped columns are copied to a new block and the
+ * mapping is released. Only gradient() and data_cost() read narrowed
+ * columns.
+ *
+ * @param data Pointer to the loaded data set.
+ * @return int - 0 on success, 1 if out of memory (the data set is unchanged).
+ */
+int narrow_pairs(Dataset *data) {
+  size_t n = data->x.size;
+  int lo = 0, hi = 0;
+  for (size_t i = 0; i < n; i++) {
+    int x = data->x.data[i], y = data->y.data[i];
+    lo = x < lo ? x : lo;
+    hi = x > hi ? x : hi;
+    lo = y < lo ? y : lo;
+    hi = y > hi ? y : hi;
+  }
+  ColumnType type = lo >= INT8_MIN && hi <= INT8_MAX     ? COLUMN_INT8
+                    : lo >= INT16_MIN && hi <= INT16_MAX ? COLUMN_INT16
+                                                         : COLUMN_INT32;
+  if (type == COLUMN_INT32 || n == 0)
+    return 0;
+
+  IntVec x, y;
+  size_t stride = (n * column_sizes[type] + COLUMN_ALIGN - 1) /
+                  COLUMN_ALIGN * COLUMN_ALIGN;
+  if (data->mapping != NULL) {
+    if (columns_alloc(&x, &y, n, type) != 0) {
+      perror("Error allocating memory");
+      return 1;
+    }
+  } else {
+    x = (IntVec){.data = data->x.data, .capacity = n, .type = type};
+    y = (IntVec){.data = (int *)((char *)data->x.data + stride),
+                 .capacity = n,
+                 .type = type};
+  }
+  x.size = y.size = n;
+
+  // The whole x column before y, y is written over the old x
+  for (size_t i = 0; i < n; i++) {
+    if (type == COLUMN_INT8)
+      x.data8[i] = (int8_t)data->x.data[i];
+    else
+      x.data16[i] = (int16_t)data->x.data[i];
+  }
+  for (size_t i = 0; i < n; i++) {
+    if (type == COLUMN_INT8)
+      y.data8[i] = (int8_t)data->y.data[i];
+    else
+      y.data16[i] = (int16_t)data->y.data[i];
+  }
+
+  if (data->mapping != NULL)
+    munmap(data->mapping, data->mapping_size);
+  data->mapping = NULL;
+  data->x = x;
+  data->y = y;
+  return 0;
+}
+
+/*
+ * Text parser
+ *
+ * Text files are read with read() in large blocks and parsed by hand, one
+ * "<x> <y>" line at a time. Every block is cut at newlines into one segment
+ * per pool thread; the segments are parsed in parallel and appended in file
+ * order, so the result does not depend on the thread count.
+ */
+
+// Size of the blocks read from a text file
+#define PARSE_BLOCK (8 << 20)
+
+/**
+ * Parse one integer, skipping leading blanks.
+ *
+ * @param p     Pointer to the cursor, advanced past the integer.
+ * @param end   End of the text.
+ * @param value Pointer receiving the integer.
+ * @return int - 0 on success, 1 if there is no integer or it overflows.
+ */
+static inline int parse_int(const char **p, const char *end, int *value) {
+  const char *c = *p;
+  while (c < end && (*c == ' ' || *c == '\t'))
+    c++;
+  int negative = c < end && *c == '-';
+  if (c < end && (*c == '-' || *c == '+'))
+    c++;
+  if (c == end || (unsigned)(*c - '0') > 9)
+    return 1;
+
+  // Accumulate in 64 bits, ten digits cannot overflow but can exceed int.
+  // An eleventh digit fails before it is accumulated.
+  long long v = 0;
+  for (int digits = 0; c < end && (unsigned)(*c - '0') <= 9; c++) {
+    if (++digits > 10)
+      return 1;
+    v = v * 10 + (*c - '0');
+  }
+  if (negative)
+    v = -v;
+  if (v < INT_MIN || v > INT_MAX)
+    return 1;
+  *value = (int)v;
+  *p = c;
+  return 0;
+}
+
+/**
+ * Parse a settings or peers file value that has to be a whole number in
+ * [min, max].
+ *
+ * strtoll() saturates out of range values, max stays below LLONG_MAX so
+ * they fail the range check too.
+ *
+ * @param value Text of the value.
+ * @param min   Smallest accepted value.
+ * @param max   Largest accepted value, below LLONG_MAX.
+ * @param count Pointer receiving the value.
+ * @return int - 0 on success, 1 if the value is not a whole number in
+ *               range.
+ */
+static int parse_count(const char *value, long long min, long long max,
+                       long long *count) {
+  char *end;
+  long long v = strtoll(value, &end, 10);
+  if (end == value || *end != '\0' || v < min || v > max)
+    return 1;
+  *count = v;
+  return 0;
+}
+
+/**
+ * Parse the input-target pairs of a piece of text made of whole lines.
+ *
+ * Blank lines are skipped, any other line must hold exactly two integers.
+ * Without y only the inputs are kept, a line then holds an input that may
+ * be followed by a target, which is dropped.
+ *
+ * @param p          Start of the text.
+ * @param end        End of the text.
+ * @param max_pairs  Stop after this many pairs.
+ * @param x          Vector receiving the inputs (ignored when stats is set).
+ * @param y          Vector receiving the targets (ignored when stats is set),
+ *                   or NULL to keep only the inputs.
+ * @param stats      Statistics to accumulate into instead, or NULL.
+ * @param lines      Pointer receiving the number of lines parsed.
+ * @param error_line Pointer receiving the 1-based line of the first
+ *                   malformed line, 0 if every line was well-formed.
+ * @return const char* - Start of the first line that was not parsed, or
+ *                       NULL if x or y could not grow.
+ */
+static const char *parse_pairs(const char *p, const char *end,
+                               size_t max_pairs, IntVec *x, IntVec *y,
+                               SuffStats *stats, size_t *lines,
+                               size_t *error_line) {
+  size_t line = 0, pairs = 0;
+  *error_line = 0;
+  while (p < end && pairs < max_pairs) {
+    line++;
+
+    // Skip blank lines
+    const char *c = p;
+    while (c < end && (*c == ' ' || *c == '\t' || *c == '\r'))
+      c++;
+    if (c == end || *c == '\n') {
+      p = c + 1;
+      continue;
+    }
+
+    // Two integers separated by blanks, then only blanks up to the newline
+    int xv, yv = 0;
+    int bad = parse_int(&c, end, &xv);
+    if (y != NULL || stats != NULL)
+      bad = bad || c == end || (*c != ' ' && *c != '\t') ||
+            parse_int(&c, end, &yv);
+    else if (!bad && c < end && (*c == ' ' || *c == '\t')) {
+      // Inputs only, a target after the input is optional
+      while (c < end && (*c == ' ' || *c == '\t'))
+        c++;
+      if (c < end && *c != '\r' && *c != '\n')
+        bad = parse_int(&c, end, &yv);
+    }
+    while (!bad && c < end && (*c == ' ' || *c == '\t' || *c == '\r'))
+      c++;
+    if (bad || (c < end && *c != '\n')) {
+      *error_line = line;
+      break;
+    }
+    if (stats != NULL)
+      stats_add(stats, xv, yv);
+    else if (vec_append(x, &xv) != 0 ||
+             (y != NULL && vec_append(y, &yv) != 0)) {
+      // Drop the half appended pair, y is never longer than x
+      if (y != NULL)
+        x->size = y->size;
+      *lines = line - 1;
+      return NULL;
+    }
+    p = c + 1;
+    pairs++;
+  }
+  *lines = line;
+  return p < end ? p : end;
+}
+
+// Result of one thread parsing its segment of a block
+typedef struct {
+  IntVec x, y;       // Pairs parsed from the segment
+  SuffStats stats;   // Statistics of the segment
+  size_t lines;      // Number of lines in the segment
+  size_t error_line; // First malformed line relative to the segment, or 0
+  int out_of_memory; // The segment could not be stored
+} ParseSegment;
+
+// Parse task shared by all threads of the pool
+typedef struct {
+  const char *text;       // Block of whole lines
+  size_t size;            // Size of the block
+  int want_stats;         // Keep only the statistics
+  ParseSegment *segments; // One result per thread
+} ParseTask;
+
+/**
+ * Move a position in the text forward to the start of a line.
+ *
+ * @param text Start of the text.
+ * @param end  End of the text.
+ * @param pos  Position to move.
+ * @return const char* - pos if a line starts there, else the start of the
+ *                       next line (or end).
+ */
+static const char *line_start(const char *text, const char *end,
+                              const char *pos) {
+  if (pos == text || pos[-1] == '\n')
+    return pos;
+  const char *newline = memchr(pos, '\n', end - pos);
+  return newline != NULL ? newline + 1 : end;
+}
+
+/**
+ * Parse this thread's segment of the block.
+ *
+ * Both segment bounds are moved forward to a line start, so every line
+ * belongs to exactly one thread.
+ */
+static void parse_task(void *ctx, int tid, int nthreads) {
+  ParseTask *task = ctx;
+  const char *text = task->text, *end = text + task->size;
+  const char *lo = line_start(text, end, text + task->size * tid / nthreads);
+  const char *hi =
+      line_start(text, end, text + task->size * (tid + 1) / nthreads);
+
+  ParseSegment *seg = &task->segments[tid];
+  seg->x.size = seg->y.size = 0;
+  seg->out_of_memory =
+      parse_pairs(lo, hi, SIZE_MAX, &seg->x, &seg->y,
+                  task->want_stats ? &seg->stats : NULL, &seg->lines,
+                  &seg->error_line) == NULL;
+}
+
+/**
+ * Parse a text file of input-target pairs.
+ *
+ * @param fd         Open descriptor of the text file.
+ * @param path       Path of the file, for error messages.
+ * @param want_stats Collect the sufficient statistics instead of the data.
+ * @param data       Pointer to the data set to fill.
+ * @return int - 0 on success, 1 on error (the error has been reported).
+ */
+static int parse_text(int fd, const char *path, int want_stats, Dataset *data) {
+  int nthreads = thread_pool.nthreads;
+  size_t capacity = PARSE_BLOCK, filled = 0, line_base = 0;
+  char *buffer = malloc(capacity);
+  ParseSegment *segments = calloc(nthreads, sizeof(*segments));
+  int status = 0, eof = 0;
+  if (buffer == NULL || segments == NULL) {
+    fprintf(stderr, "Error: out of memory parsing %s\n", path);
+    free(buffer);
+    free(segments);
+    return 1;
+  }
+  for (int t = 0; t < nthreads; t++) {
+    segments[t].x = new_intvec();
+    segments[t].y = new_intvec();
+  }
+
+  while (!eof && status == 0) {
+    // Fill the rest of the buffer, the part after the last newline of the
+    // previous block is already at the front
+    while (filled < capacity) {
+      ssize_t got = read(fd, buffer + filled, capacity - filled);
+      if (got < 0) {
+        perror("Error reading target-value file");
+        status = 1;
+        break;
+      }
+      if (got == 0) {
+        eof = 1;
+        break;
+      }
+      filled += got;
+    }
+    if (status != 0)
+      break;
+
+    // Only parse whole lines unless this is the end of the file
+    size_t size = filled;
+    if (!eof) {
+      const char *last = buffer + filled;
+      while (last > buffer && last[-1] != '\n')
+        last--;
+      if (last == buffer) {
+        // One line longer than the buffer, grow it and keep reading
+        char *grown = realloc(buffer, capacity * 2);
+        if (grown == NULL) {
+          fprintf(stderr, "Error: out of memory parsing %s\n", path);
+          status = 1;
+          break;
+        }
+        buffer = grown;
+        capacity *= 2;
+        continue;
+      }
+      size = last - buffer;
+    }
+
+    ParseTask task = {.text = buffer,
+                      .size = size,
+                      .want_stats = want_stats,
+                      .segments = segments};
+    pool_run(&thread_pool, parse_task, &task);
+
+    // Append the segments in file order
+    for (int t = 0; t < nthreads && status == 0; t++) {
+      ParseSegment *seg = &segments[t];
+      size_t n = seg->x.size;
+      if (seg->out_of_memory ||
+          (!want_stats && columns_reserve(&data->x, &data->y, n) != 0)) {
+        fprintf(stderr, "Error: out of memory parsing %s\n", path);
+        status = 1;
+        break;
+      }
+      if (seg->error_line != 0) {
+        fprintf(stderr, "Error: %s:%zu: expected two integers\n", path,
+                line_base + seg->error_line);
+        status = 1;
+      }
+      line_base += seg->lines;
+      if (!want_stats) {
+        memcpy(data->x.data + data->x.size, seg->x.data, n * sizeof(int));
+        memcpy(data->y.data + data->y.size, seg->y.data, n * sizeof(int));
+        data->x.size += n;
+        data->y.size += n;
+      }
+    }
+
+    // Move the incomplete last line to the front of the buffer
+    memmove(buffer, buffer + size, filled - size);
+    filled -= size;
+  }
+
+  for (int t = 0; t < nthreads; t++) {
+    SuffStats *st = &segments[t].stats;
+    data->stats.n += st->n;
+    data->stats.sx += st->sx;
+    data->stats.sy += st->sy;
+    data->stats.sxx += st->sxx;
+    data->stats.sxy += st->sxy;
+    data->stats.syy += st->syy;
+    free(segments[t].x.data);
+    free(segments[t].y.data);
+  }
+  free(segments);
+  free(buffer);
+  return status;
+}
+
+/*
+ * Dataset cache
+ *
+ * With cache 1 a parsed text file is published as a POSIX shared memory
+ * segment (/dev/shm/lr-cache-<hash of the real path> on Linux) in the
+ * binary data set format, and later runs map the segment like a binary
+ * file instead of parsing the text again. The reserved bytes of the
+ * segment's header hold the size and modification time of the source
+ * file it was parsed from. A run that finds a different key, or a segment
+ * whose writer never finished, removes it and publishes a fresh one under
+ * the same name, so an edited file never trains on stale pairs and every
+ * source file keeps at most one segment. The segments belong to the user
+ * (mode 0600) and live until they are replaced, removed by hand
+ * (rm /dev/shm/lr-cache-*) or the machine restarts.
+ */
+
+// Identity of the source file a cache segment was parsed from
+typedef struct {
+  uint64_t size;       // Size in bytes
+  int64_t mtime_sec;   // Modification time
+  int64_t mtime_nsec;  // Nanoseconds of the modification time
+} CacheKey;
+
+_Static_assert(sizeof(CacheKey) == sizeof(((BinaryHeader *)0)->reserved),
+               "the cache key fills the reserved bytes of the header");
+
+/**
+ * Derive the name of the cache segment of a file and its current key.
+ *
+ * @param path Path of the text file.
+ * @param st   Pointer to the status of the open file.
+ * @param name Pointer receiving the segment name, 32 bytes.
+ * @param key  Pointer receiving the key.
+ * @return int - 0 on success, 1 if the file cannot be cached.
+ */
+static int cache_name(const char *path, const struct stat *st, char *name,
+                      CacheKey *key) {
+  char *real = realpath(path, NULL);
+  if (real == NULL || !S_ISREG(st->st_mode)) {
+    free(real);
+    return 1;
+  }
+  uint64_t hash = column_checksum(CHECKSUM_SEED, real, strlen(real));
+  free(real);
+  snprintf(name, 32, "/lr-cache-%016llx", (unsigned long long)hash);
+  *key = (CacheKey){.size = st->st_size,
+                    .mtime_sec = st->st_mtim.tv_sec,
+                    .mtime_nsec = st->st_mtim.tv_nsec};
+  return 0;
+}
+
+/**
+ * Map the cache segment of a file if it is up to date.
+ *
+ * The segment was checked when it was written, so the columns are mapped
+ * without running the checksum over them. That trust needs a segment only
+ * this user can have written: one owned by someone else or open to other
+ * users (a name squatted to poison the data) is ignored and left alone.
+ *
+ * @param name   Name of the segment.
+ * @param key    Pointer to the key of the file as it is now.
+ * @param layout Layout of the feature matrix of multivariate data sets.
+ * @param data   Pointer to the data set to fill.
+ * @return int - 0 if the segment was mapped, 1 if there is none (a stale
+ *               one has been removed).
+ */
+static int cache_attach(const char *name, const CacheKey *key, Layout layout,
+                        Dataset *data) {
+  int fd = shm_open(name, O_RDONLY, 0);
+  if (fd < 0)
+    return 1;
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_uid != geteuid() ||
+      (st.st_mode & 077) != 0) {
+    fprintf(stderr, "Warning: ignoring the cache segment %s, it is not "
+                    "private to this user\n",
+            name);
+    close(fd);
+    return 1;
+  }
+  BinaryHeader header;
+  int fresh = pread(fd, &header, sizeof(header), 0) == sizeof(header) &&
+              memcmp(header.magic, binary_magic, sizeof(header.magic)) == 0 &&
+              memcmp(header.reserved, key, sizeof(*key)) == 0;
+  int status = !fresh || map_binary(fd, name, layout, 0, data) != 0;
+  close(fd);
+  if (status != 0) {
+    free_dataset(data);
+    shm_unlink(name);
+  }
+  return status;
+}
+
+/**
+ * Publish the parsed columns of a file as its cache segment.
+ *
+ * The magic bytes are written last, a segment that is still being written
+ * (or whose writer died) is not taken for a valid one. Failing to publish
+ * only costs the next run a parse.
+ *
+ * @param name Name of the segment.
+ * @param key  Pointer to the key of the file the columns were parsed from.
+ * @param x    Pointer to the x column (or the column-major feature matrix).
+ * @param y    Pointer to the y column.
+ * @param x_bytes Size of x in bytes.
+ * @param y_bytes Size of y in bytes.
+ * @param header  Pointer to the header without magic, key and checksum.
+ */
+static void cache_publish(const char *name, const CacheKey *key,
+                          const void *x, const void *y, size_t x_bytes,
+                          size_t y_bytes, BinaryHeader *header) {
+  // Another run publishing the same file at the same time wins
+  int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+  if (fd < 0)
+    return;
+  size_t size = sizeof(*header) + x_bytes + y_bytes;
+  char *map = ftruncate(fd, size) == 0
+                  ? mmap(NULL, size, PROT_WRITE, MAP_SHARED, fd, 0)
+                  : MAP_FAILED;
+  close(fd);
+  if (map == MAP_FAILED) {
+    fprintf(stderr, "Warning: could not create the cache segment %s\n",
+            name);
+    shm_unlink(name);
+    return;
+  }
+  memcpy(map + sizeof(*header), x, x_bytes);
+  memcpy(map + sizeof(*header) + x_bytes, y, y_bytes);
+  header->checksum = column_checksum(CHECKSUM_SEED, x, x_bytes);
+  header->checksum = column_checksum(header->checksum, y, y_bytes);
+  memcpy(header->reserved, key, sizeof(*key));
+  memcpy(map + sizeof(header->magic), (char *)header + sizeof(header->magic),
+         sizeof(*header) - sizeof(header->magic));
+  atomic_thread_fence(memory_order_release);
+  memcpy(map, binary_magic, sizeof(header->magic));
+  munmap(map, size);
+}
+
+/**
+ * Load input-target pairs from a text file or a binary data set.
+ *
+ * Binary data sets are recognised by their magic bytes and mapped without
+ * copying. With want_stats only the sufficient statistics are kept, text
+ * files are then not stored in memory at all unless they are cached.
+ *
+ * Multivariate data sets are loaded into data->matrix in the given layout,
+ * want_stats does not apply to them.
+ *
+ * @param path       Path of the input-target pairs file.
+ * @param want_stats Collect the sufficient statistics instead of the data.
+ * @param layout     Layout of the feature matrix of multivariate data sets.
+ * @param cache      Map a text file's cache segment instead of parsing it,
+ *                   or publish one, see Dataset cache.
+ * @param data       Pointer to the data set to fill.
+ * @return int - 0 on success, 1 on error (the error has been reported).
+ */
+int load_dataset(const char *path, int want_stats, Layout layout, int cache,
+                 Dataset *data) {
+  *data = (Dataset){0};
+
+  // Open the input-target pairs file
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    // Error message if file can not be opened
+    perror("Error opening target-value file");
+    return 1;
+  }
+
+  // Binary data sets start with the magic bytes
+  // Mapped columns and columns kept for the cache still need their
+  // statistics, the parser collects them for the others
+  char magic[sizeof(binary_magic)];
+  struct stat st;
+  char name[32];
+  CacheKey key;
+  int regular = fstat(fd, &st) == 0 && S_ISREG(st.st_mode);
+  int cached = regular && cache && cache_name(path, &st, name, &key) == 0;
+  int status, stats_from_columns = 1;
+  if (read(fd, magic, sizeof(magic)) == sizeof(magic) &&
+      memcmp(magic, binary_magic, sizeof(magic)) == 0)
+    status = map_binary(fd, path, layout, 1, data);
+  else if (cached && cache_attach(name, &key, layout, data) == 0)
+    status = 0;
+  else if (is_matrix_text(fd)) {
+    status = lseek(fd, 0, SEEK_SET) != 0 ||
+             parse_matrix_text(fd, path, &data->matrix) != 0;
+    FeatureMatrix *m = &data->matrix;
+    if (status == 0 && cached &&
+        matrix_relayout(m, LAYOUT_COLUMN_MAJOR) == 0)
+      cache_publish(name, &key, m->x, m->y,
+                    m->rows * m->features * sizeof(double),
+                    m->rows * sizeof(double),
+                    &(BinaryHeader){.version = BINARY_VERSION,
+                                    .dtype = DTYPE_F64,
+                                    .count = m->rows,
+                                    .features = m->features});
+    status = status || matrix_relayout(m, layout) != 0;
+  } else {
+    // Allocate x (inputs) and y (targets) for the most pairs the file can
+    // hold, every pair takes at least four bytes ("0 0\n"). The pages past
+    // the parsed pairs are never touched, so they cost no memory; only
+    // pipes and other files of unknown size grow the columns. A cached
+    // file keeps its columns to publish them.
+    size_t capacity = regular ? (size_t)st.st_size / 4 + 1 : INIT_SIZE;
+    stats_from_columns = cached;
+    if ((!want_stats || cached) &&
+        columns_alloc(&data->x, &data->y, capacity, COLUMN_INT32) != 0) {
+      perror("Error allocating memory");
+      status = 1;
+    } else
+      status = lseek(fd, 0, SEEK_SET) != 0 ||
+               parse_text(fd, path, want_stats && !cached, data) != 0;
+    if (status == 0 && cached)
+      cache_publish(name, &key, data->x.data, data->y.data,
+                    data->x.size * sizeof(int), data->y.size * sizeof(int),
+                    &(BinaryHeader){.version = BINARY_VERSION,
+                                    .dtype = DTYPE_I32,
+                                    .count = data->x.size});
+  }
+  if (status != 0)
+    free_dataset(data);
+  else if (stats_from_columns && data->matrix.features == 0 && want_stats)
+    for (size_t i = 0; i < data->x.size; i++)
+      stats_add(&data->stats, data->x.data[i], data->y.data[i]);
+
+  // Close the input-target pairs file
+  close(fd);
+  return status;
+}
+
+/*
+ * Pair streams
+ *
+ * A stream reads a text file or a binary data set front to back in batches
+ * of a fixed number of pairs, holding only one block of the file at a time.
+ * Streamed binary data sets are only checked against their header; the
+ * checksum covers the whole x column before the y column, so it cannot be
+ * verified batch by batch.
+ */
+
+// Structure to hold the state of a pair stream
+typedef struct {
+  int fd;           // Open descriptor of the file
+  const char *path; // Path of the file, for error messages
+  int binary;       // The file is a binary data set
+  size_t count;     // Binary: number of pairs
+  size_t next;      // Binary: index of the next pair
+  char *buffer;     // Text: current block of the file
+  size_t capacity;  // Text: size of the buffer
+  size_t start;     // Text: offset of the first unparsed byte
+  size_t filled;    // Text: number of valid bytes in the buffer
+  int eof;          // Text: the whole file has been read
+  size_t line;      // Text: number of lines consumed so far
+  int partial;      // Text: end a batch at the first read that fills one
+                    // line or more, for pipes and sockets
+  int inputs;       // Text: read only the inputs, targets are optional
+  size_t bad_line;  // Text: malformed line the next read reports, 0 if
+                    // none
+} PairStream;
+
+/**
+ * Stream text pairs from an already open descriptor (a pipe or a socket).
+ *
+ * @param stream Pointer to the stream to set up.
+ * @param fd     Open descriptor, closed by stream_close().
+ * @param path   Name of the stream, for error messages.
+ * @return int - 0 on success, 1 on error (the error has been reported, the
+ *               descriptor has been closed).
+ */
+int stream_attach(PairStream *stream, int fd, const char *path) {
+  *stream = (PairStream){.fd = fd, .path = path, .capacity = PARSE_BLOCK};
+  stream->buffer = malloc(stream->capacity);
+  if (stream->buffer == NULL) {
+    fprintf(stderr, "Error: out of memory streaming %s\n", path);
+    close(fd);
+    return 1;
+  }
+  return 0;
+}
+
+/**
+ * Open a text file or binary data set for streaming.
+ *
+ * @param stream Pointer to the stream to open.
+ * @param path   Path of the input-target pairs file.
+ * @return int - 0 on success, 1 on error (the error has been reported).
+ */
+int stream_open(PairStream *stream, const char *path) {
+  *stream = (PairStream){.path = path};
+  stream->fd = open(path, O_RDONLY);
+  if (stream->fd < 0) {
+    perror("Error opening target-value file");
+    return 1;
+  }
+
+  BinaryHeader header;
+  struct stat st;
+  if (pread(stream->fd, &header, sizeof(header), 0) == sizeof(header) &&
+      memcmp(header.magic, binary_magic, sizeof(binary_magic)) == 0) {
+    if (fstat(stream->fd, &st) != 0 || header.version != BINARY_VERSION ||
+        header.dtype != DTYPE_I32 || header.features != 0 ||
+        (size_t)st.st_size != sizeof(header) + 2 * header.count * sizeof(int)) {
+      fprintf(stderr, "Error: %s is not a valid version %d binary data set\n",
+              path, BINARY_VERSION);
+      close(stream->fd);
+      return 1;
+    }
+    stream->binary = 1;
+    stream->count = header.count;
+    return 0;
+  }
+
+  if (is_matrix_text(stream->fd)) {
+    fprintf(stderr, "Error: sgd only supports input-target pair files\n");
+    close(stream->fd);
+    return 1;
+  }
+
+  return stream_attach(stream, stream->fd, path);
+}
+
+/**
+ * Move a stream back to the first pair.
+ *
+ * @param stream Pointer to the stream.
+ * @return int - 0 on success, 1 on error (the error has been reported).
+ */
+int stream_rewind(PairStream *stream) {
+  stream->next = stream->start = stream->filled = stream->line = 0;
+  stream->bad_line = 0;
+  stream->eof = 0;
+  if (!stream->binary && lseek(stream->fd, 0, SEEK_SET) != 0) {
+    perror("Error rewinding target-value file");
+    return 1;
+  }
+  return 0;
+}
+
+/**
+ * Report the malformed line a stream stopped at.
+ */
+static int stream_bad_line(const PairStream *stream) {
+  fprintf(stderr, "Error: %s:%zu: expected %s\n", stream->path,
+          stream->bad_line,
+          stream->inputs ? "an integer input" : "two integers");
+  return 1;
+}
+
+/**
+ * Read the next batch of pairs from a stream.
+ *
+ * A batch ends before a malformed line, its pairs are returned first and
+ * the next read reports the line.
+ *
+ * @param stream Pointer to the stream.
+ * @param x      Vector receiving the inputs, emptied first.
+ * @param y      Vector receiving the targets, emptied first.
+ * @param max    Maximum number of pairs in the batch.
+ * @return int - 0 on success (an empty batch at the end of the stream),
+ *               1 on error (the error has been reported).
+ */
+int stream_read(PairStream *stream, IntVec *x, IntVec *y, size_t max) {
+  x->size = y->size = 0;
+  if (stream->bad_line != 0)
+    return stream_bad_line(stream);
+
+  if (stream->binary) {
+    // Both columns of the batch are read straight into the vectors
+    size_t n = stream->count - stream->next;
+    if (n > max)
+      n = max;
+    off_t x_at = sizeof(BinaryHeader) + stream->next * sizeof(int);
+    off_t y_at = x_at + stream->count * sizeof(int);
+    ssize_t bytes = n * sizeof(int);
+    if (pread(stream->fd, x->data, bytes, x_at) != bytes ||
+        pread(stream->fd, y->data, bytes, y_at) != bytes) {
+      fprintf(stderr, "Error: short read from %s\n", stream->path);
+      return 1;
+    }
+    x->size = y->size = n;
+    stream->next += n;
+    return 0;
+  }
+
+  while (x->size < max) {
+    // Parse the whole lines in the buffer, the rest of the file once it has
+    // all been read
+    const char *text = stream->buffer + stream->start;
+    const char *end = stream->buffer + stream->filled;
+    if (!stream->eof)
+      while (end > text && end[-1] != '\n')
+        end--;
+    if (end > text) {
+      size_t lines, error_line;
+      const char *stop =
+          parse_pairs(text, end, max - x->size, x, stream->inputs ? NULL : y,
+                      NULL, &lines, &error_line);
+      if (stop == NULL) {
+        fprintf(stderr, "Error: out of memory reading %s\n", stream->path);
+        return 1;
+      }
+      if (error_line != 0) {
+        stream->bad_line = stream->line + error_line;
+        return x->size > 0 ? 0 : stream_bad_line(stream);
+      }
+      stream->line += lines;
+      stream->start = stop - stream->buffer;
+      continue;
+    }
+    if (stream->eof || (stream->partial && x->size > 0))
+      break;
+
+    // Move the incomplete line to the front and read the next block
+    memmove(stream->buffer, stream->buffer + stream->start,
+            stream->filled - stream->start);
+    stream->filled -= stream->start;
+    stream->start = 0;
+    if (stream->filled == stream->capacity) {
+      // One line longer than the buffer, grow it
+      char *grown = realloc(stream->buffer, stream->capacity * 2);
+      if (grown == NULL) {
+        fprintf(stderr, "Error: out of memory streaming %s\n", stream->path);
+        return 1;
+      }
+      stream->buffer = grown;
+      stream->capacity *= 2;
+    }
+    ssize_t got = read(stream->fd, stream->buffer + stream->filled,
+                       stream->capacity - stream->filled);
+    if (got < 0) {
+      perror("Error reading target-value file");
+      return 1;
+    }
+    stream->eof = got == 0;
+    stream->filled += got;
+  }
+  return 0;
+}
+
+/**
+ * Close a stream and release its buffer.
+ *
+ * @param stream Pointer to the stream.
+ */
+void stream_close(PairStream *stream) {
+  close(stream->fd);
+  free(stream->buffer);
+}
+
+// States of a batch slot
+typedef enum {
+  SLOT_EMPTY, // Free for the reader
+  SLOT_FULL,  // Holds a batch the trainer has not consumed yet
+  SLOT_END    // No more batches: the last epoch ended or reading failed
+} SlotState;
+
+// Bounded double buffer between the reader thread and the trainer
+typedef struct {
+  PairStream *stream;    // Stream the reader takes the batches from
+  int epochs;            // Number of passes over the stream
+  size_t batch_size;     // Maximum number of pairs per batch
+  IntVec x[2], y[2];     // The two batch slots
+  SlotState state[2];    // State of each slot
+  int status;            // Nonzero once reading failed
+  pthread_mutex_t lock;  // Protects state and status
+  pthread_cond_t change; // Signalled whenever a slot changes state
+} BatchQueue;
+
+/**
+ * Reader thread: fill the slots in turn, epoch after epoch.
+ */
+static void *batch_reader(void *arg) {
+  BatchQueue *q = arg;
+  int slot = 0, status = 0;
+  for (int epoch = 0; epoch < q->epochs && status == 0; epoch++) {
+    status = stream_rewind(q->stream);
+    while (status == 0) {
+      // Wait for the trainer to give the slot back
+      pthread_mutex_lock(&q->lock);
+      while (q->state[slot] != SLOT_EMPTY)
+        pthread_cond_wait(&q->change, &q->lock);
+      pthread_mutex_unlock(&q->lock);
+
+      status = stream_read(q->stream, &q->x[slot], &q->y[slot], q->batch_size);
+      if (status != 0 || q->x[slot].size == 0)
+        break;
+
+      pthread_mutex_lock(&q->lock);
+      q->state[slot] = SLOT_FULL;
+      pthread_cond_signal(&q->change);
+      pthread_mutex_unlock(&q->lock);
+      slot ^= 1;
+    }
+  }
+
+  // Use the next slot to tell the trainer to stop
+  pthread_mutex_lock(&q->lock);
+  while (q->state[slot] != SLOT_EMPTY)
+    pthread_cond_wait(&q->change, &q->lock);
+  q->state[slot] = SLOT_END;
+  q->status = status;
+  pthread_cond_signal(&q->change);
+  pthread_mutex_unlock(&q->lock);
+  return NULL;
+}
+
+/**
+ * Multiply a vector by the Hessian of the cost.
+ *
+ * The cost is quadratic, its Hessian H = [[sxx, sx], [sx, n]] / n (plus l2
+ * in the weight entry) is the same everywhere and only depends on the
+ * sufficient statistics.
+ *
+ * @param st Pointer to the sufficient statistics of the data set.
+ * @param v  Pointer to the vector (as weight and bias components).
+ * @return Weights - The product H * v.
+ */
+Weights hessian_times(const SuffStats *st, const Weights *v) {
+  Weights hv = {.w = (st->sxx * v->w + st->sx * v->b) / st->n + st->l2 * v->w,
+                .b = (st->sx * v->w + st->n * v->b) / st->n};
+  return hv;
+}
+
+/**
+ * Compute the exact change in cost caused by one update of the weights.
+ *
+ * For a quadratic cost a step d from weights with gradient g changes the
+ * cost by g^T d + d^T H d / 2, which needs no pass over the data.
+ *
+ * @param st Pointer to the sufficient statistics of the data set.
+ * @param g  Pointer to the gradient at the weights before the update.
+ * @param d  Pointer to the update (new weights minus old weights).
+ * @return double - The change in cost (negative while descending).
+ */
+double cost_change(const SuffStats *st, const Weights *g, const Weights *d) {
+  Weights hd = hessian_times(st, d);
+  return g->w * d->w + g->b * d->b + (d->w * hd.w + d->b * hd.b) / 2;
+}
+
+/*
+ * Feature standardization
+ *
+ * Training on x' = (x - mean) / std makes the Hessian the identity in the
+ * weight direction, so a large learning rate converges in a few steps. The
+ * data itself is never rewritten: the model w' x' + b' is the same as
+ * w x + b with w = w' / std and b = b' - w' mean / std, so the gradient is
+ * taken on the raw data at (w, b) and mapped back into the scaled space.
+ * Without standardization the scaling is the identity {0, 1}.
+ */
+
+// Structure to hold the standardization x' = (x - mean) / std
+typedef struct {
+  double mean; // Mean of the inputs
+  double std;  // Standard deviation of the inputs
+} Scaling;
+
+/**
+ * Compute the standardization of the inputs from their statistics.
+ *
+ * @param st Pointer to the sufficient statistics of the data set.
+ * @param sc Pointer to the scaling to fill.
+ * @return int - 0 on success, 1 if the inputs have no variance.
+ */
+int scaling_from_stats(const SuffStats *st, Scaling *sc) {
+  if (st->n == 0)
+    return 1;
+  double var = (st->sxx - st->sx * st->sx / st->n) / st->n;
+  if (var <= 0)
+    return 1;
+  sc->mean = st->sx / st->n;
+  sc->std = sqrt(var);
+  return 0;
+}
+
+/**
+ * Express the sufficient statistics in terms of the standardized inputs.
+ *
+ * @param st Pointer to the statistics of the raw inputs.
+ * @param sc Pointer to the standardization.
+ * @return SuffStats - The statistics of (x - mean) / std and y.
+ */
+SuffStats stats_standardize(const SuffStats *st, const Scaling *sc) {
+  SuffStats scaled = {
+      .n = st->n,
+      .sx = (st->sx - st->n * sc->mean) / sc->std,
+      .sy = st->sy,
+      .sxx = (st->sxx - 2 * sc->mean * st->sx + st->n * sc->mean * sc->mean) /
+             (sc->std * sc->std),
+      .sxy = (st->sxy - sc->mean * st->sy) / sc->std,
+      .syy = st->syy,
+      // The penalties stay on the raw weight w = w' / std
+      .l1 = st->l1 / sc->std,
+      .l2 = st->l2 / (sc->std * sc->std)};
+  return scaled;
+}
+
+/**
+ * Convert weights of the standardized inputs to weights of the raw inputs.
+ *
+ * @param sc Pointer to the standardization.
+ * @param ws Pointer to the weights in the scaled space.
+ * @return Weights - The equivalent weights on the original scale.
+ */
+Weights unscale_weights(const Scaling *sc, const Weights *ws) {
+  Weights raw = {.w = ws->w / sc->std, .b = ws->b - ws->w * sc->mean / sc->std};
+  return raw;
+}
+
+/**
+ * Convert weights of the raw inputs to weights of the standardized inputs.
+ *
+ * @param sc Pointer to the standardization.
+ * @param ws Pointer to the weights on the original scale.
+ * @return Weights - The equivalent weights in the scaled space.
+ */
+Weights scale_weights(const Scaling *sc, const Weights *ws) {
+  Weights scaled = {.w = ws->w * sc->std, .b = ws->b + ws->w * sc->mean};
+  return scaled;
+}
+
+/**
+ * Convert a gradient taken on the raw inputs into the scaled space.
+ *
+ * @param sc Pointer to the standardization.
+ * @param g  Pointer to the gradient with respect to the raw (w, b).
+ * @return Weights - The gradient with respect to the scaled (w', b').
+ */
+Weights scale_gradient(const Scaling *sc, const Weights *g) {
+  Weights scaled = {.w = (g->w - sc->mean * g->b) / sc->std, .b = g->b};
+  return scaled;
+}
+
+// Structure to hold the state of the early stopping criteria
+typedef struct {
+  double tolerance; // Stop once the gradient norm is below this, 0 disables
+  double min_delta; // Stop once the cost changes by less than this, 0 disables
+  int patience;     // Consecutive converged iterations needed to stop
+  int streak;       // Consecutive converged iterations so far
+} EarlyStop;
+
+/**
+ * Check whether training has converged after one more iteration.
+ *
+ * @param es        Pointer to the early stopping state.
+ * @param grad_norm Norm of the gradient of the iteration.
+ * @param delta     Change in cost caused by the iteration.
+ * @return int - 1 if training should stop, 0 otherwise.
+ */
+int early_stop(EarlyStop *es, double grad_norm, double delta) {
+  int converged =
+      (es->tolerance > 0 && grad_norm < es->tolerance) ||
+      (es->min_delta > 0 && (delta < 0 ? -delta : delta) < es->min_delta);
+  es->streak = converged ? es->streak + 1 : 0;
+  return es->streak >= es->patience;
+}
+
+// Update rules that can be selected in the settings file
+typedef enum {
+  OPT_GD,         // Plain gradient descent
+  OPT_MOMENTUM,   // Heavy ball momentum
+  OPT_NESTEROV,   // Nesterov accelerated gradient
+  OPT_RMSPROP,    // Per-parameter step scaled by the gradient RMS
+  OPT_ADAM,       // RMSProp with momentum and bias correction
+  OPT_LINE_SEARCH // Exact minimisation along the negative gradient
+} OptimizerKind;
+
+// Names of the optimizers, indexed by OptimizerKind
+static const char *const optimizer_names[] = {
+    "gd", "momentum", "nesterov", "rmsprop", "adam", "line-search"};
+
+// Structure to hold an optimizer's hyperparameters and running state
+typedef struct {
+  OptimizerKind kind; // Update rule
+  double alpha;       // Learning rate
+  double momentum;    // Velocity decay of momentum and nesterov
+  double beta1;       // First moment decay of adam
+  double beta2;       // Second moment decay of rmsprop and adam
+  double epsilon;     // Keeps the rmsprop and adam steps finite
+  Weights velocity;   // Velocity, or the first moment for adam
+  Weights second;     // Running mean of the squared gradient
+  long t;             // Number of steps taken, for adam's bias correction
+} Optimizer;
+
+/**
+ * Get the weights the next gradient has to be evaluated at.
+ *
+ * Nesterov looks ahead along the velocity, every other rule evaluates the
+ * gradient at the current weights.
+ *
+ * @param opt Pointer to the optimizer.
+ * @param ws  Pointer to the current weights.
+ * @return Weights - The point to evaluate the gradient at.
+ */
+Weights optimizer_lookahead(const Optimizer *opt, const Weights *ws) {
+  if (opt->kind != OPT_NESTEROV)
+    return *ws;
+  Weights at = {.w = ws->w + opt->momentum * opt->velocity.w,
+                .b = ws->b + opt->momentum * opt->velocity.b};
+  return at;
+}
+
+/**
+ * Update the weights with one step of the given rule, the body of
+ * optimizer_step(). Always inlined, so a caller passing a constant kind
+ * gets the code of that one rule, see Specialized training loops.
+ */
+__attribute__((always_inline)) static inline void
+optimizer_update(Optimizer *opt, Weights *ws, const Weights *g,
+                 const SuffStats *st, OptimizerKind kind) {
+  opt->t++;
+  switch (kind) {
+  case OPT_GD:
+    ws->w -= opt->alpha * g->w;
+    ws->b -= opt->alpha * g->b;
+    break;
+  case OPT_MOMENTUM:
+  case OPT_NESTEROV:
+    // Both keep v = momentum * v - alpha * g, they differ in where g is taken
+    opt->velocity.w = opt->momentum * opt->velocity.w - opt->alpha * g->w;
+    opt->velocity.b = opt->momentum * opt->velocity.b - opt->alpha * g->b;
+    ws->w += opt->velocity.w;
+    ws->b += opt->velocity.b;
+    break;
+  case OPT_RMSPROP:
+  case OPT_ADAM: {
+    double b2 = opt->beta2;
+    opt->second.w = b2 * opt->second.w + (1 - b2) * g->w * g->w;
+    opt->second.b = b2 * opt->second.b + (1 - b2) * g->b * g->b;
+    Weights m = *g, v = opt->second;
+    if (kind == OPT_ADAM) {
+      // Bias corrected first and second moments
+      double b1 = opt->beta1;
+      opt->velocity.w = b1 * opt->velocity.w + (1 - b1) * g->w;
+      opt->velocity.b = b1 * opt->velocity.b + (1 - b1) * g->b;
+      double c1 = 1 - pow(b1, opt->t), c2 = 1 - pow(b2, opt->t);
+      m = (Weights){.w = opt->velocity.w / c1, .b = opt->velocity.b / c1};
+      v = (Weights){.w = v.w / c2, .b = v.b / c2};
+    }
+    ws->w -= opt->alpha * m.w / (sqrt(v.w) + opt->epsilon);
+    ws->b -= opt->alpha * m.b / (sqrt(v.b) + opt->epsilon);
+    break;
+  }
+  case OPT_LINE_SEARCH: {
+    // The cost along -g is a parabola, its minimum is at |g|^2 / g^T H g
+    Weights hg = hessian_times(st, g);
+    double curvature = g->w * hg.w + g->b * hg.b;
+    if (curvature > 0) {
+      double step = (g->w * g->w + g->b * g->b) / curvature;
+      ws->w -= step * g->w;
+      ws->b -= step * g->b;
+    }
+    break;
+  }
+  }
+}
+
+/**
+ * Update the weights with the gradient taken at optimizer_lookahead().
+ *
+ * @param opt Pointer to the optimizer, its state is advanced.
+ * @param ws  Pointer to the weights, updated in place.
+ * @param g   Pointer to the gradient.
+ * @param st  Pointer to the sufficient statistics, only used by the line
+ *            search (may be NULL otherwise).
+ */
+void optimizer_step(Optimizer *opt, Weights *ws, const Weights *g,
+                    const SuffStats *st) {
+  optimizer_update(opt, ws, g, st, opt->kind);
+}
+
+/**
+ * Get the point the next gradient of a multivariate run has to be evaluated
+ * at, the vector form of optimizer_lookahead().
+ *
+ * @param opt      Pointer to the optimizer.
+ * @param theta    Pointer to the k current parameters.
+ * @param velocity Pointer to the k velocities.
+ * @param at       Pointer to k doubles receiving the point.
+ * @param k        Number of parameters.
+ */
+void optimizer_lookahead_vec(const Optimizer *opt, const double *theta,
+                             const double *velocity, double *at, size_t k) {
+  for (size_t j = 0; j < k; j++)
+    at[j] = opt->kind == OPT_NESTEROV
+                ? theta[j] + opt->momentum * velocity[j]
+                : theta[j];
+}
+
+/**
+ * Update the parameters of a multivariate run, the vector form of
+ * optimizer_step(). The line search is not available, it needs the Hessian.
+ *
+ * @param opt      Pointer to the optimizer, its step count is advanced.
+ * @param theta    Pointer to the k parameters, updated in place.
+ * @param g        Pointer to the k gradient entries.
+ * @param velocity Pointer to the k velocities (first moments for adam).
+ * @param second   Pointer to the k running means of the squared gradient.
+ * @param k        Number of parameters.
+ */
+void optimizer_step_vec(Optimizer *opt, double *theta, const double *g,
+                        double *velocity, double *second, size_t k) {
+  opt->t++;
+  double c1 = 1 - pow(opt->beta1, opt->t), c2 = 1 - pow(opt->beta2, opt->t);
+  for (size_t j = 0; j < k; j++) {
+    switch (opt->kind) {
+    case OPT_GD:
+    case OPT_LINE_SEARCH:
+      theta[j] -= opt->alpha * g[j];
+      break;
+    case OPT_MOMENTUM:
+    case OPT_NESTEROV:
+      velocity[j] = opt->momentum * velocity[j] - opt->alpha * g[j];
+      theta[j] += velocity[j];
+      break;
+    case OPT_RMSPROP:
+    case OPT_ADAM: {
+      second[j] = opt->beta2 * second[j] + (1 - opt->beta2) * g[j] * g[j];
+      double m = g[j], v = second[j];
+      if (opt->kind == OPT_ADAM) {
+        velocity[j] = opt->beta1 * velocity[j] + (1 - opt->beta1) * g[j];
+        m = velocity[j] / c1;
+        v /= c2;
+      }
+      theta[j] -= opt->alpha * m / (sqrt(v) + opt->epsilon);
+      break;
+    }
+    }
+  }
+}
+
+/*
+ * Distributed training
+ *
+ * Every node of a distributed run loads its own shard and they combine
+ * their partial results over a ring of TCP connections: each node connects
+ * to the next rank and accepts the previous one. The peers file lists one
+ * "host port" line per node in rank order, the same file on every node.
+ *
+ * The payloads are a handful of doubles, so the cost of a reduction is the
+ * latency of the hops and not bandwidth. ring_allreduce() therefore
+ * forwards every node's whole vector around the ring (an allgather, N - 1
+ * hops instead of the 2 (N - 1) of a reduce-scatter and allgather) and
+ * then every node adds the N vectors up in rank order itself. All nodes
+ * end up with bit-identical sums, take the same steps and make the same
+ * early stopping decisions without further coordination.
+ */
+
+// Most doubles a single reduction combines
+#define RING_MAX 8
+
+// Seconds a node keeps retrying to reach the next one while it starts
+#define RING_CONNECT_SECONDS 60
+
+// Seconds a read or write of the ring may block before the peer counts as
+// lost (a crashed host or a partition sends no FIN or RST). It has to
+// cover the slowest node loading its shard or taking a gradient pass.
+#define RING_TIMEOUT_SECONDS 600
+
+// Structure to hold a node's connections of the ring
+typedef struct {
+  int nodes;      // Number of nodes, 1 when the run is not distributed
+  int rank;       // Position of this node, 0 logs and writes the output
+  int next, prev; // Sockets to the next and from the previous rank
+  double *blocks; // Every node's vector of the current reduction
+} Ring;
+
+/**
+ * Write exactly bytes bytes to a socket. A closed peer is an error, not a
+ * SIGPIPE.
+ */
+static int write_all(int fd, const void *buf, size_t bytes) {
+  const char *p = buf;
+  while (bytes > 0) {
+    ssize_t done = send(fd, p, bytes, MSG_NOSIGNAL);
+    if (done <= 0)
+      return 1;
+    p += done;
+    bytes -= done;
+  }
+  return 0;
+}
+
+/**
+ * Read exactly bytes bytes from a socket.
+ */
+static int read_all(int fd, void *buf, size_t bytes) {
+  char *p = buf;
+  while (bytes > 0) {
+    ssize_t done = read(fd, p, bytes);
+    if (done <= 0)
+      return 1;
+    p += done;
+    bytes -= done;
+  }
+  return 0;
+}
+
+/**
+ * Connect to a peer, retrying while it has not started listening yet.
+ *
+ * @return int - The connected socket, or -1 (the error has been reported).
+ */
+static int ring_connect(const char *host, const char *port) {
+  struct addrinfo hints = {.ai_family = AF_UNSPEC,
+                           .ai_socktype = SOCK_STREAM},
+                  *addrs;
+  int err = getaddrinfo(host, port, &hints, &addrs);
+  if (err != 0) {
+    fprintf(stderr, "Error: cannot resolve %s: %s\n", host, gai_strerror(err));
+    return -1;
+  }
+  for (int attempt = 0; attempt < RING_CONNECT_SECONDS * 10; attempt++) {
+    for (struct addrinfo *a = addrs; a != NULL; a = a->ai_next) {
+      int fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+      if (fd >= 0 && connect(fd, a->ai_addr, a->ai_addrlen) == 0) {
+        freeaddrinfo(addrs);
+        return fd;
+      }
+      if (fd >= 0)
+        close(fd);
+    }
+    nanosleep(&(struct timespec){.tv_nsec = 100000000}, NULL);
+  }
+  freeaddrinfo(addrs);
+  fprintf(stderr, "Error: could not connect to %s:%s\n", host, port);
+  return -1;
+}
+
+/**
+ * Join the ring described by a peers file.
+ *
+ * @param ring  Pointer to the ring to set up.
+ * @param path  Path of the peers file, one "host port" line per rank.
+ * @param rank  Rank of this node.
+ * @return int - 0 on success, 1 on error (the error has been reported).
+ */
+int ring_open(Ring *ring, const char *path, int rank) {
+  *ring = (Ring){.nodes = 1, .next = -1, .prev = -1};
+  FILE *file = fopen(path, "r");
+  if (file == NULL) {
+    perror("Error opening peers file");
+    return 1;
+  }
+  char host[256], port[16];
+  char next_host[256] = "", next_port[16] = ""; // Rank 0 after the last
+  int nodes = 0, own_port = 0;
+  while (fscanf(file, "%255s %15s", host, port) == 2) {
+    long long number;
+    if (parse_count(port, 1, 65535, &number) != 0) {
+      fprintf(stderr, "Error: invalid port %s on line %d of %s\n", port,
+              nodes + 1, path);
+      fclose(file);
+      return 1;
+    }
+    if (nodes == rank)
+      own_port = number;
+    if (nodes == rank + 1 || nodes == 0) {
+      strcpy(next_host, host);
+      strcpy(next_port, port);
+    }
+    nodes++;
+  }
+  fclose(file);
+  if (nodes == 0) {
+    fprintf(stderr, "Error: %s lists no \"host port\" lines\n", path);
+    return 1;
+  }
+  if (rank >= nodes) {
+    fprintf(stderr, "Error: rank %d is not in %s (%d nodes, ranks 0 to %d)\n",
+            rank, path, nodes, nodes - 1);
+    return 1;
+  }
+  ring->rank = rank;
+  ring->blocks = malloc(nodes * RING_MAX * sizeof(double));
+  if (ring->blocks == NULL) {
+    perror("Error allocating memory");
+    return 1;
+  }
+  if (nodes == 1)
+    return 0;
+
+  // Listen first so the previous rank can connect while this one is still
+  // reaching the next
+  int server = socket(AF_INET, SOCK_STREAM, 0), on = 1;
+  struct sockaddr_in addr = {.sin_family = AF_INET,
+                             .sin_port = htons(own_port),
+                             .sin_addr.s_addr = htonl(INADDR_ANY)};
+  if (server < 0 ||
+      setsockopt(server, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) != 0 ||
+      bind(server, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+      listen(server, 1) != 0) {
+    perror("Error listening for the previous rank");
+    if (server >= 0)
+      close(server);
+    return 1;
+  }
+  // The previous rank retries for as long as this one does, a rank that
+  // never starts must not block the accept forever
+  ring->next = ring_connect(next_host, next_port);
+  if (ring->next >= 0) {
+    struct pollfd pending = {.fd = server, .events = POLLIN};
+    int ready = poll(&pending, 1, (RING_CONNECT_SECONDS + 10) * 1000);
+    if (ready > 0)
+      ring->prev = accept(server, NULL, NULL);
+    else if (ready == 0)
+      fprintf(stderr, "Error: the previous rank did not connect within %d "
+                      "seconds\n",
+              RING_CONNECT_SECONDS + 10);
+    else
+      perror("Error accepting the previous rank");
+    if (ready > 0 && ring->prev < 0)
+      perror("Error accepting the previous rank");
+  }
+  close(server);
+  if (ring->next < 0 || ring->prev < 0)
+    return 1;
+
+  // Every step is a few small writes, send them right away. A peer that
+  // stops answering fails the reads and writes after RING_TIMEOUT_SECONDS.
+  struct timeval timeout = {.tv_sec = RING_TIMEOUT_SECONDS};
+  for (int k = 0; k < 2; k++) {
+    int fd = k == 0 ? ring->next : ring->prev;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+  }
+
+  // Check that the neighbours agree on the ring
+  int32_t hello[2] = {nodes, rank}, peer[2];
+  if (write_all(ring->next, hello, sizeof(hello)) != 0 ||
+      read_all(ring->prev, peer, sizeof(peer)) != 0) {
+    fprintf(stderr, "Error: lost the connection to a peer\n");
+    return 1;
+  }
+  if (peer[0] != nodes || peer[1] != (rank + nodes - 1) % nodes) {
+    fprintf(stderr, "Error: the previous rank does not match %s\n", path);
+    return 1;
+  }
+  ring->nodes = nodes;
+  return 0;
+}
+
+/**
+ * Sum a vector over all nodes, every node receives the same sums.
+ *
+ * @param ring Pointer to the ring.
+ * @param v    Vector of this node, replaced by the sums over all nodes.
+ * @param k    Number of elements, at most RING_MAX.
+ * @return int - 0 on success, 1 if a peer failed (the error has been
+ *               reported).
+ */
+int ring_allreduce(Ring *ring, double *v, size_t k) {
+  if (ring->nodes == 1)
+    return 0;
+
+  // In step s pass on the vector of rank - s and receive that of
+  // rank - s - 1, after N - 1 steps every node holds all of them
+  memcpy(ring->blocks + ring->rank * k, v, k * sizeof(double));
+  for (int s = 0; s + 1 < ring->nodes; s++) {
+    int out = (ring->rank - s + ring->nodes) % ring->nodes;
+    int in = (out - 1 + ring->nodes) % ring->nodes;
+    if (write_all(ring->next, ring->blocks + out * k, k * sizeof(double)) ||
+        read_all(ring->prev, ring->blocks + in * k, k * sizeof(double))) {
+      fprintf(stderr, "Error: lost the connection to a peer\n");
+      return 1;
+    }
+  }
+
+  // Add up in rank order so the sums do not depend on the position
+  for (size_t j = 0; j < k; j++) {
+    v[j] = ring->blocks[j];
+    for (int r = 1; r < ring->nodes; r++)
+      v[j] += ring->blocks[r * k + j];
+  }
+  return 0;
+}
+
+/**
+ * Combine the sufficient statistics of every node's shard.
+ *
+ * @param ring Pointer to the ring.
+ * @param st   Statistics of the local shard, replaced by the global ones.
+ * @return int - 0 on success, 1 if a peer failed (the error has been
+ *               reported).
+ */
+int ring_stats(Ring *ring, SuffStats *st) {
+  double v[6] = {st->n, st->sx, st->sy, st->sxx, st->sxy, st->syy};
+  if (ring_allreduce(ring, v, 6) != 0)
+    return 1;
+  *st = (SuffStats){.n = v[0],
+                    .sx = v[1],
+                    .sy = v[2],
+                    .sxx = v[3],
+                    .sxy = v[4],
+                    .syy = v[5]};
+  return 0;
+}
+
+/**
+ * Compute the gradient over the shards of all nodes.
+ *
+ * Each node sums its shard like gradient() and the unaveraged sums and the
+ * pair counts are added up, so the result is the gradient of the whole
+ * data set.
+ *
+ * @param ring Pointer to the ring.
+ * @param x    Pointer to the inputs of the local shard.
+ * @param y    Pointer to the targets of the local shard.
+ * @param ws   Pointer to the current weights (w, b) of the model.
+ * @param g    Pointer receiving the gradients (dj_dw, dj_db).
+ * @param cost Pointer receiving the cost over all shards, or NULL.
+ * @return int - 0 on success, 1 if a peer failed (the error has been
+ *               reported).
+ */
+int ring_gradient(Ring *ring, const IntVec *x, const IntVec *y,
+                  const Weights *ws, Weights *g, double *cost) {
+  double sse = 0;
+  Weights sums = gradient_sums(
+      x, y, ws, cost != NULL && cost_kernel != NULL ? &sse : NULL);
+  if (cost != NULL && cost_kernel == NULL && x->size > 0)
+    sse = data_cost(x, y, ws) * 2 * x->size;
+  double v[4] = {sums.w, sums.b, x->size, sse};
+  if (ring_allreduce(ring, v, cost != NULL ? 4 : 3) != 0)
+    return 1;
+  *g = (Weights){.w = v[0] / v[2], .b = v[1] / v[2]};
+  if (cost != NULL)
+    *cost = v[3] / (2 * v[2]);
+  return 0;
+}
+
+/**
+ * Leave the ring.
+ *
+ * @param ring Pointer to the ring.
+ */
+void ring_close(Ring *ring) {
+  if (ring->next >= 0)
+    close(ring->next);
+  if (ring->prev >= 0)
+    close(ring->prev);
+  free(ring->blocks);
+  *ring = (Ring){.nodes = 1, .next = -1, .prev = -1};
+}
+
+/*
+ * OpenCL backend
+ *
+ * Built with -DLR_WITH_OPENCL (link -lOpenCL) the gradient passes of
+ * univariate gradient descent can run on a GPU, selected with device
+ * opencl. The int32 columns are copied to the device once and stay there.
+ * Every iteration launches two kernels: the first has each work-group sum
+ * a grid-stride share of the pairs into one partial, the second adds the
+ * partials up in group order. Only the three resulting sums (dw, db and
+ * the squared errors) are read back, the whole exchange per iteration is
+ * the two weights in and 24 bytes out.
+ *
+ * The kernels need double precision (cl_khr_fp64). A fixed launch shape
+ * gives the same result every run on the same device, but not the same
+ * result as the CPU kernels since the sums are added in a different order.
+ */
+
+#ifdef LR_WITH_OPENCL
+// Largest work-group the reductions use, a power of two
+#define GPU_LOCAL_MAX 256
+
+// Work-groups per compute unit of the partials kernel
+#define GPU_GROUPS_PER_UNIT 8
+
+// Source of the two reduction kernels, built for the device at start
+static const char gpu_source[] =
+    "#pragma OPENCL EXTENSION cl_khr_fp64 : enable\n"
+    "static void reduce3(__local double *s, double a, double b, double c) {\n"
+    "  size_t l = get_local_id(0);\n"
+    "  s[3 * l] = a;\n"
+    "  s[3 * l + 1] = b;\n"
+    "  s[3 * l + 2] = c;\n"
+    "  barrier(CLK_LOCAL_MEM_FENCE);\n"
+    "  for (size_t h = get_local_size(0) / 2; h > 0; h /= 2) {\n"
+    "    if (l < h)\n"
+    "      for (int k = 0; k < 3; k++)\n"
+    "        s[3 * l + k] += s[3 * (l + h) + k];\n"
+    "    barrier(CLK_LOCAL_MEM_FENCE);\n"
+    "  }\n"
+    "}\n"
+    "__kernel void partials(__global const int *x, __global const int *y,\n"
+    "                       ulong n, double w, double b,\n"
+    "                       __global double *out, __local double *s) {\n"
+    "  double dw = 0, db = 0, se = 0;\n"
+    "  for (ulong i = get_global_id(0); i < n; i += get_global_size(0)) {\n"
+    "    double xi = x[i], err = w * xi + b - y[i];\n"
+    "    dw += err * xi;\n"
+    "    db += err;\n"
+    "    se += err * err;\n"
+    "  }\n"
+    "  reduce3(s, dw, db, se);\n"
+    "  if (get_local_id(0) == 0)\n"
+    "    for (int k = 0; k < 3; k++)\n"
+    "      out[3 * get_group_id(0) + k] = s[k];\n"
+    "}\n"
+    "__kernel void finish(__global const double *in, uint groups,\n"
+    "                     __global double *out, __local double *s) {\n"
+    "  double dw = 0, db = 0, se = 0;\n"
+    "  for (uint g = get_local_id(0); g < groups; g += get_local_size(0)) {\n"
+    "    dw += in[3 * g];\n"
+    "    db += in[3 * g + 1];\n"
+    "    se += in[3 * g + 2];\n"
+    "  }\n"
+    "  reduce3(s, dw, db, se);\n"
+    "  if (get_local_id(0) == 0)\n"
+    "    for (int k = 0; k < 3; k++)\n"
+    "      out[k] = s[k];\n"
+    "}\n";
+
+// Structure to hold the device, its copy of the data and the kernels
+typedef struct {
+  cl_context context;
+  cl_command_queue queue;
+  cl_program program;
+  cl_kernel partials, finish; // The two reduction kernels
+  cl_mem x, y;                // The columns, resident for the whole run
+  cl_mem groupsums, sums;     // Partials of the groups and the 3 sums
+  size_t n;                   // Number of pairs
+  size_t local, groups;       // Launch shape of the partials kernel
+} GpuBackend;
+
+/**
+ * Report a failed OpenCL call.
+ *
+ * @param what Name of the call.
+ * @param err  Its error code.
+ * @return int - Always 1.
+ */
+static int gpu_error(const char *what, cl_int err) {
+  fprintf(stderr, "Error: OpenCL %s failed (%d)\n", what, (int)err);
+  return 1;
+}
+
+/**
+ * Pick the first device with double precision, GPUs before the others.
+ */
+static int gpu_device(cl_device_id *device) {
+  cl_platform_id platforms[16];
+  cl_uint nplatforms = 0;
+  cl_int err = clGetPlatformIDs(16, platforms, &nplatforms);
+  if (err != CL_SUCCESS || nplatforms == 0) {
+    fprintf(stderr, "Error: no OpenCL platform found\n");
+    return 1;
+  }
+  if (nplatforms > 16)
+    nplatforms = 16;
+  cl_device_type types[] = {CL_DEVICE_TYPE_GPU, CL_DEVICE_TYPE_ALL};
+  for (int t = 0; t < 2; t++)
+    for (cl_uint p = 0; p < nplatforms; p++) {
+      cl_device_id devices[16];
+      cl_uint ndevices = 0;
+      if (clGetDeviceIDs(platforms[p], types[t], 16, devices, &ndevices) !=
+          CL_SUCCESS)
+        continue;
+      for (cl_uint d = 0; d < ndevices && d < 16; d++) {
+        cl_device_fp_config fp64 = 0;
+        clGetDeviceInfo(devices[d], CL_DEVICE_DOUBLE_FP_CONFIG, sizeof(fp64),
+                        &fp64, NULL);
+        if (fp64 != 0) {
+          *device = devices[d];
+          return 0;
+        }
+      }
+    }
+  fprintf(stderr, "Error: no OpenCL device with double precision found\n");
+  return 1;
+}
+
+/**
+ * Set up the device and copy the pairs to it.
+ *
+ * @param gpu Pointer to the backend, zeroed.
+ * @param x   Pointer to the inputs, int32.
+ * @param y   Pointer to the targets, int32.
+ * @return int - 0 on success, 1 on error (the error has been reported).
+ */
+int gpu_open(GpuBackend *gpu, const IntVec *x, const IntVec *y) {
+  cl_device_id device;
+  cl_int err;
+  if (x->size == 0) {
+    fprintf(stderr, "Error: no input-target pairs\n");
+    return 1;
+  }
+  if (gpu_device(&device) != 0)
+    return 1;
+  gpu->n = x->size;
+  gpu->context = clCreateContext(NULL, 1, &device, NULL, NULL, &err);
+  if (err != CL_SUCCESS)
+    return gpu_error("clCreateContext", err);
+  gpu->queue = clCreateCommandQueue(gpu->context, device, 0, &err);
+  if (err != CL_SUCCESS)
+    return gpu_error("clCreateCommandQueue", err);
+
+  // Build the kernels, the build log says why a build failed
+  const char *source = gpu_source;
+  gpu->program =
+      clCreateProgramWithSource(gpu->context, 1, &source, NULL, &err);
+  if (err != CL_SUCCESS)
+    return gpu_error("clCreateProgramWithSource", err);
+  err = clBuildProgram(gpu->program, 1, &device, NULL, NULL, NULL);
+  if (err != CL_SUCCESS) {
+    char build_log[4096] = "";
+    clGetProgramBuildInfo(gpu->program, device, CL_PROGRAM_BUILD_LOG,
+                          sizeof(build_log) - 1, build_log, NULL);
+    fprintf(stderr, "%s\n", build_log);
+    return gpu_error("clBuildProgram", err);
+  }
+  gpu->partials = clCreateKernel(gpu->program, "partials", &err);
+  if (err != CL_SUCCESS)
+    return gpu_error("clCreateKernel", err);
+  gpu->finish = clCreateKernel(gpu->program, "finish", &err);
+  if (err != CL_SUCCESS)
+    return gpu_error("clCreateKernel", err);
+
+  // The largest power of two work-group the kernels allow, and enough
+  // groups to keep every compute unit busy
+  size_t max_local = 1;
+  cl_uint units = 1;
+  clGetKernelWorkGroupInfo(gpu->partials, device, CL_KERNEL_WORK_GROUP_SIZE,
+                           sizeof(max_local), &max_local, NULL);
+  clGetDeviceInfo(device, CL_DEVICE_MAX_COMPUTE_UNITS, sizeof(units), &units,
+                  NULL);
+  gpu->local = 1;
+  while (gpu->local * 2 <= max_local && gpu->local * 2 <= GPU_LOCAL_MAX)
+    gpu->local *= 2;
+  gpu->groups = (size_t)units * GPU_GROUPS_PER_UNIT;
+  if (gpu->groups * gpu->local > gpu->n)
+    gpu->groups = (gpu->n + gpu->local - 1) / gpu->local;
+
+  // Copy the columns once, they stay on the device for the whole run
+  gpu->x = clCreateBuffer(gpu->context,
+                          CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+                          gpu->n * sizeof(int), x->data, &err);
+  if (err != CL_SUCCESS)
+    return gpu_error("clCreateBuffer", err);
+  gpu->y = clCreateBuffer(gpu->context,
+                          CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+                          gpu->n * sizeof(int), y->data, &err);
+  if (err != CL_SUCCESS)
+    return gpu_error("clCreateBuffer", err);
+  gpu->groupsums = clCreateBuffer(gpu->context, CL_MEM_READ_WRITE,
+                                  gpu->groups * 3 * sizeof(double), NULL,
+                                  &err);
+  if (err != CL_SUCCESS)
+    return gpu_error("clCreateBuffer", err);
+  gpu->sums = clCreateBuffer(gpu->context, CL_MEM_WRITE_ONLY,
+                             3 * sizeof(double), NULL, &err);
+  if (err != CL_SUCCESS)
+    return gpu_error("clCreateBuffer", err);
+
+  // The arguments that do not change between iterations
+  cl_ulong n = gpu->n;
+  cl_uint groups = gpu->groups;
+  err = clSetKernelArg(gpu->partials, 0, sizeof(cl_mem), &gpu->x);
+  err |= clSetKernelArg(gpu->partials, 1, sizeof(cl_mem), &gpu->y);
+  err |= clSetKernelArg(gpu->partials, 2, sizeof(n), &n);
+  err |= clSetKernelArg(gpu->partials, 5, sizeof(cl_mem), &gpu->groupsums);
+  err |= clSetKernelArg(gpu->partials, 6, 3 * gpu->local * sizeof(double),
+                        NULL);
+  err |= clSetKernelArg(gpu->finish, 0, sizeof(cl_mem), &gpu->groupsums);
+  err |= clSetKernelArg(gpu->finish, 1, sizeof(groups), &groups);
+  err |= clSetKernelArg(gpu->finish, 2, sizeof(cl_mem), &gpu->sums);
+  err |= clSetKernelArg(gpu->finish, 3, 3 * gpu->local * sizeof(double),
+                        NULL);
+  if (err != CL_SUCCESS)
+    return gpu_error("clSetKernelArg", err);
+  return 0;
+}
+
+/**
+ * Compute the gradient, and with cost the cost, on the device.
+ *
+ * @param gpu  Pointer to the backend.
+ * @param ws   Pointer to the current weights (w, b) of the model.
+ * @param g    Pointer receiving the gradients (dj_dw, dj_db).
+ * @param cost Pointer receiving the cost of the weights, or NULL.
+ * @return int - 0 on success, 1 on error (the error has been reported).
+ */
+int gpu_gradient(GpuBackend *gpu, const Weights *ws, Weights *g,
+                 double *cost) {
+  double w = ws->w, b = ws->b, sums[3];
+  size_t global = gpu->groups * gpu->local;
+  cl_int err = clSetKernelArg(gpu->partials, 3, sizeof(w), &w);
+  err |= clSetKernelArg(gpu->partials, 4, sizeof(b), &b);
+  if (err != CL_SUCCESS)
+    return gpu_error("clSetKernelArg", err);
+  err = clEnqueueNDRangeKernel(gpu->queue, gpu->partials, 1, NULL, &global,
+                               &gpu->local, 0, NULL, NULL);
+  if (err != CL_SUCCESS)
+    return gpu_error("clEnqueueNDRangeKernel", err);
+  err = clEnqueueNDRangeKernel(gpu->queue, gpu->finish, 1, NULL, &gpu->local,
+                               &gpu->local, 0, NULL, NULL);
+  if (err != CL_SUCCESS)
+    return gpu_error("clEnqueueNDRangeKernel", err);
+  err = clEnqueueReadBuffer(gpu->queue, gpu->sums, CL_TRUE, 0, sizeof(sums),
+                            sums, 0, NULL, NULL);
+  if (err != CL_SUCCESS)
+    return gpu_error("clEnqueueReadBuffer", err);
+  *g = (Weights){.w = sums[0] / gpu->n, .b = sums[1] / gpu->n};
+  if (cost != NULL)
+    *cost = sums[2] / (2 * gpu->n);
+  return 0;
+}
+
+/**
+ * Release the device and its copy of the data.
+ *
+ * @param gpu Pointer to the backend.
+ */
+void gpu_close(GpuBackend *gpu) {
+  if (gpu->x != NULL)
+    clReleaseMemObject(gpu->x);
+  if (gpu->y != NULL)
+    clReleaseMemObject(gpu->y);
+  if (gpu->groupsums != NULL)
+    clReleaseMemObject(gpu->groupsums);
+  if (gpu->sums != NULL)
+    clReleaseMemObject(gpu->sums);
+  if (gpu->partials != NULL)
+    clReleaseKernel(gpu->partials);
+  if (gpu->finish != NULL)
+    clReleaseKernel(gpu->finish);
+  if (gpu->program != NULL)
+    clReleaseProgram(gpu->program);
+  if (gpu->queue != NULL)
+    clReleaseCommandQueue(gpu->queue);
+  if (gpu->context != NULL)
+    clReleaseContext(gpu->context);
+  *gpu = (GpuBackend){0};
+}
+#else
+// Without OpenCL main() rejects device opencl before any of these run
+typedef struct {
+  int unused;
+} GpuBackend;
+
+int gpu_open(GpuBackend *gpu, const IntVec *x, const IntVec *y) {
+  (void)gpu, (void)x, (void)y;
+  fprintf(stderr, "Error: device opencl needs a build with "
+                  "-DLR_WITH_OPENCL\n");
+  return 1;
+}
+
+int gpu_gradient(GpuBackend *gpu, const Weights *ws, Weights *g,
+                 double *cost) {
+  (void)gpu, (void)ws, (void)g, (void)cost;
+  return 1;
+}
+
+void gpu_close(GpuBackend *gpu) { (void)gpu; }
+#endif
+
+/*
+ * Instrumentation
+ *
+ * Built with -DLR_INSTRUMENT the trainer times its phases (loading, every
+ * gradient pass, every weight update and every logged iteration) with the
+ * cycle counter and keeps per-phase counts, totals, extremes and a log2
+ * histogram of the cycles. The tables are printed on stderr at exit and
+ * whenever the process receives SIGUSR1:
+ *   kill -USR1 <pid>
+ * Without the flag the INSTRUMENT_* macros expand to nothing.
+ */
+#ifdef LR_INSTRUMENT
+
+// Phases that are timed
+typedef enum {
+  PHASE_LOAD,
+  PHASE_GRADIENT,
+  PHASE_UPDATE,
+  PHASE_LOGGING,
+  PHASE_COUNT
+} Phase;
+
+// Names of the phases, indexed by Phase
+static const char *const phase_names[] = {"load", "gradient", "update",
+                                          "logging"};
+
+// Bucket b of the histogram counts durations in [2^b, 2^(b + 1)) cycles
+#define PHASE_BUCKETS 64
+
+// Structure to hold the timings of one phase
+typedef struct {
+  uint64_t count;                  // Number of timed calls
+  uint64_t total;                  // Sum of their cycles
+  uint64_t min;                    // Shortest call
+  uint64_t max;                    // Longest call
+  uint64_t buckets[PHASE_BUCKETS]; // Log2 histogram of the cycles
+} PhaseStats;
+
+// Timings of every phase, only touched by the main thread
+static PhaseStats phase_stats[PHASE_COUNT];
+
+// Set by the SIGUSR1 handler, the training loops print the tables
+static volatile sig_atomic_t dump_requested = 0;
+
+/**
+ * Read the cycle counter (the time stamp counter on x86, the virtual counter
+ * on ARM and nanoseconds elsewhere).
+ *
+ * @return uint64_t - The current count.
+ */
+static inline uint64_t read_cycles(void) {
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#elif defined(__aarch64__)
+  uint64_t count;
+  __asm__ volatile("mrs %0, cntvct_el0" : "=r"(count));
+  return count;
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+/**
+ * Add one timed call to the statistics of a phase.
+ *
+ * @param phase  The phase that was timed.
+ * @param cycles Duration of the call.
+ */
+static inline void phase_record(Phase phase, uint64_t cycles) {
+  PhaseStats *s = &phase_stats[phase];
+  if (s->count == 0 || cycles < s->min)
+    s->min = cycles;
+  if (cycles > s->max)
+    s->max = cycles;
+  s->count++;
+  s->total += cycles;
+  s->buckets[cycles == 0 ? 0 : 63 - __builtin_clzll(cycles)]++;
+}
+
+/**
+ * Estimate a percentile of a phase from its histogram.
+ *
+ * @param s Pointer to the phase statistics.
+ * @param q Fraction of the calls, e.g. 0.99.
+ * @return uint64_t - The upper bound of the bucket holding the percentile.
+ */
+static uint64_t phase_percentile(const PhaseStats *s, double q) {
+  uint64_t rank = (uint64_t)ceil(q * s->count), seen = 0;
+  for (int b = 0; b < PHASE_BUCKETS; b++) {
+    seen += s->buckets[b];
+    if (seen >= rank)
+      return b == 63 ? UINT64_MAX : (2ULL << b) - 1;
+  }
+  return s->max;
+}
+
+/**
+ * Print the timings of every phase that ran on stderr.
+ */
+static void instrument_dump(void) {
+  fprintf(stderr, "%-9s %12s %16s %12s %12s %12s %12s %12s\n", "phase",
+          "count", "cycles", "mean", "min", "p50", "p99", "max");
+  for (int p = 0; p < PHASE_COUNT; p++) {
+    const PhaseStats *s = &phase_stats[p];
+    if (s->count == 0)
+      continue;
+    // The percentiles are bucket bounds, never more than the maximum
+    uint64_t p50 = phase_percentile(s, 0.5), p99 = phase_percentile(s, 0.99);
+    fprintf(stderr,
+            "%-9s %12" PRIu64 " %16" PRIu64 " %12.0f %12" PRIu64
+            " %12" PRIu64 " %12" PRIu64 " %12" PRIu64 "\n",
+            phase_names[p], s->count, s->total, (double)s->total / s->count,
+            s->min, p50 < s->max ? p50 : s->max, p99 < s->max ? p99 : s->max,
+            s->max);
+  }
+
+  // One line per phase with the non-empty buckets as <log2 cycles>:<count>
+  for (int p = 0; p < PHASE_COUNT; p++) {
+    if (phase_stats[p].count == 0)
+      continue;
+    fprintf(stderr, "%-9s", phase_names[p]);
+    for (int b = 0; b < PHASE_BUCKETS; b++)
+      if (phase_stats[p].buckets[b] != 0)
+        fprintf(stderr, " %d:%" PRIu64, b, phase_stats[p].buckets[b]);
+    fputc('\n', stderr);
+  }
+}
+
+/**
+ * Print the tables if SIGUSR1 arrived, called once per iteration.
+ */
+static inline void instrument_poll(void) {
+  if (dump_requested) {
+    dump_requested = 0;
+    instrument_dump();
+  }
+}
+
+#ifndef LR_BENCH
+// The trainer's main() starts the instrumentation, the benchmark suite
+// does not
+
+/**
+ * Signal handler of SIGUSR1, asks for the tables to be printed.
+ */
+static void request_dump(int sig) {
+  (void)sig;
+  dump_requested = 1;
+}
+
+/**
+ * Print the tables at exit and on SIGUSR1.
+ */
+static void instrument_start(void) {
+  struct sigaction action = {.sa_handler = request_dump,
+                             .sa_flags = SA_RESTART};
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGUSR1, &action, NULL);
+  atexit(instrument_dump);
+}
+#endif
+
+// Time the code between the two macros as phase p, in one block
+#define INSTRUMENT_BEGIN(p) uint64_t instrument_##p = read_cycles()
+#define INSTRUMENT_END(p) phase_record(p, read_cycles() - instrument_##p)
+
+#define INSTRUMENT_POLL() instrument_poll()
+#define INSTRUMENT_START() instrument_start()
+#else
+#define INSTRUMENT_BEGIN(p)
+#define INSTRUMENT_END(p)
+#define INSTRUMENT_POLL()
+#define INSTRUMENT_START()
+#endif
+
+/*
+ * Checkpoints
+ *
+ * A checkpoint is a CheckpointHeader followed by three arrays of p doubles:
+ * the parameters the training loop holds (w and b, or the d weights and
+ * the bias), the optimizer's velocity and its running mean of the squared
+ * gradient. It is written to "<path>.tmp", synced and renamed over the
+ * path, so a run killed at any point leaves either the previous or the new
+ * checkpoint behind, never a torn one.
+ */
+
+// Magic bytes at the start of every checkpoint file
+static const char checkpoint_magic[8] = "LRCKPT";
+
+// Version of the checkpoint file format
+#define CHECKPOINT_VERSION 1
+
+// Header of a checkpoint file, 64 bytes
+typedef struct {
+  char magic[8];      // "LRCKPT"
+  uint32_t version;   // CHECKPOINT_VERSION
+  uint32_t optimizer; // OptimizerKind the state belongs to
+  uint64_t features;  // Features of the data set, 0 for pairs
+  int64_t iteration;  // Next iteration to run
+  int64_t steps;      // Optimizer steps taken (adam's bias correction)
+  int32_t streak;     // Early stopping streak
+  int32_t normalize;  // The parameters are in the standardized space
+  uint64_t checksum;  // column_checksum() of the three arrays
+  double previous;    // Cost of the last multivariate iteration, or NAN
+} CheckpointHeader;
+
+// Set by the signal handler, asks the training loop to checkpoint and stop
+static volatile sig_atomic_t stop_requested = 0;
+
+#ifndef LR_BENCH
+/**
+ * Signal handler of SIGTERM and SIGINT while checkpointing.
+ */
+static void request_stop(int sig) {
+  (void)sig;
+  stop_requested = 1;
+}
+#endif
+
+/**
+ * Atomically write a checkpoint.
+ *
+ * @param path   Path of the checkpoint file.
+ * @param header Pointer to the header, magic, version and checksum are set.
+ * @param state  Pointer to the 3 * p doubles of state.
+ * @param p      Number of parameters.
+ * @return int - 0 on success, 1 on error (the error has been reported).
+ */
+int write_checkpoint(const char *path, CheckpointHeader *header,
+                     const double *state, size_t p) {
+  size_t bytes = 3 * p * sizeof(*state);
+  memcpy(header->magic, checkpoint_magic, sizeof(header->magic));
+  header->version = CHECKPOINT_VERSION;
+  header->checksum = column_checksum(CHECKSUM_SEED, state, bytes);
+
+  char tmp[PATH_MAX];
+  if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int)sizeof(tmp)) {
+    fprintf(stderr, "Error: checkpoint path too long: %s\n", path);
+    return 1;
+  }
+  FILE *file = fopen(tmp, "wb");
+  if (file == NULL) {
+    perror("Error opening checkpoint file");
+    return 1;
+  }
+  int ok = fwrite(header, sizeof(*header), 1, file) == 1 &&
+           fwrite(state, 1, bytes, file) == bytes && fflush(file) == 0 &&
+           fsync(fileno(file)) == 0;
+  if (fclose(file) != 0 || !ok || rename(tmp, path) != 0) {
+    perror("Error writing checkpoint file");
+    unlink(tmp);
+    return 1;
+  }
+  return 0;
+}
+
+/**
+ * Read a checkpoint and check that it belongs to this run.
+ *
+ * @param path      Path of the checkpoint file.
+ * @param header    Pointer receiving the header.
+ * @param state     Pointer receiving the 3 * p doubles of state.
+ * @param p         Number of parameters.
+ * @param features  Features of the data set, 0 for pairs.
+ * @param optimizer Optimizer of the run.
+ * @param normalize Whether the run trains on standardized inputs.
+ * @return int - 0 on success, 1 on error (the error has been reported).
+ */
+int read_checkpoint(const char *path, CheckpointHeader *header, double *state,
+                    size_t p, size_t features, OptimizerKind optimizer,
+                    int normalize) {
+  FILE *file = fopen(path, "rb");
+  if (file == NULL) {
+    perror("Error opening checkpoint file");
+    return 1;
+  }
+  size_t bytes = 3 * p * sizeof(*state);
+  int ok = fread(header, sizeof(*header), 1, file) == 1 &&
+           memcmp(header->magic, checkpoint_magic, sizeof(header->magic)) ==
+               0 &&
+           header->version == CHECKPOINT_VERSION &&
+           fread(state, 1, bytes, file) == bytes &&
+           header->checksum == column_checksum(CHECKSUM_SEED, state, bytes);
+  fclose(file);
+  if (!ok) {
+    fprintf(stderr, "Error: %s is not a valid checkpoint\n", path);
+    return 1;
+  }
+  if (header->features != features || header->optimizer != optimizer ||
+      header->normalize != normalize) {
+    fprintf(stderr, "Error: %s was written by a run with other features, "
+                    "optimizer or normalize settings\n",
+            path);
+    return 1;
+  }
+  return 0;
+}
+
+/*
+ * Logging
+ *
+ * The training loops only copy a record into a single-producer ring buffer;
+ * a writer thread drains it, formats the records and writes them through a
+ * large stdio buffer, so no formatting or I/O happens on the training
+ * thread. The binary format is a LogFileHeader followed by the raw
+ * LogRecord structs (host byte order), e.g. for numpy:
+ *   np.fromfile(path, dtype=[("iteration", "<i8"), ("event", "<i4"),
+ *               ("config", "<i4"), ("w", "<f8"), ("b", "<f8"), ("cost", "<f8"),
+ *               ("grad_norm", "<f8")], offset=16)
+ * Multivariate runs log w as NAN and append the d weights to every record,
+ * record_size in the header is then sizeof(LogRecord) + 8 * d. The records
+ * of a regularization path hold its point (from 1) in config and the l1 of
+ * the point in grad_norm.
+ */
+
+// Formats of the output file
+typedef enum {
+  LOG_TEXT,  // The "iteration: i, w: w, b: b" lines
+  LOG_CSV,   // One header line, then comma separated records
+  LOG_BINARY // LogFileHeader followed by raw LogRecords
+} LogFormat;
+
+// Names of the log formats, indexed by LogFormat
+static const char *const log_format_names[] = {"text", "csv", "binary"};
+
+// Kinds of log records
+typedef enum {
+  EVENT_ITERATION,  // Progress every log-every iterations
+  EVENT_CONVERGED,   // Early stopping ended the run
+  EVENT_CLOSED_FORM, // Exact solution of closed-form mode
+  EVENT_SWEEP,       // Result of one configuration of a sweep
+  EVENT_BEST,        // The sweep configuration with the lowest cost
+  EVENT_ONLINE,      // Model refitted after a batch in online mode
+  EVENT_PATH,        // Fit of one l1 value of a regularization path
+  EVENT_FOLD,        // Model of one cross-validation fold
+  EVENT_CV           // Mean over the folds of a cross-validation
+} LogEvent;
+
+// Names of the log events in the csv format, indexed by LogEvent
+static const char *const log_event_names[] = {
+    "iteration", "converged", "closed-form", "sweep", "best", "online",
+    "path", "fold", "cv"};
+
+// One log record, NAN cost and gradient norm when they were not measured
+typedef struct {
+  int64_t iteration; // Iteration (or mini-batch step)
+  int32_t event;     // LogEvent
+  int32_t config;    // Sweep configuration or fold (from 1), else 0
+  double w, b;       // Weights on the original scale
+  double cost;       // Half the mean squared error at (w, b), of the held
+                     // out pairs for folds
+  double grad_norm;  // Norm of the gradient of the step
+} LogRecord;
+
+// Header of a binary log file
+typedef struct {
+  char magic[8];        // "LRLOG"
+  uint32_t version;     // 1
+  uint32_t record_size; // sizeof(LogRecord) plus the multivariate weights
+} LogFileHeader;
+
+// One slot of the ring buffer
+typedef struct {
+  LogRecord record; // The record itself
+  double *weights;  // Multivariate runs: the d weights in a vector slot,
+                    // else NULL
+} LogEntry;
+
+// Number of records the ring buffer holds, a power of two
+#define LOG_RING 4096
+
+// Bytes of the weight vector slots of a multivariate run, allocated once.
+// At least one slot, at most one per record of the ring.
+#define LOG_VECTOR_BYTES (16 << 20)
+
+// Structure to hold the logger and its writer thread
+typedef struct {
+  FILE *file;              // Output file (stdout when no file is set)
+  LogFormat format;        // Format of the output file
+  size_t features;         // Number of weights of multivariate runs, else 0
+  LogEntry ring[LOG_RING]; // Records waiting to be written
+  atomic_size_t head;      // Number of records pushed
+  atomic_size_t tail;      // Number of records written
+  atomic_int closing;      // Set once no more records will be pushed
+  pthread_t writer;        // Drains the ring into the file
+  double *vectors;         // Multivariate runs: slots of d weights each
+  size_t vector_slots;     // Number of slots in vectors
+  size_t pushed;           // Number of vectors pushed
+  atomic_size_t written;   // Number of vectors written
+} Logger;
+
+/**
+ * Format and write one log record.
+ */
+static void logger_write(Logger *log, const LogEntry *e) {
+  const LogRecord *r = &e->record;
+  switch (log->format) {
+  case LOG_TEXT:
+    if (r->event == EVENT_CLOSED_FORM)
+      fprintf(log->file, "closed-form, w: ");
+    else if (r->event == EVENT_SWEEP || r->event == EVENT_BEST)
+      fprintf(log->file, "%s: %d, iterations: %lld, w: ",
+              r->event == EVENT_BEST ? "best config" : "config", r->config,
+              (long long)r->iteration);
+    else if (r->event == EVENT_PATH)
+      fprintf(log->file, "path: %d, l1: %lf, sweeps: %lld, w: ", r->config,
+              r->grad_norm, (long long)r->iteration);
+    else if (r->event == EVENT_FOLD)
+      fprintf(log->file, "fold: %d, iterations: %lld, w: ", r->config,
+              (long long)r->iteration);
+    else if (r->event == EVENT_CV)
+      fprintf(log->file, "cv mean of %d folds, w: ", r->config);
+    else
+      fprintf(log->file, "%s: %lld, w: ",
+              r->event == EVENT_CONVERGED ? "converged at iteration"
+              : r->event == EVENT_ONLINE  ? "batch"
+                                          : "iteration",
+              (long long)r->iteration);
+    if (e->weights == NULL)
+      fprintf(log->file, "%lf", r->w);
+    else
+      for (size_t j = 0; j < log->features; j++)
+        fprintf(log->file, "%s%lf%s", j == 0 ? "[" : " ", e->weights[j],
+                j + 1 == log->features ? "]" : "");
+    fprintf(log->file, ", b: %lf", r->b);
+    if (!isnan(r->cost))
+      fprintf(log->file,
+              r->event == EVENT_FOLD || r->event == EVENT_CV
+                  ? ", validation cost: %lf"
+                  : ", cost: %lf",
+              r->cost);
+    if (!isnan(r->grad_norm) && r->event != EVENT_PATH)
+      fprintf(log->file, ", gradient norm: %lf", r->grad_norm);
+    fputc('\n', log->file);
+    break;
+  case LOG_CSV:
+    fprintf(log->file, "%s,%d,%lld,", log_event_names[r->event], r->config,
+            (long long)r->iteration);
+    if (e->weights == NULL)
+      fprintf(log->file, "%.17g,", r->w);
+    else
+      for (size_t j = 0; j < log->features; j++)
+        fprintf(log->file, "%.17g,", e->weights[j]);
+    fprintf(log->file, "%.17g,%.17g,%.17g\n", r->b, r->cost, r->grad_norm);
+    break;
+  case LOG_BINARY:
+    fwrite(r, sizeof(*r), 1, log->file);
+    if (e->weights != NULL)
+      fwrite(e->weights, sizeof(double), log->features, log->file);
+    break;
+  }
+  // The vector is in the file buffer, its slot can be reused
+  if (e->weights != NULL)
+    atomic_fetch_add_explicit(&log->written, 1, memory_order_release);
+}
+
+/**
+ * Writer thread: drain the ring until the logger is closed.
+ */
+static void *logger_main(void *arg) {
+  Logger *log = arg;
+  size_t tail = atomic_load_explicit(&log->tail, memory_order_relaxed);
+  for (;;) {
+    size_t head = atomic_load_explicit(&log->head, memory_order_acquire);
+    if (tail == head) {
+      // Read closing before re-checking head, a record pushed before the
+      // close is then guaranteed to be seen
+      if (atomic_load(&log->closing) &&
+          atomic_load_explicit(&log->head, memory_order_acquire) == tail)
+        break;
+      fflush(log->file);
+      nanosleep(&(struct timespec){.tv_nsec = 1000000}, NULL);
+      continue;
+    }
+    for (; tail != head; tail++)
+      logger_write(log, &log->ring[tail & (LOG_RING - 1)]);
+    atomic_store_explicit(&log->tail, tail, memory_order_release);
+  }
+  return NULL;
+}
+
+/**
+ * Open the output file and start the writer thread.
+ *
+ * @param log      Pointer to the logger.
+ * @param path     Output file, the empty string uses stdout.
+ * @param format   Format of the output file.
+ * @param features Number of weights of a multivariate run, 0 otherwise.
+ * @param append   Append to an existing output file (resumed runs), its
+ *                 header is then not written again.
+ * @return int - 0 on success, 1 on error (the error has been reported).
+ */
+int logger_open(Logger *log, const char *path, LogFormat format,
+                size_t features, int append) {
+  log->format = format;
+  log->features = features;
+  log->file = stdout;
+  atomic_init(&log->head, 0);
+  atomic_init(&log->tail, 0);
+  atomic_init(&log->closing, 0);
+  atomic_init(&log->written, 0);
+  log->vectors = NULL;
+  log->pushed = 0;
+  if (features > 0) {
+    size_t slots = LOG_VECTOR_BYTES / sizeof(double) / features;
+    log->vector_slots = slots < 1 ? 1 : slots > LOG_RING ? LOG_RING : slots;
+    log->vectors = malloc(log->vector_slots * features * sizeof(double));
+    if (log->vectors == NULL) {
+      perror("Error allocating memory");
+      return 1;
+    }
+  }
+  int header = 1;
+  // If a specified output file was provided, open it
+  if (strcmp(path, "") != 0) {
+    log->file = fopen(path, append ? "ab" : format == LOG_BINARY ? "wb" : "w");
+    // Error message if the output file could not be opened
+    if (log->file == NULL) {
+      perror("Error Opening File");
+      free(log->vectors);
+      return 1;
+    }
+    header = !append || (fseek(log->file, 0, SEEK_END) == 0 &&
+                         ftell(log->file) == 0);
+  }
+  setvbuf(log->file, NULL, _IOFBF, 1 << 20);
+
+  if (header && format == LOG_CSV) {
+    fputs("event,config,iteration,", log->file);
+    if (features == 0)
+      fputs("w,", log->file);
+    for (size_t j = 0; j < features; j++)
+      fprintf(log->file, "w%zu,", j + 1);
+    fputs("b,cost,grad_norm\n", log->file);
+  } else if (header && format == LOG_BINARY) {
+    LogFileHeader file_header = {
+        .magic = "LRLOG",
+        .version = 1,
+        .record_size = sizeof(LogRecord) + features * sizeof(double)};
+    fwrite(&file_header, sizeof(file_header), 1, log->file);
+  }
+
+  if (pthread_create(&log->writer, NULL, logger_main, log) != 0) {
+    fprintf(stderr, "Error: could not start the log writer\n");
+    if (log->file != stdout)
+      fclose(log->file);
+    free(log->vectors);
+    return 1;
+  }
+  return 0;
+}
+
+/**
+ * Copy an entry into the ring, waiting for room if the writer fell a whole
+ * ring behind.
+ */
+static void logger_enqueue(Logger *log, const LogEntry *e) {
+  size_t head = atomic_load_explicit(&log->head, memory_order_relaxed);
+  while (head - atomic_load_explicit(&log->tail, memory_order_acquire) ==
+         LOG_RING)
+    sched_yield();
+  log->ring[head & (LOG_RING - 1)] = *e;
+  atomic_store_explicit(&log->head, head + 1, memory_order_release);
+}
+
+/**
+ * Copy the weights of a multivariate record into the next vector slot,
+ * waiting for the writer to free one, then queue the record.
+ *
+ * @param log   Pointer to the logger (opened with the feature count).
+ * @param e     Pointer to the entry, its weights are set to the slot.
+ * @param theta Pointer to the d weights.
+ */
+static void logger_enqueue_vector(Logger *log, LogEntry *e,
+                                  const double *theta) {
+  while (log->pushed -
+             atomic_load_explicit(&log->written, memory_order_acquire) ==
+         log->vector_slots)
+    sched_yield();
+  e->weights = log->vectors + log->pushed % log->vector_slots * log->features;
+  memcpy(e->weights, theta, log->features * sizeof(double));
+  log->pushed++;
+  logger_enqueue(log, e);
+}
+
+/**
+ * Queue one record for the writer thread.
+ *
+ * @param log       Pointer to the logger.
+ * @param event     Kind of record.
+ * @param i         Iteration (or mini-batch step).
+ * @param ws        Pointer to the weights on the original scale.
+ * @param cost      Cost at the weights, or NAN.
+ * @param grad_norm Norm of the gradient of the step, or NAN.
+ */
+static void logger_push(Logger *log, LogEvent event, long i, const Weights *ws,
+                        double cost, double grad_norm) {
+  logger_enqueue(log, &(LogEntry){.record = {.iteration = i,
+                                             .event = event,
+                                             .w = ws->w,
+                                             .b = ws->b,
+                                             .cost = cost,
+                                             .grad_norm = grad_norm}});
+}
+
+/**
+ * Queue the result of one sweep configuration or cross-validation fold for
+ * the writer thread.
+ *
+ * @param log        Pointer to the logger.
+ * @param event      EVENT_SWEEP, EVENT_BEST, EVENT_FOLD or EVENT_CV.
+ * @param config     Configuration or fold, counted from 1.
+ * @param iterations Last iteration the configuration trained.
+ * @param ws         Pointer to the final weights.
+ * @param cost       Cost at the final weights.
+ */
+static void logger_push_sweep(Logger *log, LogEvent event, int config,
+                              long iterations, const Weights *ws,
+                              double cost) {
+  logger_enqueue(log, &(LogEntry){.record = {.iteration = iterations,
+                                             .event = event,
+                                             .config = config,
+                                             .w = ws->w,
+                                             .b = ws->b,
+                                             .cost = cost,
+                                             .grad_norm = NAN}});
+}
+
+/**
+ * Queue one record of a multivariate run for the writer thread. The
+ * weights are copied into a preallocated vector slot.
+ *
+ * @param log       Pointer to the logger (opened with the feature count).
+ * @param event     Kind of record.
+ * @param i         Iteration.
+ * @param theta     Pointer to the d weights followed by the bias.
+ * @param cost      Cost at the weights, or NAN.
+ * @param grad_norm Norm of the gradient of the step, or NAN.
+ */
+static void logger_push_vector(Logger *log, LogEvent event, long i,
+                               const double *theta, double cost,
+                               double grad_norm) {
+  logger_enqueue_vector(log,
+                        &(LogEntry){.record = {.iteration = i,
+                                               .event = event,
+                                               .w = NAN,
+                                               .b = theta[log->features],
+                                               .cost = cost,
+                                               .grad_norm = grad_norm}},
+                        theta);
+}
+
+/**
+ * Queue the fit of one point of a regularization path for the writer
+ * thread.
+ *
+ * @param log    Pointer to the logger (opened with the feature count).
+ * @param point  Point of the path, counted from 1.
+ * @param sweeps Coordinate descent sweeps the fit took.
+ * @param theta  Pointer to the d weights followed by the bias.
+ * @param l1     Lasso penalty of the point.
+ * @param cost   Cost at the weights, or NAN.
+ */
+static void logger_push_path(Logger *log, int point, long sweeps,
+                             const double *theta, double l1, double cost) {
+  logger_enqueue_vector(log,
+                        &(LogEntry){.record = {.iteration = sweeps,
+                                               .event = EVENT_PATH,
+                                               .config = point,
+                                               .w = NAN,
+                                               .b = theta[log->features],
+                                               .cost = cost,
+                                               .grad_norm = l1}},
+                        theta);
+}
+
+/**
+ * Write the remaining records, stop the writer and close the output file.
+ *
+ * @param log Pointer to the logger.
+ */
+void logger_close(Logger *log) {
+  atomic_store(&log->closing, 1);
+  pthread_join(log->writer, NULL);
+  if (log->file != stdout)
+    fclose(log->file);
+  else
+    fflush(stdout);
+  free(log->vectors);
+}
+
+// Training modes that can be selected in the settings file
+typedef enum {
+  MODE_GRADIENT_DESCENT, // Full pass over the data every iteration
+  MODE_SUFFICIENT_STATS, // Gradient descent on sums collected while loading
+  MODE_CLOSED_FORM,      // Exact least squares solution, no iterations
+  MODE_SGD,              // Mini-batch descent streaming the file
+  MODE_ONLINE,           // Refit on running sums as new pairs arrive
+  MODE_PREDICT           // Score inputs with a saved model, no training
+} Mode;
+
+// Solvers that can be selected in the settings file
+typedef enum {
+  SOLVER_ITERATIVE, // The training mode decides
+  SOLVER_DIRECT,    // Solve the normal equations, same as mode closed-form
+  SOLVER_COORDINATE // Coordinate descent, for the l1 penalty
+} Solver;
+
+// Names of the solvers, indexed by Solver
+static const char *const solver_names[] = {"iterative", "direct",
+                                           "coordinate"};
+
+// Devices the gradient passes can run on
+typedef enum {
+  DEVICE_CPU,   // The gradient kernels and the thread pool
+  DEVICE_OPENCL // Gradient descent on a GPU, see OpenCL backend
+} Device;
+
+// Names of the devices, indexed by Device
+static const char *const device_names[] = {"cpu", "opencl"};
+
+// Structure to hold the settings of a training run
+typedef struct {
+  double w, b;          // Initial weight and initial bias
+  int iterations;       // Number of iterations to train (inclusive)
+  int every;            // Number of iterations between log lines
+  char output[101];     // Output file (empty uses stdout)
+  Mode mode;            // Training mode
+  Kernel kernel;        // Gradient kernel
+  Precision precision;  // Arithmetic precision of the gradient kernel
+  int threads;          // Number of threads parsing and computing the gradient
+  size_t batch_size;    // Pairs per mini-batch in sgd mode
+  int epochs;           // Passes over the file in sgd mode
+  EarlyStop stop;       // Early stopping criteria of the full batch modes
+  Optimizer optimizer;  // Update rule, learning rate and its other settings
+  int normalize;        // Train on standardized inputs
+  LogFormat log_format; // Format of the output file
+  int log_metrics;      // Also log the cost and the gradient norm
+  Layout layout;        // In-memory layout of a multivariate feature matrix
+  Solver solver;        // Iterative training or a direct solve
+  char sweep[101];      // Sweep file of configurations (empty disables)
+  char checkpoint[101]; // Checkpoint file (empty disables)
+  int checkpoint_every; // Number of iterations between checkpoints
+  char resume[101];     // Checkpoint file to resume from (empty disables)
+  size_t window;        // Online: most recent pairs fit on (0 keeps all)
+  double decay;         // Online: weight older pairs keep per new pair
+  int listen;           // Online: TCP port accepting pairs (0 reads input)
+  char address[101];    // Online: IPv4 address the listen port binds to
+  char publish[101];    // Online: file the model is written to (empty
+                        // disables)
+  char model[101];      // File of the initial w and b (empty disables)
+  char peers[101];      // Peers file of a distributed run (empty disables)
+  int rank;             // Rank of this node in the peers file
+  Device device;        // Device the gradient passes run on
+  double l1, l2;        // Lasso and ridge penalties of the weights
+  int path;             // Points of an l1 regularization path (0 fits l1)
+  int cache;            // Keep parsed text files in shared memory
+  int deterministic;    // Same results for every thread count
+  int cv;               // Folds of k-fold cross-validation (0 disables)
+} Settings;
+
+// Largest pair count of a buffer, batch-size and window allocate two int
+// buffers of that many pairs
+#define MAX_PAIR_COUNT                                                         \
+  ((long long)(SIZE_MAX / sizeof(int) < LLONG_MAX / 2                          \
+                   ? SIZE_MAX / sizeof(int)                                    \
+                   : LLONG_MAX / 2))
+
+// Most gradient threads a run starts, deterministic partials scale with it
+#define MAX_THREADS 1024
+
+/**
+ * Read the optional initial settings file into the settings structure.
+ *
+ * @param path     Path of the settings file.
+ * @param settings Pointer to the settings, pre-filled with the defaults.
+ * @return int - 0 on success, 1 on error (the error has been reported).
+ */
+int read_settings(const char *path, Settings *settings) {
+  FILE *settings_file = fopen(path, "r");
+  if (settings_file == NULL) {
+    // Error message if the settings file cannot be opened
+    perror("Error opening settings file");
+    return 1;
+  }
+
+  // Temporary variables to store keys and values from the settings file
+  char key[33]; // Buffer to store the setting key (e.g., "w", "b", "alpha")
+  char value[101]; // Variable to store the corresponding value
+  int status = 0;
+
+  // Read key-value pairs from the settings file
+  while (fscanf(settings_file, "%32s %100s", key, value) == 2) {
+    // Match the key and update the corresponding variable
+    if (strcmp(key, "w") == 0)
+      settings->w = atof(value);
+    else if (strcmp(key, "b") == 0)
+      settings->b = atof(value);
+    else if (strcmp(key, "alpha") == 0)
+      settings->optimizer.alpha = atof(value);
+    else if (strcmp(key, "momentum") == 0)
+      settings->optimizer.momentum = atof(value);
+    else if (strcmp(key, "beta1") == 0)
+      settings->optimizer.beta1 = atof(value);
+    else if (strcmp(key, "beta2") == 0)
+      settings->optimizer.beta2 = atof(value);
+    else if (strcmp(key, "epsilon") == 0)
+      settings->optimizer.epsilon = atof(value);
+    else if (strcmp(key, "optimizer") == 0) {
+      size_t k = 0;
+      while (k < sizeof(optimizer_names) / sizeof(*optimizer_names) &&
+             strcmp(value, optimizer_names[k]) != 0)
+        k++;
+      if (k == sizeof(optimizer_names) / sizeof(*optimizer_names)) {
+        fprintf(stderr, "Unknown optimizer: %s\n", value);
+        status = 1;
+      } else
+        settings->optimizer.kind = (OptimizerKind)k;
+    } else if (strcmp(key, "iterations") == 0)
+      settings->iterations = atof(value);
+    else if (strcmp(key, "log-every") == 0)
+      settings->every = atof(value);
+    else if (strcmp(key, "output") == 0) {
+      strncpy(settings->output, value, sizeof(settings->output) - 1);
+      settings->output[sizeof(settings->output) - 1] = '\0';
+    } else if (strcmp(key, "mode") == 0) {
+      if (strcmp(value, "gradient-descent") == 0)
+        settings->mode = MODE_GRADIENT_DESCENT;
+      else if (strcmp(value, "sufficient-stats") == 0)
+        settings->mode = MODE_SUFFICIENT_STATS;
+      else if (strcmp(value, "closed-form") == 0)
+        settings->mode = MODE_CLOSED_FORM;
+      else if (strcmp(value, "sgd") == 0)
+        settings->mode = MODE_SGD;
+      else if (strcmp(value, "online") == 0)
+        settings->mode = MODE_ONLINE;
+      else if (strcmp(value, "predict") == 0)
+        settings->mode = MODE_PREDICT;
+      else {
+        fprintf(stderr, "Unknown mode: %s\n", value);
+        status = 1;
+      }
+    } else if (strcmp(key, "threads") == 0) {
+      long long count;
+      if (parse_count(value, 0, MAX_THREADS, &count) != 0) {
+        fprintf(stderr, "Invalid thread count: %s\n", value);
+        status = 1;
+      } else
+        settings->threads = count;
+      // 0 uses every online CPU
+      if (settings->threads == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        settings->threads = cpus < 1             ? 1
+                            : cpus > MAX_THREADS ? MAX_THREADS
+                                                 : cpus;
+      }
+    } else if (strcmp(key, "batch-size") == 0) {
+      long long count;
+      if (parse_count(value, 1, MAX_PAIR_COUNT, &count) != 0) {
+        fprintf(stderr, "Invalid batch-size: %s\n", value);
+        status = 1;
+      } else
+        settings->batch_size = count;
+    } else if (strcmp(key, "epochs") == 0) {
+      long long count;
+      if (parse_count(value, 1, INT_MAX, &count) != 0) {
+        fprintf(stderr, "Invalid epochs: %s\n", value);
+        status = 1;
+      } else
+        settings->epochs = count;
+    } else if (strcmp(key, "normalize") == 0)
+      settings->normalize = atoi(value);
+    else if (strcmp(key, "log-metrics") == 0)
+      settings->log_metrics = atoi(value);
+    else if (strcmp(key, "log-format") == 0) {
+      size_t k = 0;
+      while (k < sizeof(log_format_names) / sizeof(*log_format_names) &&
+             strcmp(value, log_format_names[k]) != 0)
+        k++;
+      if (k == sizeof(log_format_names) / sizeof(*log_format_names)) {
+        fprintf(stderr, "Unknown log format: %s\n", value);
+        status = 1;
+      } else
+        settings->log_format = (LogFormat)k;
+    } else if (strcmp(key, "tolerance") == 0)
+      settings->stop.tolerance = atof(value);
+    else if (strcmp(key, "min-delta") == 0)
+      settings->stop.min_delta = atof(value);
+    else if (strcmp(key, "patience") == 0) {
+      settings->stop.patience = atoi(value);
+      if (settings->stop.patience < 1) {
+        fprintf(stderr, "Invalid patience: %s\n", value);
+        status = 1;
+      }
+    } else if (strcmp(key, "checkpoint") == 0) {
+      strncpy(settings->checkpoint, value, sizeof(settings->checkpoint) - 1);
+      settings->checkpoint[sizeof(settings->checkpoint) - 1] = '\0';
+    } else if (strcmp(key, "checkpoint-every") == 0) {
+      long long count;
+      if (parse_count(value, 1, INT_MAX, &count) != 0) {
+        fprintf(stderr, "Invalid checkpoint interval: %s\n", value);
+        status = 1;
+      } else
+        settings->checkpoint_every = count;
+    } else if (strcmp(key, "resume") == 0) {
+      strncpy(settings->resume, value, sizeof(settings->resume) - 1);
+      settings->resume[sizeof(settings->resume) - 1] = '\0';
+    } else if (strcmp(key, "window") == 0) {
+      long long count;
+      if (parse_count(value, 0, MAX_PAIR_COUNT, &count) != 0) {
+        fprintf(stderr, "Invalid window: %s\n", value);
+        status = 1;
+      } else
+        settings->window = count;
+    } else if (strcmp(key, "decay") == 0) {
+      settings->decay = atof(value);
+      if (!(settings->decay > 0 && settings->decay <= 1)) {
+        fprintf(stderr, "Invalid decay: %s\n", value);
+        status = 1;
+      }
+    } else if (strcmp(key, "listen-address") == 0) {
+      struct in_addr addr;
+      if (inet_pton(AF_INET, value, &addr) != 1) {
+        fprintf(stderr, "Invalid listen-address: %s\n", value);
+        status = 1;
+      }
+      strncpy(settings->address, value, sizeof(settings->address) - 1);
+      settings->address[sizeof(settings->address) - 1] = '\0';
+    } else if (strcmp(key, "listen") == 0) {
+      long long count;
+      if (parse_count(value, 0, 65535, &count) != 0) {
+        fprintf(stderr, "Invalid port: %s\n", value);
+        status = 1;
+      } else
+        settings->listen = count;
+    } else if (strcmp(key, "publish") == 0) {
+      strncpy(settings->publish, value, sizeof(settings->publish) - 1);
+      settings->publish[sizeof(settings->publish) - 1] = '\0';
+    } else if (strcmp(key, "peers") == 0) {
+      strncpy(settings->peers, value, sizeof(settings->peers) - 1);
+      settings->peers[sizeof(settings->peers) - 1] = '\0';
+    } else if (strcmp(key, "rank") == 0) {
+      // ring_open() checks it against the nodes of the peers file
+      long long count;
+      if (parse_count(value, 0, INT_MAX, &count) != 0) {
+        fprintf(stderr, "Invalid rank: %s\n", value);
+        status = 1;
+      } else
+        settings->rank = count;
+    } else if (strcmp(key, "model") == 0) {
+      strncpy(settings->model, value, sizeof(settings->model) - 1);
+      settings->model[sizeof(settings->model) - 1] = '\0';
+    } else if (strcmp(key, "sweep") == 0) {
+      strncpy(settings->sweep, value, sizeof(settings->sweep) - 1);
+      settings->sweep[sizeof(settings->sweep) - 1] = '\0';
+    } else if (strcmp(key, "l1") == 0 || strcmp(key, "l2") == 0) {
+      double penalty = atof(value);
+      if (!(penalty >= 0)) {
+        fprintf(stderr, "Invalid penalty: %s\n", value);
+        status = 1;
+      } else if (key[1] == '1')
+        settings->l1 = penalty;
+      else
+        settings->l2 = penalty;
+    } else if (strcmp(key, "cache") == 0)
+      settings->cache = atoi(value);
+    else if (strcmp(key, "deterministic") == 0)
+      settings->deterministic = atoi(value);
+    else if (strcmp(key, "cv") == 0) {
+      // 0 disables cross-validation, otherwise at least two folds
+      long long count;
+      if (parse_count(value, 0, INT_MAX, &count) != 0 || count == 1) {
+        fprintf(stderr, "Invalid fold count: %s\n", value);
+        status = 1;
+      } else
+        settings->cv = count;
+    } else if (strcmp(key, "path") == 0) {
+      long long count;
+      if (parse_count(value, 0, INT_MAX, &count) != 0) {
+        fprintf(stderr, "Invalid path: %s\n", value);
+        status = 1;
+      } else
+        settings->path = count;
+    } else if (strcmp(key, "device") == 0) {
+      size_t k = 0;
+      while (k < sizeof(device_names) / sizeof(*device_names) &&
+             strcmp(value, device_names[k]) != 0)
+        k++;
+      if (k == sizeof(device_names) / sizeof(*device_names)) {
+        fprintf(stderr, "Unknown device: %s\n", value);
+        status = 1;
+      } else
+        settings->device = (Device)k;
+    } else if (strcmp(key, "solver") == 0) {
+      size_t k = 0;
+      while (k < sizeof(solver_names) / sizeof(*solver_names) &&
+             strcmp(value, solver_names[k]) != 0)
+        k++;
+      if (k == sizeof(solver_names) / sizeof(*solver_names)) {
+        fprintf(stderr, "Unknown solver: %s\n", value);
+        status = 1;
+      } else
+        settings->solver = (Solver)k;
+    } else if (strcmp(key, "layout") == 0) {
+      size_t k = 0;
+      while (k < sizeof(layout_names) / sizeof(*layout_names) &&
+             strcmp(value, layout_names[k]) != 0)
+        k++;
+      if (k == sizeof(layout_names) / sizeof(*layout_names)) {
+        fprintf(stderr, "Unknown layout: %s\n", value);
+        status = 1;
+      } else
+        settings->layout = (Layout)k;
+    } else if (strcmp(key, "kernel") == 0) {
+      size_t k = 0;
+      while (k < sizeof(kernel_names) / sizeof(*kernel_names) &&
+             strcmp(value, kernel_names[k]) != 0)
+        k++;
+      if (k == sizeof(kernel_names) / sizeof(*kernel_names)) {
+        fprintf(stderr, "Unknown kernel: %s\n", value);
+        status = 1;
+      } else
+        settings->kernel = (Kernel)k;
+    } else if (strcmp(key, "precision") == 0) {
+      size_t k = 0;
+      while (k < sizeof(precision_names) / sizeof(*precision_names) &&
+             strcmp(value, precision_names[k]) != 0)
+        k++;
+      if (k == sizeof(precision_names) / sizeof(*precision_names)) {
+        fprintf(stderr, "Unknown precision: %s\n", value);
+        status = 1;
+      } else
+        settings->precision = (Precision)k;
+    } else
+      fprintf(stderr, "Unknown key: %s\n", key);
+  }
+
+  // Close the settings file
+  fclose(settings_file);
+  return status;
+}
+
+/**
+ * Train with mini-batch gradient descent while streaming the file.
+ *
+ * A reader thread fills one batch slot while the gradient is computed on
+ * the other, so peak memory is two batches plus one file block no matter
+ * how large the data set is. Every batch is one descent step.
+ *
+ * @param path        Path of the input-target pairs file.
+ * @param settings    Pointer to the settings of the run.
+ * @param weights     Pointer to the weights, updated in place.
+ * @param log         Pointer to the logger of the run.
+ * @return int - 0 on success, 1 on error (the error has been reported).
+ */
+int train_sgd(const char *path, const Settings *settings, Weights *weights,
+              Logger *log) {
+  PairStream stream;
+  if (stream_open(&stream, path) != 0)
+    return 1;
+
+  BatchQueue q = {.stream = &stream,
+                  .epochs = settings->epochs,
+                  .batch_size = settings->batch_size,
+                  .lock = PTHREAD_MUTEX_INITIALIZER,
+                  .change = PTHREAD_COND_INITIALIZER};
+  int status = 0;
+  for (int k = 0; k < 2; k++) {
+    q.x[k] = (IntVec){.data = malloc(q.batch_size * sizeof(int)),
+                      .capacity = q.batch_size};
+    q.y[k] = (IntVec){.data = malloc(q.batch_size * sizeof(int)),
+                      .capacity = q.batch_size};
+    if (q.x[k].data == NULL || q.y[k].data == NULL)
+      status = 1;
+  }
+
+  // Standardization needs the statistics of the whole file, one extra pass
+  Scaling scaling = {.mean = 0, .std = 1};
+  if (status == 0 && settings->normalize) {
+    SuffStats stats = {0};
+    do {
+      status = stream_read(&stream, &q.x[0], &q.y[0], q.batch_size);
+      for (size_t i = 0; status == 0 && i < q.x[0].size; i++)
+        stats_add(&stats, q.x[0].data[i], q.y[0].data[i]);
+    } while (status == 0 && q.x[0].size > 0);
+    if (status == 0 && scaling_from_stats(&stats, &scaling) != 0) {
+      fprintf(stderr, "Error: normalize needs at least two distinct inputs\n");
+      status = 1;
+    }
+  }
+
+  pthread_t reader;
+  if (status != 0 || pthread_create(&reader, NULL, batch_reader, &q) != 0) {
+    fprintf(stderr, "Error: could not start the batch reader\n");
+    for (int k = 0; k < 2; k++) {
+      free(q.x[k].data);
+      free(q.y[k].data);
+    }
+    stream_close(&stream);
+    return 1;
+  }
+
+  // Take the batches in the order the reader filled them, training in the
+  // scaled space
+  Optimizer opt = settings->optimizer;
+  Weights scaled = scale_weights(&scaling, weights);
+  for (long i = 0, slot = 0;; i++, slot ^= 1) {
+    pthread_mutex_lock(&q.lock);
+    while (q.state[slot] == SLOT_EMPTY)
+      pthread_cond_wait(&q.change, &q.lock);
+    SlotState state = q.state[slot];
+    pthread_mutex_unlock(&q.lock);
+    if (state == SLOT_END)
+      break;
+
+    // One descent step on the batch, the cost of the batch comes out of
+    // the same pass on the steps that log it
+    int metrics = settings->log_metrics && i % settings->every == 0;
+    double cost = NAN;
+    Weights at = optimizer_lookahead(&opt, &scaled);
+    Weights raw = unscale_weights(&scaling, &at);
+    Weights ws = metrics ? gradient_cost(&q.x[slot], &q.y[slot], &raw, &cost)
+                         : gradient(&q.x[slot], &q.y[slot], &raw);
+    ws = scale_gradient(&scaling, &ws);
+    optimizer_step(&opt, &scaled, &ws, NULL);
+    *weights = unscale_weights(&scaling, &scaled);
+    if (i % settings->every == 0)
+      logger_push(log, EVENT_ITERATION, i, weights, cost,
+                  metrics ? hypot(ws.w, ws.b) : NAN);
+
+    // Give the slot back to the reader
+    pthread_mutex_lock(&q.lock);
+    q.state[slot] = SLOT_EMPTY;
+    pthread_cond_signal(&q.change);
+    pthread_mutex_unlock(&q.lock);
+  }
+
+  pthread_join(reader, NULL);
+  status = q.status;
+  for (int k = 0; k < 2; k++) {
+    free(q.x[k].data);
+    free(q.y[k].data);
+  }
+  stream_close(&stream);
+  return status;
+}
+
+// Structure to hold the state of an online model
+typedef struct {
+  SuffStats stats; // Statistics of the pairs the model is fit on
+  double decay;    // Weight every older pair keeps per new pair (1 keeps all)
+  size_t window;   // Number of most recent pairs kept, 0 keeps every pair
+  int *ring_x;     // Window: inputs of the pairs in the statistics
+  int *ring_y;     // Window: targets of the pairs in the statistics
+  size_t count;    // Window: number of pairs in the ring
+  size_t oldest;   // Window: slot of the oldest pair, replaced next
+  long batches;    // Number of batches taken so far
+} OnlineModel;
+
+/**
+ * Fold one batch into the statistics of an online model.
+ *
+ * Every pair costs O(1): the decay rescales the sums and a full window
+ * takes its oldest pair back out, so old data ages out without a rescan.
+ *
+ * @param om Pointer to the online model.
+ * @param x  Pointer to the inputs of the batch.
+ * @param y  Pointer to the targets of the batch.
+ */
+static void online_add(OnlineModel *om, const IntVec *x, const IntVec *y) {
+  for (size_t i = 0; i < x->size; i++) {
+    if (om->decay < 1)
+      stats_scale(&om->stats, om->decay);
+    if (om->window > 0) {
+      if (om->count == om->window)
+        stats_remove(&om->stats, om->ring_x[om->oldest],
+                     om->ring_y[om->oldest]);
+      else
+        om->count++;
+      om->ring_x[om->oldest] = x->data[i];
+      om->ring_y[om->oldest] = y->data[i];
+      om->oldest = (om->oldest + 1) % om->window;
+    }
+    stats_add(&om->stats, x->data[i], y->data[i]);
+  }
+}
+
+/**
+ * Write a model to a file, replacing the previous one atomically.
+ *
+ * The file holds "w <w>" and "b <b>" lines, the settings file format, so a
+ * reader never sees half a model and a later run can start from it.
+ *
+ * @param path Path of the model file.
+ * @param ws   Pointer to the weights to write.
+ * @return int - 0 on success, 1 on error (the error has been reported).
+ */
+int publish_model(const char *path, const Weights *ws) {
+  char tmp[PATH_MAX];
+  if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int)sizeof(tmp)) {
+    fprintf(stderr, "Error: publish path too long: %s\n", path);
+    return 1;
+  }
+  FILE *file = fopen(tmp, "w");
+  if (file == NULL) {
+    perror("Error opening publish file");
+    return 1;
+  }
+  int ok = fprintf(file, "w %.17g\nb %.17g\n", ws->w, ws->b) > 0 &&
+           fflush(file) == 0 && fsync(fileno(file)) == 0;
+  if (fclose(file) != 0 || !ok || rename(tmp, path) != 0) {
+    perror("Error publishing the model");
+    unlink(tmp);
+    return 1;
+  }
+  return 0;
+}
+
+/**
+ * Take batches from a stream until it ends, refitting after every batch.
+ *
+ * @param om       Pointer to the online model.
+ * @param stream   Pointer to the stream the pairs arrive on.
+ * @param settings Pointer to the settings of the run.
+ * @param x, y     Batch vectors with room for batch-size pairs.
+ * @param weights  Pointer to the weights, the last fitted model.
+ * @param log      Pointer to the logger of the run.
+ * @return int - 0 once the stream ended, 1 on error (the error has been
+ *               reported).
+ */
+static int online_serve(OnlineModel *om, PairStream *stream,
+                        const Settings *settings, IntVec *x, IntVec *y,
+                        Weights *weights, Logger *log) {
+  for (;;) {
+    if (stream_read(stream, x, y, settings->batch_size) != 0)
+      return 1;
+    if (x->size == 0)
+      return 0;
+
+    // The least squares solution of the sums is the exact model of the
+    // data seen so far, there is nothing left to iterate
+    online_add(om, x, y);
+    long i = om->batches++;
+    if (closed_form(&om->stats, weights) != 0)
+      continue; // Nothing to fit before two distinct inputs arrived
+    if (settings->publish[0] != '\0' &&
+        publish_model(settings->publish, weights) != 0)
+      return 1;
+    if (i % settings->every == 0)
+      logger_push(log, EVENT_ONLINE, i, weights,
+                  settings->log_metrics ? stats_cost(&om->stats, weights)
+                                        : NAN,
+                  settings->log_metrics ? 0 : NAN);
+  }
+}
+
+/**
+ * Keep a model up to date while new pairs arrive.
+ *
+ * The pairs are read from the input file, "-" for stdin, or from every
+ * connection accepted on the listen port, one after another. A batch is at
+ * most batch-size pairs or whatever arrived by the time a read returned.
+ * Only the sufficient statistics (and the pairs of a window) are kept, so
+ * each batch costs O(batch) no matter how much data came before it.
+ *
+ * @param path     Path of the input-target pairs, "-" for stdin.
+ * @param settings Pointer to the settings of the run.
+ * @param weights  Pointer to the weights, the last fitted model.
+ * @param log      Pointer to the logger of the run.
+ * @return int - 0 once the input ended, 1 on error (the error has been
+ *               reported). A server only returns on error.
+ */
+int train_online(const char *path, const Settings *settings, Weights *weights,
+                 Logger *log) {
+  OnlineModel om = {.decay = settings->decay, .window = settings->window};
+  IntVec x = {.data = malloc(settings->batch_size * sizeof(int)),
+              .capacity = settings->batch_size};
+  IntVec y = {.data = malloc(settings->batch_size * sizeof(int)),
+              .capacity = settings->batch_size};
+  if (om.window > 0) {
+    om.ring_x = malloc(om.window * sizeof(int));
+    om.ring_y = malloc(om.window * sizeof(int));
+  }
+  int status = 0;
+  if (x.data == NULL || y.data == NULL ||
+      (om.window > 0 && (om.ring_x == NULL || om.ring_y == NULL))) {
+    perror("Error allocating memory");
+    status = 1;
+  }
+
+  PairStream stream;
+  if (status == 0 && settings->listen == 0) {
+    // A single stream, the run ends with it
+    status = strcmp(path, "-") == 0 ? stream_attach(&stream, 0, "stdin")
+                                    : stream_open(&stream, path);
+    if (status == 0) {
+      stream.partial = 1;
+      status = online_serve(&om, &stream, settings, &x, &y, weights, log);
+      stream_close(&stream);
+    }
+  } else if (status == 0) {
+    // Serve one connection at a time, a client that sends a malformed line
+    // loses its connection but the model keeps what it sent before. The
+    // pairs are not authenticated, so only listen-address (loopback unless
+    // set) accepts them.
+    int server = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr = {.sin_family = AF_INET,
+                               .sin_port = htons(settings->listen)};
+    int on = 1;
+    if (server < 0 ||
+        inet_pton(AF_INET, settings->address, &addr.sin_addr) != 1 ||
+        setsockopt(server, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) != 0 ||
+        bind(server, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+        listen(server, 16) != 0) {
+      perror("Error listening for pairs");
+      status = 1;
+    }
+    while (status == 0) {
+      int fd = accept(server, NULL, NULL);
+      if (fd < 0) {
+        perror("Error accepting a connection");
+        status = 1;
+      } else if (stream_attach(&stream, fd, "connection") == 0) {
+        stream.partial = 1;
+        online_serve(&om, &stream, settings, &x, &y, weights, log);
+        stream_close(&stream);
+      }
+    }
+    if (server >= 0)
+      close(server);
+  }
+
+  free(x.data);
+  free(y.data);
+  free(om.ring_x);
+  free(om.ring_y);
+  return status;
+}
+
+/**
+ * Read the weights of a saved univariate model.
+ *
+ * Two formats are understood: "w <w>" and "b <b>" lines (a settings file,
+ * e.g. written by publish) and text log lines such as
+ * "iteration: 100, w: 1.5, b: 0.2". The last weights in the file win, so a
+ * whole training log gives its final model.
+ *
+ * @param path Path of the model file.
+ * @param ws   Pointer receiving the weights.
+ * @return int - 0 on success, 1 on error (the error has been reported).
+ */
+int load_model(const char *path, Weights *ws) {
+  FILE *file = fopen(path, "r");
+  if (file == NULL) {
+    perror("Error opening model file");
+    return 1;
+  }
+  char line[512];
+  int found_w = 0, found_b = 0;
+  while (fgets(line, sizeof(line), file) != NULL) {
+    const char *w = strstr(line, "w: "), *b = strstr(line, ", b: ");
+    double value, bias;
+    if (sscanf(line, "w %lf", &value) == 1) {
+      ws->w = value;
+      found_w = 1;
+    } else if (sscanf(line, "b %lf", &value) == 1) {
+      ws->b = value;
+      found_b = 1;
+    } else if (w != NULL && b != NULL && sscanf(w, "w: %lf", &value) == 1 &&
+             sscanf(b, ", b: %lf", &bias) == 1) {
+      ws->w = value;
+      ws->b = bias;
+      found_w = found_b = 1;
+    }
+  }
+  fclose(file);
+  if (!found_w || !found_b) {
+    fprintf(stderr, "Error: %s holds no univariate w and b\n", path);
+    return 1;
+  }
+  return 0;
+}
+
+// Inputs scored at a time from a mapped or regular file
+#define PREDICT_BLOCK (1 << 20)
+
+/**
+ * Write a batch of predictions, raw doubles or one per line.
+ */
+static void write_predictions(FILE *out, const double *p, size_t n,
+                              int binary) {
+  if (binary)
+    fwrite(p, sizeof(*p), n, out);
+  else
+    for (size_t i = 0; i < n; i++)
+      fprintf(out, "%.17g\n", p[i]);
+}
+
+/**
+ * Score every input of a file or stream with a univariate model.
+ *
+ * A binary data set is mapped and its x column scored in place. Text holds
+ * one input per line, a target after it is allowed and ignored, so a pairs
+ * file can be scored as it is. Regular files are scored in large blocks
+ * split across the threads. A pipe or socket ("-" for stdin) is scored
+ * batch by batch as its lines arrive, and every batch is flushed to the
+ * output, so the latency of a prediction is one read and one write.
+ *
+ * @param path     Path of the inputs, "-" for stdin.
+ * @param settings Pointer to the settings (output, log-format, batch-size).
+ * @param ws       Pointer to the weights of the model.
+ * @return int - 0 on success, 1 on error (the error has been reported).
+ */
+int run_predict(const char *path, const Settings *settings,
+                const Weights *ws) {
+  int binary = settings->log_format == LOG_BINARY;
+  FILE *out = stdout;
+  if (settings->output[0] != '\0') {
+    out = fopen(settings->output, binary ? "wb" : "w");
+    if (out == NULL) {
+      perror("Error Opening File");
+      return 1;
+    }
+  }
+  setvbuf(out, NULL, _IOFBF, 1 << 20);
+
+  int fd = strcmp(path, "-") == 0 ? 0 : open(path, O_RDONLY);
+  if (fd < 0) {
+    perror("Error opening target-value file");
+    if (out != stdout)
+      fclose(out);
+    return 1;
+  }
+  BinaryHeader header;
+  int mapped = pread(fd, &header, sizeof(header), 0) == sizeof(header) &&
+               memcmp(header.magic, binary_magic, sizeof(binary_magic)) == 0;
+
+  int status = 0;
+  double *predictions = NULL;
+  if (mapped) {
+    // Score the mapped x column block by block
+    close(fd);
+    Dataset data = {0};
+    status = load_dataset(path, 0, LAYOUT_ROW_MAJOR, 0, &data);
+    if (status == 0 && data.matrix.features > 0) {
+      fprintf(stderr, "Error: predict needs a univariate data set\n");
+      status = 1;
+    }
+    predictions = malloc(PREDICT_BLOCK * sizeof(double));
+    if (status == 0 && predictions == NULL) {
+      perror("Error allocating memory");
+      status = 1;
+    }
+    for (size_t i = 0; status == 0 && i < data.x.size; i += PREDICT_BLOCK) {
+      size_t n = data.x.size - i < PREDICT_BLOCK ? data.x.size - i
+                                                 : PREDICT_BLOCK;
+      IntVec block = {.data = data.x.data + i, .size = n};
+      predict(&block, ws, predictions);
+      write_predictions(out, predictions, n, binary);
+    }
+    free_dataset(&data);
+  } else {
+    // Stream the text, a pipe in batches as soon as they arrive
+    PairStream stream;
+    struct stat st;
+    status = stream_attach(&stream, fd, fd == 0 ? "stdin" : path);
+    if (status == 0) {
+      stream.inputs = 1;
+      stream.partial = fstat(fd, &st) != 0 || !S_ISREG(st.st_mode);
+      size_t batch = stream.partial ? settings->batch_size : PREDICT_BLOCK;
+      IntVec x = {.data = malloc(batch * sizeof(int)), .capacity = batch};
+      IntVec y = {0}; // Stays empty, only the inputs are read
+      predictions = malloc(batch * sizeof(double));
+      if (x.data == NULL || predictions == NULL) {
+        perror("Error allocating memory");
+        status = 1;
+      }
+      while (status == 0 &&
+             (status = stream_read(&stream, &x, &y, batch)) == 0 &&
+             x.size > 0) {
+        predict(&x, ws, predictions);
+        write_predictions(out, predictions, x.size, binary);
+        // The predictions before a malformed line go out before its error
+        if (stream.partial || stream.bad_line != 0)
+          fflush(out);
+      }
+      free(x.data);
+      stream_close(&stream);
+    }
+  }
+  free(predictions);
+
+  if (fflush(out) != 0 || ferror(out)) {
+    perror("Error writing predictions");
+    status = 1;
+  }
+  if (out != stdout)
+    fclose(out);
+  return status;
+}
+
+/**
+ * Train a multivariate model with full batch gradient descent.
+ *
+ * The gradient pass also returns the cost, so log-metrics and min-delta
+ * cost nothing extra. Both refer to the point the gradient was taken at,
+ * i.e. the weights before the step (or the nesterov lookahead), and
+ * min-delta compares the costs of consecutive iterations. The ridge penalty
+ * l2 is added to both.
+ *
+ * @param data     Pointer to the data set holding the feature matrix.
+ * @param settings Pointer to the settings (the early stopping state and the
+ *                 optimizer step count are advanced).
+ * @param log      Pointer to the logger, opened with the feature count.
+ * @return int - 0 on success, 1 on error (the error has been reported).
+ */
+int train_multivariate(const Dataset *data, Settings *settings, Logger *log) {
+  const FeatureMatrix *m = &data->matrix;
+  size_t k = m->features + 1;
+
+  // Parameters, lookahead point, gradient and the optimizer's state in one
+  // block, the bias is the last entry of each
+  double *theta = calloc(5 * k, sizeof(double));
+  MatrixWork work = {0};
+  if (theta == NULL || matrix_work_alloc(&work, m) != 0) {
+    perror("Error allocating memory");
+    matrix_work_free(&work);
+    free(theta);
+    return 1;
+  }
+  // theta, velocity and second are the state of a checkpoint
+  double *velocity = theta + k, *second = velocity + k;
+  double *at = second + k, *g = at + k;
+  for (size_t j = 0; j < m->features; j++)
+    theta[j] = settings->w;
+  theta[m->features] = settings->b;
+
+  Optimizer *opt = &settings->optimizer;
+  double previous = NAN;
+  int first = 0, status = 0;
+  if (settings->resume[0] != '\0') {
+    CheckpointHeader header;
+    status = read_checkpoint(settings->resume, &header, theta, k,
+                             m->features, opt->kind, 0);
+    if (status == 0) {
+      opt->t = header.steps;
+      settings->stop.streak = header.streak;
+      previous = header.previous;
+      first = header.iteration;
+    }
+  }
+
+  for (int i = first; status == 0 && i <= settings->iterations; i++) {
+    INSTRUMENT_POLL();
+    INSTRUMENT_BEGIN(PHASE_GRADIENT);
+    optimizer_lookahead_vec(opt, theta, velocity, at, k);
+    double cost = matrix_gradient(m, at, g, &work);
+    for (size_t j = 0; j < m->features; j++) {
+      g[j] += settings->l2 * at[j];
+      cost += settings->l2 / 2 * at[j] * at[j];
+    }
+    INSTRUMENT_END(PHASE_GRADIENT);
+    double norm = 0;
+    for (size_t j = 0; j < k; j++)
+      norm += g[j] * g[j];
+    norm = sqrt(norm);
+    INSTRUMENT_BEGIN(PHASE_UPDATE);
+    optimizer_step_vec(opt, theta, g, velocity, second, k);
+    INSTRUMENT_END(PHASE_UPDATE);
+
+    // Print the weights every specified number of iterations for progress
+    // tracking
+    if (i % settings->every == 0) {
+      INSTRUMENT_BEGIN(PHASE_LOGGING);
+      logger_push_vector(log, EVENT_ITERATION, i, theta,
+                         settings->log_metrics ? cost : NAN,
+                         settings->log_metrics ? norm : NAN);
+      INSTRUMENT_END(PHASE_LOGGING);
+    }
+
+    // Stop as soon as the run has converged, the first iteration has no
+    // cost change yet
+    double delta = isnan(previous) ? INFINITY : cost - previous;
+    previous = cost;
+    if ((settings->stop.tolerance > 0 || settings->stop.min_delta > 0) &&
+        early_stop(&settings->stop, norm, delta)) {
+      logger_push_vector(log, EVENT_CONVERGED, i, theta, NAN, NAN);
+      break;
+    }
+
+    // Checkpoint the state the next iteration starts from
+    if (settings->checkpoint[0] != '\0' &&
+        ((i + 1) % settings->checkpoint_every == 0 || stop_requested)) {
+      CheckpointHeader header = {.optimizer = opt->kind,
+                                 .features = m->features,
+                                 .iteration = i + 1,
+                                 .steps = opt->t,
+                                 .streak = settings->stop.streak,
+                                 .previous = previous};
+      write_checkpoint(settings->checkpoint, &header, theta, k);
+    }
+    if (stop_requested) {
+      fprintf(stderr, "Stopped by a signal after iteration %d, resume from "
+                      "%s\n",
+              i, settings->checkpoint);
+      status = 1;
+    }
+  }
+
+  matrix_work_free(&work);
+  free(theta);
+  return status;
+}
+
+/*
+ * Coordinate descent
+ *
+ * The l1 penalty is not differentiable at w_j = 0, gradient descent only
+ * circles around the exact zeros of a lasso fit. Coordinate descent instead
+ * minimizes the cost along one weight at a time, which has the closed form
+ *   w_j = S(norm_j w_j - x_j^T r / n, l1) / (norm_j + l2)
+ * with the soft threshold S, the column norm norm_j = x_j^T x_j / n cached
+ * once and the residuals r = X w + b - y kept up to date as the weights
+ * move. An update is then one dot product over the column and, when the
+ * weight changed, one axpy into r: O(n) instead of a full gradient. The
+ * bias is not penalized, its update subtracts the mean residual. The
+ * matrix is loaded column-major so every column is contiguous.
+ *
+ * After a sweep over all weights only the nonzero ones are swept until they
+ * settle, then a full sweep checks whether a zero weight has to enter. A
+ * path fits a decreasing sequence of l1 values, from the smallest one that
+ * keeps every weight at zero down to l1, and every fit starts from the
+ * solution of the previous one (warm start), so most points only take a
+ * few sweeps.
+ */
+
+// Largest change of the fitted values a sweep may make to end the fit when
+// the tolerance setting is 0
+#define CD_TOLERANCE 1e-9
+
+/**
+ * Run one coordinate descent sweep.
+ *
+ * @param m     Pointer to the column-major feature matrix.
+ * @param theta Pointer to the d weights followed by the bias, updated.
+ * @param norm  Pointer to the d column norms x_j^T x_j / n.
+ * @param r     Pointer to the residuals at theta, updated.
+ * @param l1    Lasso penalty.
+ * @param l2    Ridge penalty.
+ * @param full  Sweep every weight, otherwise only the nonzero ones.
+ * @return double - The largest change of the fitted values, |dw_j| times
+ *                  the root mean square of column j.
+ */
+static double cd_sweep(const FeatureMatrix *m, double *theta,
+                       const double *norm, double *r, double l1, double l2,
+                       int full) {
+  size_t d = m->features, n = m->rows;
+  double mean = 0;
+  for (size_t i = 0; i < n; i++)
+    mean += r[i];
+  mean /= n;
+  theta[d] -= mean;
+  for (size_t i = 0; i < n; i++)
+    r[i] -= mean;
+  double change = fabs(mean);
+
+  for (size_t j = 0; j < d; j++) {
+    if (norm[j] == 0 || (!full && theta[j] == 0))
+      continue;
+    const double *col = m->x + j * n;
+    double z = norm[j] * theta[j] - vector_ops.dot(col, r, n) / n;
+    double wj = soft_threshold(z, l1) / (norm[j] + l2);
+    double delta = wj - theta[j];
+    if (delta != 0) {
+      vector_ops.axpy(delta, col, r, n);
+      theta[j] = wj;
+      change = fmax(change, fabs(delta) * sqrt(norm[j]));
+    }
+  }
+  return change;
+}
+
+/**
+ * Compute the cost (half the mean squared error plus the penalties) from
+ * the residuals.
+ */
+static double cd_cost(const FeatureMatrix *m, const double *theta,
+                      const double *r, double l1, double l2) {
+  double cost = vector_ops.dot(r, r, m->rows) / (2 * m->rows);
+  for (size_t j = 0; j < m->features; j++)
+    cost += l1 * fabs(theta[j]) + l2 / 2 * theta[j] * theta[j];
+  return cost;
+}
+
+/**
+ * Sweep until the fit has converged or the sweeps run out.
+ *
+ * @param m         Pointer to the column-major feature matrix.
+ * @param theta     Pointer to the d weights followed by the bias, updated.
+ * @param norm      Pointer to the d column norms.
+ * @param r         Pointer to the residuals at theta, updated.
+ * @param l1        Lasso penalty.
+ * @param settings  Pointer to the settings (l2, sweeps, tolerance, logging).
+ * @param log       Pointer to the logger that gets the progress of the
+ *                  sweeps, NULL logs nothing.
+ * @return long - The number of sweeps, negative if the fit did not
+ *                converge.
+ */
+static long cd_fit(const FeatureMatrix *m, double *theta, const double *norm,
+                   double *r, double l1, const Settings *settings,
+                   Logger *log) {
+  double l2 = settings->l2;
+  double tolerance =
+      settings->stop.tolerance > 0 ? settings->stop.tolerance : CD_TOLERANCE;
+  int full = 1;
+  for (int i = 0; i <= settings->iterations; i++) {
+    INSTRUMENT_POLL();
+    INSTRUMENT_BEGIN(PHASE_GRADIENT);
+    double change = cd_sweep(m, theta, norm, r, l1, l2, full);
+    INSTRUMENT_END(PHASE_GRADIENT);
+    if (log != NULL && i % settings->every == 0) {
+      INSTRUMENT_BEGIN(PHASE_LOGGING);
+      logger_push_vector(log, EVENT_ITERATION, i, theta,
+                         settings->log_metrics ? cd_cost(m, theta, r, l1, l2)
+                                               : NAN,
+                         NAN);
+      INSTRUMENT_END(PHASE_LOGGING);
+    }
+
+    // Only a full sweep that changes nothing ends the fit
+    if (change <= tolerance && full) {
+      if (log != NULL)
+        logger_push_vector(log, EVENT_CONVERGED, i, theta, NAN, NAN);
+      return i + 1;
+    }
+    full = change <= tolerance;
+  }
+  return -(long)settings->iterations - 1;
+}
+
+/**
+ * Train a multivariate model with coordinate descent, or a regularization
+ * path with settings->path points.
+ *
+ * @param data     Pointer to the data set holding the column-major feature
+ *                 matrix.
+ * @param settings Pointer to the settings.
+ * @param log      Pointer to the logger, opened with the feature count.
+ * @return int - 0 on success, 1 on error (the error has been reported).
+ */
+int train_coordinate(const Dataset *data, const Settings *settings,
+                     Logger *log) {
+  const FeatureMatrix *m = &data->matrix;
+  size_t d = m->features, n = m->rows;
+  if (n == 0) {
+    fprintf(stderr, "Error: coordinate needs at least one row\n");
+    return 1;
+  }
+  double *theta = malloc((2 * d + 1) * sizeof(double));
+  double *r = malloc(n * sizeof(double));
+  if (theta == NULL || r == NULL) {
+    perror("Error allocating memory");
+    free(theta);
+    free(r);
+    return 1;
+  }
+  double *norm = theta + d + 1;
+  for (size_t j = 0; j < d; j++)
+    norm[j] = vector_ops.dot(m->x + j * n, m->x + j * n, n) / n;
+
+  // A path starts where every weight is zero, a single fit at the initial
+  // weights
+  int path = settings->path > 1;
+  for (size_t j = 0; j < d; j++)
+    theta[j] = path ? 0 : settings->w;
+  theta[d] = path ? 0 : settings->b;
+  for (size_t i = 0; i < n; i++)
+    r[i] = theta[d] - m->y[i];
+  for (size_t j = 0; j < d; j++)
+    if (theta[j] != 0)
+      vector_ops.axpy(theta[j], m->x + j * n, r, n);
+
+  if (!path)
+    cd_fit(m, theta, norm, r, settings->l1, settings, log);
+  else {
+    // Above max_j |x_j^T r| / n at w = 0 and the best bias every weight
+    // stays zero
+    cd_sweep(m, theta, norm, r, INFINITY, settings->l2, 1);
+    double l1_max = settings->l1;
+    for (size_t j = 0; j < d; j++)
+      l1_max = fmax(l1_max, fabs(vector_ops.dot(m->x + j * n, r, n)) / n);
+
+    // Geometrically spaced from l1_max down to l1
+    for (int p = 0; p < settings->path; p++) {
+      double l1 = l1_max * pow(settings->l1 / l1_max,
+                               (double)p / (settings->path - 1));
+      long sweeps = cd_fit(m, theta, norm, r, l1, settings, NULL);
+      if (sweeps < 0) {
+        fprintf(stderr, "Warning: path point %d did not converge in %d "
+                        "sweeps\n",
+                p + 1, settings->iterations + 1);
+        sweeps = -sweeps;
+      }
+      logger_push_path(log, p + 1, sweeps, theta, l1,
+                       settings->log_metrics
+                           ? cd_cost(m, theta, r, l1, settings->l2)
+                           : NAN);
+    }
+  }
+
+  free(theta);
+  free(r);
+  return 0;
+}
+
+// One configuration of a hyperparameter sweep
+typedef struct {
+  double alpha;   // Learning rate
+  double w, b;    // Initial weight and initial bias
+  int iterations; // Number of iterations to train (inclusive)
+} SweepConfig;
+
+/**
+ * Read the configurations of a sweep file.
+ *
+ * Every non-blank line is one configuration of key value pairs out of
+ * alpha, w, b and iterations; keys a line leaves out keep the value of the
+ * settings file.
+ *
+ * @param path     Path of the sweep file.
+ * @param settings Pointer to the settings the configurations start from.
+ * @param configs  Pointer receiving the malloc'd configurations.
+ * @param count    Pointer receiving the number of configurations.
+ * @return int - 0 on success, 1 on error (the error has been reported).
+ */
+int read_sweep(const char *path, const Settings *settings,
+               SweepConfig **configs, size_t *count) {
+  FILE *file = fopen(path, "r");
+  if (file == NULL) {
+    perror("Error opening sweep file");
+    return 1;
+  }
+
+  char *line = NULL;
+  size_t line_capacity = 0, line_number = 0, capacity = 0;
+  int status = 0;
+  *configs = NULL;
+  *count = 0;
+  while (status == 0 && getline(&line, &line_capacity, file) != -1) {
+    line_number++;
+    SweepConfig c = {.alpha = settings->optimizer.alpha,
+                     .w = settings->w,
+                     .b = settings->b,
+                     .iterations = settings->iterations};
+    char key[33], value[101];
+    const char *p = line;
+    int used, pairs = 0;
+    while (status == 0 &&
+           sscanf(p, "%32s %100s%n", key, value, &used) == 2) {
+      p += used;
+      pairs++;
+      if (strcmp(key, "alpha") == 0)
+        c.alpha = atof(value);
+      else if (strcmp(key, "w") == 0)
+        c.w = atof(value);
+      else if (strcmp(key, "b") == 0)
+        c.b = atof(value);
+      else if (strcmp(key, "iterations") == 0) {
+        long long iterations;
+        if (parse_count(value, 0, INT_MAX, &iterations) != 0) {
+          fprintf(stderr, "Error: %s:%zu: invalid iterations %s\n", path,
+                  line_number, value);
+          status = 1;
+        } else
+          c.iterations = iterations;
+      } else {
+        fprintf(stderr, "Error: %s:%zu: unknown sweep key %s\n", path,
+                line_number, key);
+        status = 1;
+      }
+    }
+    if (status == 0 && sscanf(p, "%32s", key) == 1) {
+      fprintf(stderr, "Error: %s:%zu: expected key value pairs\n", path,
+              line_number);
+      status = 1;
+    }
+    if (status != 0 || pairs == 0)
+      continue;
+
+    // Grow the array by doubling, like vec_append()
+    if (*count == capacity) {
+      capacity = capacity == 0 ? 16 : capacity * 2;
+      SweepConfig *grown = realloc(*configs, capacity * sizeof(*grown));
+      if (grown == NULL) {
+        perror("Error allocating memory");
+        status = 1;
+        break;
+      }
+      *configs = grown;
+    }
+    (*configs)[(*count)++] = c;
+  }
+  free(line);
+  fclose(file);
+
+  if (status == 0 && *count == 0) {
+    fprintf(stderr, "Error: %s holds no configurations\n", path);
+    status = 1;
+  }
+  if (status != 0) {
+    free(*configs);
+    *configs = NULL;
+  }
+  return status;
+}
+
+/**
+ * Train every configuration of a sweep file together with gradient descent.
+ *
+ * All models still training share each pass over the data (or the
+ * sufficient statistics in sufficient-stats mode). A model leaves
+ * the pass once it reaches its iteration count or the early stopping
+ * criteria, so the active ones stay contiguous for the SIMD lanes. One
+ * record per configuration is logged at the end, then the one with the
+ * lowest cost.
+ *
+ * @param data     Pointer to the data set holding the pairs.
+ * @param settings Pointer to the settings, holding the sweep file and the
+ *                 mode.
+ * @param stats    Pointer to the sufficient statistics of the data.
+ * @param log      Pointer to the logger.
+ * @return int - 0 on success, 1 on error (the error has been reported).
+ */
+int train_sweep(const Dataset *data, const Settings *settings,
+                const SuffStats *stats, Logger *log) {
+  SweepConfig *configs;
+  size_t k;
+  if (read_sweep(settings->sweep, settings, &configs, &k) != 0)
+    return 1;
+
+  // Slot m holds configuration order[m], the first active ones are training
+  SweepTask task = {.kernel = select_sweep_kernel(gradient_kernel),
+                    .stride = (2 * k + 7) / 8 * 8};
+  task.partials = aligned_alloc(
+      64, thread_pool.nthreads * task.stride * sizeof(double));
+  double *w = malloc(4 * k * sizeof(double));
+  size_t *order = malloc(k * sizeof(*order));
+  EarlyStop *stop = malloc(k * sizeof(*stop));
+  Weights *result = malloc(k * sizeof(*result));
+  long *last = malloc(k * sizeof(*last));
+  int status = 0;
+  if (task.partials == NULL || w == NULL || order == NULL || stop == NULL ||
+      result == NULL || last == NULL) {
+    perror("Error allocating memory");
+    status = 1;
+  } else {
+    double *b = w + k, *dw = b + k, *db = dw + k;
+    for (size_t m = 0; m < k; m++) {
+      w[m] = configs[m].w;
+      b[m] = configs[m].b;
+      order[m] = m;
+      stop[m] = settings->stop;
+    }
+    task.w = w;
+    task.b = b;
+
+    int stopping =
+        settings->stop.tolerance > 0 || settings->stop.min_delta > 0;
+    size_t active = k;
+    for (long i = 0; active > 0; i++) {
+      // One shared pass over the data, or O(1) per model from the sums
+      task.k = active;
+      if (settings->mode == MODE_SUFFICIENT_STATS)
+        for (size_t m = 0; m < active; m++) {
+          Weights g = stats_gradient(stats, &(Weights){.w = w[m], .b = b[m]});
+          dw[m] = g.w;
+          db[m] = g.b;
+        }
+      else
+        sweep_gradient(&data->x, &data->y, &task, dw, db);
+      for (size_t m = 0; m < active;) {
+        const SweepConfig *c = &configs[order[m]];
+        Weights g = {.w = dw[m], .b = db[m]};
+        Weights d = {.w = -c->alpha * g.w, .b = -c->alpha * g.b};
+        w[m] += d.w;
+        b[m] += d.b;
+        int finished = i >= c->iterations;
+        if (!finished && stopping)
+          finished = early_stop(&stop[m], hypot(g.w, g.b),
+                                settings->stop.min_delta > 0
+                                    ? cost_change(stats, &g, &d)
+                                    : 0);
+        if (!finished) {
+          m++;
+          continue;
+        }
+
+        // Record the result and move the last active model into this slot
+        result[order[m]] = (Weights){.w = w[m], .b = b[m]};
+        last[order[m]] = i;
+        active--;
+        w[m] = w[active];
+        b[m] = b[active];
+        dw[m] = dw[active];
+        db[m] = db[active];
+        order[m] = order[active];
+        stop[m] = stop[active];
+      }
+    }
+
+    size_t best = 0;
+    double best_cost = INFINITY;
+    for (size_t c = 0; c < k; c++) {
+      // A diverged configuration must not win through a NAN cost
+      double cost = isfinite(result[c].w) && isfinite(result[c].b)
+                        ? stats_cost(stats, &result[c])
+                        : INFINITY;
+      logger_push_sweep(log, EVENT_SWEEP, c + 1, last[c], &result[c], cost);
+      if (cost < best_cost) {
+        best = c;
+        best_cost = cost;
+      }
+    }
+    logger_push_sweep(log, EVENT_BEST, best + 1, last[best], &result[best],
+                      best_cost);
+  }
+
+  free(task.partials);
+  free(w);
+  free(order);
+  free(stop);
+  free(result);
+  free(last);
+  free(configs);
+  return status;
+}
+
+/*
+ * Cross-validation
+ *
+ * cv k splits the pairs into k contiguous folds and trains k models, each
+ * on every fold but one, then measures each model on the fold it left out.
+ * One pass over the loaded pairs collects the sufficient statistics of
+ * every fold, the training statistics of a fold are the totals minus its
+ * own, so no fold copies the data and every iteration of a model is O(1).
+ * The folds train in parallel on the thread pool.
+ */
+
+// Folds of a cross-validation, shared by the pool threads
+typedef struct {
+  const IntVec *x, *y;      // Pairs split into the folds
+  const Settings *settings; // Mode, optimizer, iterations and early stopping
+  int k;                    // Number of folds
+  SuffStats *held;          // Statistics of every fold's own pairs
+  SuffStats *train;         // Statistics of every fold's training pairs
+  Weights *result;          // Final weights of every fold
+  long *last;               // Last iteration of every fold, -1 on failure
+} CvTask;
+
+/**
+ * Collect the statistics of this thread's folds tid, tid + nthreads, ...
+ */
+static void cv_stats_task(void *ctx, int tid, int nthreads) {
+  CvTask *task = ctx;
+  size_t n = task->x->size;
+  for (int f = tid; f < task->k; f += nthreads) {
+    SuffStats st = {.n = 0};
+    for (size_t i = n * f / task->k; i < n * (f + 1) / task->k; i++)
+      stats_add(&st, task->x->data[i], task->y->data[i]);
+    task->held[f] = st;
+  }
+}
+
+/**
+ * Train one model on sufficient statistics the way the training loop of
+ * main() does, or solve it exactly in closed-form mode.
+ *
+ * @param st       Pointer to the training statistics.
+ * @param settings Pointer to the settings.
+ * @param ws       Pointer receiving the weights.
+ * @return long - The last iteration trained, -1 if closed-form has no
+ *                solution.
+ */
+static long cv_fit(const SuffStats *st, const Settings *settings,
+                   Weights *ws) {
+  *ws = (Weights){.w = settings->w, .b = settings->b};
+  if (settings->mode == MODE_CLOSED_FORM)
+    return closed_form(st, ws) == 0 ? 0 : -1;
+
+  Optimizer opt = settings->optimizer;
+  EarlyStop stop = settings->stop;
+  int stopping = stop.tolerance > 0 || stop.min_delta > 0;
+  for (long i = 0;; i++) {
+    Weights at = optimizer_lookahead(&opt, ws);
+    Weights g = stats_gradient(st, &at);
+    Weights before = *ws;
+    optimizer_step(&opt, ws, &g, st);
+    if (i >= settings->iterations)
+      return i;
+
+    // The cost change needs the gradient at the old weights, as in main()
+    double delta = 0;
+    if (stop.min_delta > 0) {
+      Weights ahead = {.w = at.w - before.w, .b = at.b - before.b};
+      Weights h_ahead = hessian_times(st, &ahead);
+      Weights old = {.w = g.w - h_ahead.w, .b = g.b - h_ahead.b};
+      Weights d = {.w = ws->w - before.w, .b = ws->b - before.b};
+      delta = cost_change(st, &old, &d);
+    }
+    if (stopping && early_stop(&stop, hypot(g.w, g.b), delta))
+      return i;
+  }
+}
+
+/**
+ * Train this thread's folds tid, tid + nthreads, ...
+ */
+static void cv_train_task(void *ctx, int tid, int nthreads) {
+  CvTask *task = ctx;
+  for (int f = tid; f < task->k; f += nthreads)
+    task->last[f] =
+        cv_fit(&task->train[f], task->settings, &task->result[f]);
+}
+
+/**
+ * Run a k-fold cross-validation of the settings on the loaded pairs.
+ *
+ * Logs the model and the validation cost (half the mean squared error on
+ * the held out fold, without the penalties) of every fold, then the mean of
+ * the weights and of the validation costs over the folds.
+ *
+ * @param data     Pointer to the data set holding the pairs.
+ * @param settings Pointer to the settings, holding the fold count.
+ * @param log      Pointer to the logger.
+ * @return int - 0 on success, 1 on error (the error has been reported).
+ */
+int train_cv(const Dataset *data, const Settings *settings, Logger *log) {
+  int k = settings->cv;
+  if (data->x.size < (size_t)k) {
+    fprintf(stderr, "Error: cv %d needs at least %d pairs\n", k, k);
+    return 1;
+  }
+
+  CvTask task = {.x = &data->x,
+                 .y = &data->y,
+                 .settings = settings,
+                 .k = k,
+                 .held = malloc(2 * k * sizeof(SuffStats)),
+                 .result = malloc(k * sizeof(Weights)),
+                 .last = malloc(k * sizeof(long))};
+  int status = 0;
+  if (task.held == NULL || task.result == NULL || task.last == NULL) {
+    perror("Error allocating memory");
+    status = 1;
+  } else {
+    task.train = task.held + k;
+    pool_run(&thread_pool, cv_stats_task, &task);
+
+    // The totals in fold order, then every fold's complement
+    SuffStats total = {.n = 0};
+    for (int f = 0; f < k; f++)
+      stats_merge(&total, &task.held[f], 1);
+    for (int f = 0; f < k; f++) {
+      task.train[f] = total;
+      stats_merge(&task.train[f], &task.held[f], -1);
+      task.train[f].l1 = settings->l1;
+      task.train[f].l2 = settings->l2;
+    }
+    pool_run(&thread_pool, cv_train_task, &task);
+
+    for (int f = 0; status == 0 && f < k; f++)
+      if (task.last[f] < 0) {
+        fprintf(stderr, "Error: the training pairs of fold %d need at "
+                        "least two distinct inputs\n",
+                f + 1);
+        status = 1;
+      }
+
+    Weights mean = {.w = 0, .b = 0};
+    double mean_cost = 0;
+    for (int f = 0; status == 0 && f < k; f++) {
+      double cost = stats_cost(&task.held[f], &task.result[f]);
+      logger_push_sweep(log, EVENT_FOLD, f + 1, task.last[f],
+                        &task.result[f], cost);
+      mean.w += task.result[f].w / k;
+      mean.b += task.result[f].b / k;
+      mean_cost += cost / k;
+    }
+    if (status == 0)
+      logger_push_sweep(log, EVENT_CV, k, 0, &mean, mean_cost);
+  }
+
+  free(task.held);
+  free(task.result);
+  free(task.last);
+  return status;
+}
+
+/*
+ * Specialized training loops
+ *
+ * The training loop of main() checks its options every iteration. In the
+ * plain configuration (gradient-descent on the pairs in memory without
+ * metrics, early stopping, checkpoints, normalize, l2, peers or a device)
+ * none of them apply, so FAST_LOOP instantiates the loop once per update
+ * rule and gradient pass, both fixed at compile time. select_fast_loop()
+ * picks the instance once before training. It runs the iterations between
+ * two log records as one block, without a modulo or a branch on the
+ * options per iteration, and its weights are bit-identical to the loop of
+ * main() as long as they stay finite.
+ */
+
+// Training loop of one update rule and gradient pass
+typedef void (*FastLoop)(const IntVec *x, const IntVec *y, Optimizer *opt,
+                         Weights *ws, int iterations, int every,
+                         Logger *log);
+
+// Gradient sums of the instances: the int32 or the narrow kernel on one
+// thread, or gradient_sums() with the thread pool or deterministic sums
+#define FAST_PASS_INT32(x, y, at)                                              \
+  gradient_kernel((x)->data, (y)->data, (x)->size, (at).w, (at).b)
+#define FAST_PASS_NARROW(x, y, at)                                             \
+  narrow_kernel((x)->data, (y)->data, (x)->size, (at).w, (at).b)
+#define FAST_PASS_POOL(x, y, at) gradient_sums(x, y, &(at), NULL)
+
+// One iteration: the gradient at the lookahead point, then the update
+#define FAST_STEP(kind, pass)                                                  \
+  do {                                                                         \
+    Weights at = kind == OPT_NESTEROV ? optimizer_lookahead(opt, ws) : *ws;   \
+    Weights g = pass(x, y, at);                                                \
+    g.w = g.w / x->size;                                                       \
+    g.b = g.b / x->size;                                                       \
+    optimizer_update(opt, ws, &g, NULL, kind);                                 \
+  } while (0)
+
+// The loop of main(): iteration i logs when it is a multiple of every, the
+// iterations up to the next multiple follow without a check
+#define FAST_LOOP(name, kind, pass)                                            \
+  static void name(const IntVec *x, const IntVec *y, Optimizer *opt,           \
+                   Weights *ws, int iterations, int every, Logger *log) {      \
+    for (int i = 0; i <= iterations; i++) {                                    \
+      FAST_STEP(kind, pass);                                                   \
+      logger_push(log, EVENT_ITERATION, i, ws, NAN, NAN);                      \
+      int end = iterations - i < every ? iterations : i + every - 1;           \
+      while (i < end) {                                                        \
+        i++;                                                                   \
+        FAST_STEP(kind, pass);                                                 \
+      }                                                                        \
+    }                                                                          \
+  }
+
+// The three passes of one update rule
+#define FAST_LOOPS(prefix, kind)                                               \
+  FAST_LOOP(prefix##_int32, kind, FAST_PASS_INT32)                             \
+  FAST_LOOP(prefix##_narrow, kind, FAST_PASS_NARROW)                           \
+  FAST_LOOP(prefix##_pool, kind, FAST_PASS_POOL)
+
+FAST_LOOPS(fast_gd, OPT_GD)
+FAST_LOOPS(fast_momentum, OPT_MOMENTUM)
+FAST_LOOPS(fast_nesterov, OPT_NESTEROV)
+FAST_LOOPS(fast_rmsprop, OPT_RMSPROP)
+FAST_LOOPS(fast_adam, OPT_ADAM)
+
+// Instances indexed by OptimizerKind (up to adam) and pass
+static const FastLoop fast_loops[][3] = {
+    {fast_gd_int32, fast_gd_narrow, fast_gd_pool},
+    {fast_momentum_int32, fast_momentum_narrow, fast_momentum_pool},
+    {fast_nesterov_int32, fast_nesterov_narrow, fast_nesterov_pool},
+    {fast_rmsprop_int32, fast_rmsprop_narrow, fast_rmsprop_pool},
+    {fast_adam_int32, fast_adam_narrow, fast_adam_pool}};
+
+/**
+ * Pick the specialized loop of the settings, once before training.
+ *
+ * @param settings Pointer to the settings.
+ * @param x        Pointer to the inputs, their type decides the kernel.
+ * @param nodes    Number of nodes of the run.
+ * @return FastLoop - The loop, NULL if the settings need the loop of
+ *                    main().
+ */
+static FastLoop select_fast_loop(const Settings *settings, const IntVec *x,
+                                 int nodes) {
+#ifdef LR_INSTRUMENT
+  // The phases are measured in the loop of main()
+  return NULL;
+#endif
+  if (settings->mode != MODE_GRADIENT_DESCENT || settings->log_metrics ||
+      settings->stop.tolerance > 0 || settings->stop.min_delta > 0 ||
+      settings->checkpoint[0] != '\0' || settings->resume[0] != '\0' ||
+      settings->normalize || settings->l2 > 0 || nodes > 1 ||
+      settings->device != DEVICE_CPU || settings->every < 1 ||
+      settings->optimizer.kind == OPT_LINE_SEARCH)
+    return NULL;
+  int pass = thread_pool.nthreads > 1 || deterministic ? 2
+             : x->type == COLUMN_INT32                 ? 0
+                                                       : 1;
+  return fast_loops[settings->optimizer.kind][pass];
+}
+
+#ifdef LR_BENCH
+/*
+ * Benchmarks
+ *
+ * Built with -DLR_BENCH the executable is a benchmark suite instead of the
+ * trainer:
+ *   cc -O2 -pthread -DLR_BENCH univariate-linear-regression.c -o
+ *      univariate-linear-regression-bench -lm
+ *   ./univariate-linear-regression-bench [max rows] > bench.json
+ * It times loading (text parsing and binary mapping), one gradient() pass
+ * for every kernel the CPU supports in every precision and element type
+ * (with its error against double precision) and every thread count, the
+ * training loop in gradient-descent and sufficient-stats mode, the
+ * multivariate gradient, predict() (throughput, and the p50 and p99 latency
+ * of small batches), and the logger, on synthetic data sets of 1K rows
+ * growing tenfold up to max rows (default 10M, at most 100M). Every
+ * measurement repeats until it ran for at least BENCH_MIN_SECONDS and is
+ * printed as one JSON object.
+ */
+
+// Minimum run time of one measurement
+#define BENCH_MIN_SECONDS 0.2
+
+// Features of the multivariate benchmark, run on rows / BENCH_FEATURES
+// samples so the matrix stays eight times the size of the pairs
+#define BENCH_FEATURES 16
+
+// Keeps the compiler from dropping the benchmarked work
+static volatile double bench_sink;
+
+// Whether the next JSON object is the first one of the array
+static int bench_first = 1;
+
+/**
+ * Read the monotonic clock.
+ *
+ * @return double - The time in seconds.
+ */
+static double bench_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/**
+ * Print one measurement as a JSON object.
+ *
+ * @param name       Benchmark name.
+ * @param variant    Kernel, mode or format the benchmark ran with.
+ * @param rows       Elements processed per iteration.
+ * @param threads    Number of threads.
+ * @param iterations Number of iterations timed.
+ * @param seconds    Total time of all iterations.
+ * @param bytes      Bytes read per iteration.
+ * @param error      Relative error against the double precision result, or
+ *                   negative if the benchmark has none.
+ */
+static void bench_report(const char *name, const char *variant, size_t rows,
+                         int threads, long iterations, double seconds,
+                         double bytes, double error) {
+  printf("%s\n    {\"name\": \"%s\", \"variant\": \"%s\", \"rows\": %zu, "
+         "\"threads\": %d, \"iterations\": %ld, \"seconds\": %.6f, "
+         "\"ns_per_element\": %.4f, \"gb_per_s\": %.4f, "
+         "\"iterations_per_s\": %.2f",
+         bench_first ? "" : ",", name, variant, rows, threads, iterations,
+         seconds, seconds * 1e9 / ((double)rows * iterations),
+         bytes * iterations / seconds / 1e9, iterations / seconds);
+  if (error >= 0)
+    printf(", \"relative_error\": %.3e", error);
+  printf("}");
+  bench_first = 0;
+  fflush(stdout);
+}
+
+// Weights every gradient benchmark is evaluated at
+static const Weights bench_weights = {.w = 1.5, .b = 0.5};
+
+// Double precision kernel of the instruction set being benchmarked
+static GradientKernel bench_f64_kernel = gradient_scalar;
+
+/**
+ * Fill the pairs with y = 2x + 3 plus noise from a fixed-seed generator,
+ * every value fits in int8.
+ */
+static void bench_fill(IntVec *x, IntVec *y, size_t rows) {
+  uint64_t state = 88172645463325252ULL;
+  for (size_t i = 0; i < rows; i++) {
+    // xorshift64
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    x->data[i] = (int)(state % 50);
+    y->data[i] = 2 * x->data[i] + 3 + (int)(state >> 60) - 8;
+  }
+  x->size = y->size = rows;
+}
+
+/**
+ * Time loading the pairs back from a text file and from a binary file.
+ *
+ * @param x    Pointer to the inputs.
+ * @param y    Pointer to the targets.
+ * @param rows Number of pairs.
+ * @return int - 0 on success, 1 on error (the error has been reported).
+ */
+static int bench_load(const IntVec *x, const IntVec *y, size_t rows) {
+  char path[] = "/tmp/lr-bench-XXXXXX";
+  int fd = mkstemp(path);
+  FILE *file = fd < 0 ? NULL : fdopen(fd, "w");
+  if (file == NULL) {
+    perror("Error creating benchmark file");
+    return 1;
+  }
+  for (size_t i = 0; i < rows; i++)
+    fprintf(file, "%d %d\n", x->data[i], y->data[i]);
+  long text_bytes = ftell(file);
+  fclose(file);
+
+  // The text file goes through the parser, the binary one is mapped
+  for (int binary = 0; binary < 2; binary++) {
+    if (binary && write_binary(path, x, y) != 0) {
+      unlink(path);
+      return 1;
+    }
+    double bytes = binary ? sizeof(BinaryHeader) + rows * 8.0 : text_bytes;
+    long iterations = 1;
+    double seconds;
+    for (;;) {
+      double start = bench_now();
+      for (long r = 0; r < iterations; r++) {
+        Dataset data;
+        if (load_dataset(path, 0, LAYOUT_ROW_MAJOR, 0, &data) != 0) {
+          unlink(path);
+          return 1;
+        }
+        bench_sink += data.x.data[rows - 1];
+        free_dataset(&data);
+      }
+      seconds = bench_now() - start;
+      if (seconds >= BENCH_MIN_SECONDS)
+        break;
+      iterations *= 2;
+    }
+    bench_report(binary ? "load-binary" : "load-text", "", rows,
+                 thread_pool.nthreads, iterations, seconds, bytes, -1);
+  }
+  unlink(path);
+  return 0;
+}
+
+/**
+ * Time one gradient() pass and the training loop around it.
+ *
+ * @param x         Pointer to the inputs.
+ * @param y         Pointer to the targets.
+ * @param variant   Name of the selected kernel, precision or element type.
+ * @param exact     Pointer to the gradient of the double precision kernel at
+ *                  bench_weights, the error is measured against it.
+ */
+static void bench_gradient(const IntVec *x, const IntVec *y,
+                           const char *variant, const Weights *exact) {
+  Weights ws = bench_weights;
+  Weights g = gradient(x, y, &ws);
+  double error =
+      hypot(g.w - exact->w, g.b - exact->b) / hypot(exact->w, exact->b);
+
+  long iterations = 1;
+  double seconds;
+  for (;;) {
+    double start = bench_now();
+    for (long r = 0; r < iterations; r++)
+      bench_sink += gradient(x, y, &ws).w;
+    seconds = bench_now() - start;
+    if (seconds >= BENCH_MIN_SECONDS)
+      break;
+    iterations *= 2;
+  }
+  bench_report("gradient", variant, x->size, thread_pool.nthreads,
+               iterations, seconds, x->size * 2.0 * column_sizes[x->type],
+               error);
+
+  // The pass of a logging iteration, gradient and cost fused (only double
+  // precision has a fused kernel, narrow columns use the f64 ones)
+  cost_kernel = select_cost_kernel(
+      x->type == COLUMN_INT32 ? gradient_kernel : bench_f64_kernel, x->type);
+  if (cost_kernel != NULL) {
+    iterations = 1;
+    for (;;) {
+      double cost, start = bench_now();
+      for (long r = 0; r < iterations; r++)
+        bench_sink += gradient_cost(x, y, &ws, &cost).w + cost;
+      seconds = bench_now() - start;
+      if (seconds >= BENCH_MIN_SECONDS)
+        break;
+      iterations *= 2;
+    }
+    bench_report("gradient-cost", variant, x->size, thread_pool.nthreads,
+                 iterations, seconds, x->size * 2.0 * column_sizes[x->type],
+                 -1);
+  }
+
+  // The loop of gradient-descent mode: gradient and optimizer step
+  Optimizer opt = {.kind = OPT_GD, .alpha = 0.00001};
+  iterations = 1;
+  for (;;) {
+    Weights weights = {0};
+    double start = bench_now();
+    for (long r = 0; r < iterations; r++) {
+      Weights g = gradient(x, y, &weights);
+      optimizer_step(&opt, &weights, &g, NULL);
+    }
+    seconds = bench_now() - start;
+    bench_sink += weights.w;
+    if (seconds >= BENCH_MIN_SECONDS)
+      break;
+    iterations *= 2;
+  }
+  bench_report("train", variant, x->size, thread_pool.nthreads, iterations,
+               seconds, x->size * 2.0 * column_sizes[x->type], -1);
+
+  // The same loop specialized at compile time, it logs its first iteration
+  Settings plain = {.mode = MODE_GRADIENT_DESCENT,
+                    .every = INT_MAX,
+                    .optimizer = {.kind = OPT_GD, .alpha = 0.00001}};
+  FastLoop fast = select_fast_loop(&plain, x, 1);
+  Logger *log = malloc(sizeof(*log));
+  if (fast == NULL || log == NULL ||
+      logger_open(log, "/dev/null", LOG_BINARY, 0, 0) != 0) {
+    free(log);
+    return;
+  }
+  iterations = 1;
+  for (;;) {
+    Weights weights = {0};
+    Optimizer fast_opt = plain.optimizer;
+    double start = bench_now();
+    fast(x, y, &fast_opt, &weights, iterations - 1, plain.every, log);
+    seconds = bench_now() - start;
+    bench_sink += weights.w;
+    if (seconds >= BENCH_MIN_SECONDS)
+      break;
+    iterations *= 2;
+  }
+  logger_close(log);
+  free(log);
+  bench_report("train-fast", variant, x->size, thread_pool.nthreads,
+               iterations, seconds, x->size * 2.0 * column_sizes[x->type],
+               -1);
+}
+
+/**
+ * Time one matrix_gradient() pass over BENCH_FEATURES features.
+ *
+ * @param rows    Number of samples.
+ * @param variant Name of the selected kernel.
+ * @return int - 0 on success, 1 if out of memory.
+ */
+static int bench_matrix(size_t rows, const char *variant) {
+  size_t d = BENCH_FEATURES;
+  FeatureMatrix m = {.x = malloc(rows * d * sizeof(double)),
+                     .y = malloc(rows * sizeof(double)),
+                     .rows = rows,
+                     .features = d,
+                     .layout = LAYOUT_ROW_MAJOR,
+                     .owns_x = 1,
+                     .owns_y = 1};
+  double w[BENCH_FEATURES + 1] = {0}, g[BENCH_FEATURES + 2];
+  MatrixWork work;
+  if (m.x == NULL || m.y == NULL || matrix_work_alloc(&work, &m) != 0) {
+    perror("Error allocating memory");
+    free_matrix(&m);
+    return 1;
+  }
+  for (size_t i = 0; i < rows * d; i++)
+    m.x[i] = (double)(i % 1000) / 1000;
+  for (size_t i = 0; i < rows; i++)
+    m.y[i] = (double)(i % 7);
+
+  long iterations = 1;
+  double seconds;
+  for (;;) {
+    double start = bench_now();
+    for (long r = 0; r < iterations; r++)
+      bench_sink += matrix_gradient(&m, w, g, &work);
+    seconds = bench_now() - start;
+    if (seconds >= BENCH_MIN_SECONDS)
+      break;
+    iterations *= 2;
+  }
+  // The matrix is read twice, for the residuals and for the gradient
+  bench_report("matrix-gradient", variant, rows * d, thread_pool.nthreads,
+               iterations, seconds, 2.0 * rows * d * sizeof(double), -1);
+  matrix_work_free(&work);
+  free_matrix(&m);
+  return 0;
+}
+
+// Calls timed one by one for the prediction latency percentiles
+#define BENCH_LATENCY_CALLS 100000
+
+/**
+ * Order two doubles for qsort().
+ */
+static int bench_compare(const void *a, const void *b) {
+  double da = *(const double *)a, db = *(const double *)b;
+  return (da > db) - (da < db);
+}
+
+/**
+ * Time predict(): throughput over all the inputs and, for small batches,
+ * the latency percentiles of single calls.
+ *
+ * @param x       Pointer to the inputs.
+ * @param variant Name of the selected kernel.
+ * @param latency Also measure the latency of small batches.
+ * @return int - 0 on success, 1 if out of memory.
+ */
+static int bench_predict(const IntVec *x, const char *variant, int latency) {
+  double *out = malloc(x->size * sizeof(double));
+  double *samples = malloc(BENCH_LATENCY_CALLS * sizeof(double));
+  if (out == NULL || samples == NULL) {
+    perror("Error allocating memory");
+    free(out);
+    free(samples);
+    return 1;
+  }
+
+  long iterations = 1;
+  double seconds;
+  for (;;) {
+    double start = bench_now();
+    for (long r = 0; r < iterations; r++) {
+      predict(x, &bench_weights, out);
+      bench_sink += out[x->size - 1];
+    }
+    seconds = bench_now() - start;
+    if (seconds >= BENCH_MIN_SECONDS)
+      break;
+    iterations *= 2;
+  }
+  // Every prediction reads an int and writes a double
+  bench_report("predict", variant, x->size, thread_pool.nthreads, iterations,
+               seconds, x->size * (sizeof(int) + sizeof(double)), -1);
+
+  static const size_t batches[] = {1, 64, 1024};
+  for (size_t k = 0; latency && k < sizeof(batches) / sizeof(*batches); k++) {
+    size_t n = batches[k] < x->size ? batches[k] : x->size;
+    double total = 0;
+    for (size_t c = 0; c < BENCH_LATENCY_CALLS; c++) {
+      IntVec batch = {.data = x->data + c * n % (x->size - n + 1), .size = n};
+      double start = bench_now();
+      predict(&batch, &bench_weights, out);
+      samples[c] = bench_now() - start;
+      total += samples[c];
+      bench_sink += out[0];
+    }
+    qsort(samples, BENCH_LATENCY_CALLS, sizeof(*samples), bench_compare);
+    printf("%s\n    {\"name\": \"predict-latency\", \"variant\": \"%s\", "
+           "\"rows\": %zu, \"threads\": %d, \"iterations\": %d, "
+           "\"predictions_per_s\": %.0f, \"p50_us\": %.3f, "
+           "\"p99_us\": %.3f}",
+           bench_first ? "" : ",", variant, n, thread_pool.nthreads,
+           BENCH_LATENCY_CALLS, n * BENCH_LATENCY_CALLS / total,
+           samples[BENCH_LATENCY_CALLS / 2] * 1e6,
+           samples[BENCH_LATENCY_CALLS * 99 / 100] * 1e6);
+    bench_first = 0;
+  }
+  fflush(stdout);
+  free(out);
+  free(samples);
+  return 0;
+}
+
+/**
+ * Time the training loop of sufficient-stats mode, O(1) per iteration.
+ *
+ * @param x Pointer to the inputs.
+ * @param y Pointer to the targets.
+ */
+static void bench_stats(const IntVec *x, const IntVec *y) {
+  SuffStats stats = {0};
+  for (size_t i = 0; i < x->size; i++)
+    stats_add(&stats, x->data[i], y->data[i]);
+  Optimizer opt = {.kind = OPT_GD, .alpha = 0.00001};
+  long iterations = 1;
+  double seconds;
+  for (;;) {
+    Weights weights = {0};
+    double start = bench_now();
+    for (long r = 0; r < iterations; r++) {
+      Weights g = stats_gradient(&stats, &weights);
+      optimizer_step(&opt, &weights, &g, NULL);
+    }
+    seconds = bench_now() - start;
+    bench_sink += weights.w;
+    if (seconds >= BENCH_MIN_SECONDS)
+      break;
+    iterations *= 2;
+  }
+  bench_report("train", "sufficient-stats", x->size, 1, iterations, seconds,
+               0, -1);
+}
+
+/**
+ * Time the logger: records pushed, formatted and written to /dev/null.
+ *
+ * @return int - 0 on success, 1 on error (the error has been reported).
+ */
+static int bench_logging(void) {
+  size_t records = 1000000;
+  for (int f = 0; f < 3; f++) {
+    long iterations = 1;
+    double seconds;
+    for (;;) {
+      double start = bench_now();
+      for (long r = 0; r < iterations; r++) {
+        Logger *log = malloc(sizeof(*log));
+        if (log == NULL || logger_open(log, "/dev/null", (LogFormat)f, 0, 0)) {
+          free(log);
+          return 1;
+        }
+        for (size_t i = 0; i < records; i++)
+          logger_push(log, EVENT_ITERATION, i, &(Weights){.w = i, .b = 1},
+                      NAN, NAN);
+        logger_close(log);
+        free(log);
+      }
+      seconds = bench_now() - start;
+      if (seconds >= BENCH_MIN_SECONDS)
+        break;
+      iterations *= 2;
+    }
+    bench_report("logging", log_format_names[f], records, 1, iterations,
+                 seconds, 0, -1);
+  }
+  return 0;
+}
+
+// Benchmark entry point, replaces the trainer's main
+int main(int argc, char **argv) {
+  size_t max_rows = 10000000;
+  if (argc > 2 || (argc == 2 && (max_rows = strtoull(argv[1], NULL, 10)) <
+                                    1000) ||
+      max_rows > 100000000) {
+    fprintf(stderr, "Usage: %s [max rows, 1000 to 100000000]\n", argv[0]);
+    return 1;
+  }
+
+  // Every thread count from one to all CPUs, doubling
+  int cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  IntVec x = {.data = malloc(max_rows * sizeof(int)), .capacity = max_rows};
+  IntVec y = {.data = malloc(max_rows * sizeof(int)), .capacity = max_rows};
+  // The same pairs stored narrow
+  IntVec x16 = {.data16 = malloc(max_rows * 2), .type = COLUMN_INT16};
+  IntVec y16 = {.data16 = malloc(max_rows * 2), .type = COLUMN_INT16};
+  IntVec x8 = {.data8 = malloc(max_rows), .type = COLUMN_INT8};
+  IntVec y8 = {.data8 = malloc(max_rows), .type = COLUMN_INT8};
+  gradient_partials = aligned_alloc(
+      64, (cpus > 1 ? cpus : 1) * sizeof(PartialSums));
+  if (x.data == NULL || y.data == NULL || x16.data == NULL ||
+      y16.data == NULL || x8.data == NULL || y8.data == NULL ||
+      gradient_partials == NULL) {
+    perror("Error allocating memory");
+    return 1;
+  }
+
+  int status = 0;
+  printf("{\"benchmarks\": [");
+  for (size_t rows = 1000; status == 0 && rows <= max_rows; rows *= 10) {
+    bench_fill(&x, &y, rows);
+    for (size_t i = 0; i < rows; i++) {
+      x16.data16[i] = (int16_t)x.data[i];
+      y16.data16[i] = (int16_t)y.data[i];
+      x8.data8[i] = (int8_t)x.data[i];
+      y8.data8[i] = (int8_t)y.data[i];
+    }
+    x16.size = y16.size = x8.size = y8.size = rows;
+    for (int threads = 1; status == 0; threads *= 2) {
+      if (threads > cpus)
+        threads = cpus;
+      if (threads > 1 && pool_start(&thread_pool, threads) != 0) {
+        fprintf(stderr, "Error: could not start %d threads\n", threads);
+        status = 1;
+        break;
+      }
+      status = bench_load(&x, &y, rows);
+      for (Kernel k = KERNEL_SCALAR; status == 0 && k <= KERNEL_NEON; k++) {
+        GradientKernel f64 = select_kernel(k);
+        if (f64 == NULL)
+          continue;
+        gradient_kernel = bench_f64_kernel = f64;
+        Weights exact = gradient(&x, &y, &bench_weights);
+        char variant[32];
+        for (Precision p = PRECISION_F64; p <= PRECISION_MIXED; p++) {
+          snprintf(variant, sizeof(variant), "%s-%s", kernel_names[k],
+                   precision_names[p]);
+          gradient_kernel = select_precision(f64, p);
+          bench_gradient(&x, &y, variant, &exact);
+        }
+        for (int d = 0; d < 2; d++) {
+          IntVec *nx = d == 0 ? &x16 : &x8, *ny = d == 0 ? &y16 : &y8;
+          snprintf(variant, sizeof(variant), "%s-%s", kernel_names[k],
+                   d == 0 ? "int16" : "int8");
+          narrow_kernel = select_narrow(f64, nx->type);
+          bench_gradient(nx, ny, variant, &exact);
+        }
+        vector_ops = select_vector_ops(f64);
+        status = bench_matrix(rows / BENCH_FEATURES, kernel_names[k]);
+        predict_kernel = select_predict_kernel(f64);
+        if (status == 0)
+          status = bench_predict(&x, kernel_names[k], rows == 1000);
+      }
+      pool_stop(&thread_pool);
+      if (threads >= cpus)
+        break;
+    }
+    if (status == 0)
+      bench_stats(&x, &y);
+  }
+  if (status == 0)
+    status = bench_logging();
+  printf("\n]}\n");
+
+  free(x.data);
+  free(y.data);
+  free(x16.data);
+  free(y16.data);
+  free(x8.data);
+  free(y8.data);
+  free(gradient_partials);
+  return status;
+}
+#else
+
+/**
+ * Print the usage message explaining the arguments and the settings file.
+ *
+ * @param prog Name of the executable.
+ */
+static void print_usage(const char *prog) {
+  fprintf(
+      stderr,
+      "Error: Invalid number of arguments provided.\n\n"
+      "Usage: %s <input-target pairs file> or %s <input-target pairs file> "
+      "<initial setting file>\n"
+      "or %s --convert <input-target pairs file> <binary file>\n"
+      "<input-target pairs file> (input-target.txt) example: \n"
+      "1 2\n2 3\n3 4\n123 432\n10 1\n-10 37\n\n"
+      "<initial settings file> (settings.txt) example:\n"
+      "w 0.0\nb 0.0\nalpha 0.00001\niterations 100000\noutput stdout\n"
+      "log-every 100\nmode gradient-descent\nkernel auto\nthreads 1\n"
+      "batch-size 1024\nepochs 10\ntolerance 0\nmin-delta 0\npatience 1\n"
+      "optimizer gd\nmomentum 0.9\nbeta1 0.9\nbeta2 0.999\nepsilon 1e-8\n"
+      "normalize 0\nlog-format text\nlog-metrics 0\n\n"
+      "Settings file explanation:\n"
+      "w = initial weight, b = initial bias, alpha = learning rate,\n"
+      "iterations = number of iterations to train (inclusive) starting from 0\n"
+      "(e.g. 1000 would be 0..1000 or 1001 total, 10000 would be 0..10000 or "
+      "10001 total),\n"
+      "log-every = number of iterations to pass between before logging (e.g. "
+      "log-every 100 would log 0 100 200 ...),\n"
+      "output = file where the output will be written (left unspecified uses "
+      "stdout),\n"
+      "mode = gradient-descent (pass over the data every iteration), "
+      "sufficient-stats\n"
+      "(descend on sums collected while loading, O(1) per iteration) or "
+      "closed-form\n"
+      "(exact least squares solution, no iterations, one data pass plus a "
+      "Cholesky or QR\n"
+      "solve for multivariate data) or sgd (mini-batch "
+      "descent streaming the file) or online (keeps running sums and refits "
+      "the exact\n"
+      "model after every batch of new pairs, read from the input file, \"-\" "
+      "for stdin, or a socket)\n"
+      "or predict (writes w*x + b for every input of the input file, one x "
+      "per line or a\n"
+      "binary data set, to output, log-format binary writes raw doubles),\n"
+      "batch-size = pairs per mini-batch step in sgd mode, most pairs per "
+      "batch in online mode,\n"
+      "epochs = number of passes over the file in sgd mode,\n"
+      "tolerance = stop once the gradient norm is below this (0 disables),\n"
+      "min-delta = stop once an iteration changes the cost by less than this "
+      "(0 disables),\n"
+      "patience = number of consecutive iterations that must meet tolerance "
+      "or min-delta before stopping\n"
+      "(the early stopping settings apply to gradient-descent and "
+      "sufficient-stats),\n"
+      "optimizer = gd, momentum, nesterov, rmsprop, adam or line-search "
+      "(exact step size along the\n"
+      "gradient, ignores alpha, not available in sgd mode),\n"
+      "momentum = velocity decay of momentum and nesterov, beta1 / beta2 = "
+      "moment decays of adam\n"
+      "(rmsprop uses beta2), epsilon = keeps the rmsprop and adam steps "
+      "finite,\n"
+      "normalize = 1 trains on standardized inputs (x - mean) / std, the "
+      "logged w and b are\n"
+      "converted back to the original scale (allows a learning rate around "
+      "0.1-1),\n"
+      "log-format = text, csv or binary (header then raw records, see the "
+      "source for the layout),\n"
+      "log-metrics = 1 also logs the cost and the gradient norm at every log "
+      "line, both at the\n"
+      "weights the gradient was taken at (the cost comes out of the "
+      "gradient pass)\n"
+      "kernel = gradient kernel: auto (widest the CPU supports), scalar, avx2, "
+      "avx512 or neon,\n"
+      "precision = f64, f32 (float products and sums, twice the vector "
+      "width) or mixed\n"
+      "(float products, sums added in double) for the univariate gradient,\n"
+      "threads = number of threads parsing the input and computing the "
+      "gradient (0 uses every CPU, at most 1024),\n"
+      "layout = row-major or column-major, memory layout of a multivariate "
+      "feature matrix,\n"
+      "solver = iterative (the mode decides), direct (same as mode "
+      "closed-form) or coordinate\n"
+      "(coordinate descent on a multivariate data set, the exact "
+      "closed-form on pairs),\n"
+      "l1 / l2 = lasso and ridge penalties l1 |w| and l2 / 2 w^2 added to "
+      "the cost (the bias\n"
+      "is not penalized), l1 needs solver coordinate or mode closed-form,\n"
+      "path = number of l1 values solver coordinate fits, from the smallest "
+      "that zeroes every\n"
+      "weight down to l1, each starting from the previous solution (0 fits "
+      "only l1),\n"
+      "cache = 1 keeps a parsed text input in shared memory "
+      "(/dev/shm/lr-cache-*), later runs on\n"
+      "the unchanged file map it instead of parsing, a changed file "
+      "replaces it,\n"
+      "deterministic = 1 sums every gradient in fixed blocks along a fixed "
+      "pairwise tree, the\n"
+      "results are bit-identical for every thread count (for the same "
+      "kernel, precision and\n"
+      "input files), sweep and multivariate closed-form then run on one "
+      "thread,\n"
+      "cv = k (at least 2) runs a k-fold cross-validation of the pairs in "
+      "gradient-descent,\n"
+      "sufficient-stats or closed-form mode: k contiguous folds, each model "
+      "trains on all\n"
+      "but one fold from the sums of one pass, logs its weights and the "
+      "validation cost on\n"
+      "the fold left out, then the means over the folds (0 disables),\n"
+      "sweep = file of configurations trained together in gradient-descent "
+      "or sufficient-stats\n"
+      "mode, one per line "
+      "as key value pairs out of alpha, w, b and iterations (e.g. \"alpha "
+      "0.0001 w 1\"), logs the\n"
+      "result of every configuration and the best one,\n"
+      "checkpoint = file the training state is saved to every "
+      "checkpoint-every iterations\n"
+      "(default 10000) and when the run is stopped by SIGTERM or SIGINT, "
+      "resume = checkpoint file\n"
+      "to continue from (the output file is appended to),\n"
+      "window = online mode fits the most recent window pairs (0 keeps "
+      "all), decay = online\n"
+      "mode weight older pairs keep per new pair (1 keeps all, e.g. "
+      "0.9999), listen = TCP port\n"
+      "online mode accepts pairs on, one connection at a time (0 reads the "
+      "input file),\n"
+      "listen-address = IPv4 address listen binds to (default 127.0.0.1, "
+      "0.0.0.0 accepts pairs\n"
+      "from every host, unauthenticated),\n"
+      "publish = file online mode writes \"w <w>\" and \"b <b>\" to "
+      "after every batch,\n"
+      "model = file the initial w and b are read from, \"w\" and \"b\" "
+      "lines or a text log\n"
+      "(its last line with w and b),\n"
+      "peers = file of \"host port\" lines, one per node in rank order, "
+      "for a distributed run:\n"
+      "every node trains on its own input file and the nodes combine their "
+      "gradients\n"
+      "(gradient-descent) or sums (sufficient-stats, closed-form) over a "
+      "TCP ring,\n"
+      "rank = this node's line in peers counting from 0, rank 0 writes the "
+      "output,\n"
+      "device = cpu or opencl (gradient-descent on a GPU with the inputs "
+      "kept on the device,\n"
+      "needs a build with -DLR_WITH_OPENCL)\n\n"
+      "It is fine to not provide a initial settings file, if one is not "
+      "provided,\n"
+      "the settings listed in the example will be used.\n"
+      "Furthermore, you don't have to specify all the settings in your "
+      "<initial settings file>\n"
+      "and the ordering of your settings does not matter.\n\n"
+      "Another <initial settings file> (settings.txt) example:\n"
+      "log-every 1000\nw 100\n\n"
+      "Is also a valid settings file.\n\n"
+      "Files should be txts with the format value <space> value and should be "
+      "in the same directory as the executable.\n"
+      "The <input-target pairs file> can also be a binary file written by "
+      "--convert,\n"
+      "it is memory mapped and trained on without parsing.\n"
+      "A multivariate file starts with a line \"features <d>\", every other "
+      "line holds d\n"
+      "feature values followed by the target. It is trained with "
+      "gradient-descent or\n"
+      "closed-form, one w per feature, and the log shows the weights as "
+      "[w1 w2 ...].\n",
+      prog, prog, prog);
+}
+
+// Main function
+int main(int argc, char **argv) {
+
+  // Convert a text file of input-target pairs into a binary data set
+  if (argc == 4 && strcmp(argv[1], "--convert") == 0) {
+    Dataset data;
+    if (load_dataset(argv[2], 0, LAYOUT_COLUMN_MAJOR, 0, &data) != 0)
+      return 1;
+    int status = data.matrix.features > 0
+                     ? write_matrix_binary(argv[3], &data.matrix)
+                     : write_binary(argv[3], &data.x, &data.y);
+    free_dataset(&data);
+    return status;
+  }
+
+  // Check if correct number of arguments are provided
+  if (argc < 2 || argc > 3) {
+    // Error message explaining usage and input requirements
+    print_usage(argv[0]);
+    return 1;
+  }
+
+  // Default initial settings
+  Settings settings = {.w = 0.0,
+                       .b = 0.0,
+                       .iterations = 100000,
+                       .every = 100,
+                       .output = "",
+                       .mode = MODE_GRADIENT_DESCENT,
+                       .kernel = KERNEL_AUTO,
+                       .precision = PRECISION_F64,
+                       .threads = 1,
+                       .batch_size = 1024,
+                       .epochs = 10,
+                       .stop = {.patience = 1},
+                       .optimizer = {.kind = OPT_GD,
+                                     .alpha = 0.00001,
+                                     .momentum = 0.9,
+                                     .beta1 = 0.9,
+                                     .beta2 = 0.999,
+                                     .epsilon = 1e-8},
+                       .normalize = 0,
+                       .log_format = LOG_TEXT,
+                       .log_metrics = 0,
+                       .layout = LAYOUT_ROW_MAJOR,
+                       .solver = SOLVER_ITERATIVE,
+                       .sweep = "",
+                       .checkpoint = "",
+                       .checkpoint_every = 10000,
+                       .resume = "",
+                       .window = 0,
+                       .decay = 1,
+                       .listen = 0,
+                       .address = "127.0.0.1",
+                       .publish = "",
+                       .model = "",
+                       .peers = "",
+                       .rank = 0,
+                       .device = DEVICE_CPU,
+                       .l1 = 0,
+                       .l2 = 0,
+                       .path = 0,
+                       .cache = 0,
+                       .deterministic = 0,
+                       .cv = 0};
+
+  // Read the optional initial settings file first, the training mode decides
+  // how the input-target pairs are loaded
+  if (argc == 3 && read_settings(argv[2], &settings) != 0)
+    return 1;
+  if (settings.solver != SOLVER_ITERATIVE) {
+    if (settings.mode == MODE_SGD || settings.mode == MODE_ONLINE ||
+        settings.mode == MODE_PREDICT) {
+      fprintf(stderr, "Error: solver %s cannot be used with sgd, "
+                      "online or predict\n",
+              solver_names[settings.solver]);
+      return 1;
+    }
+    settings.mode = MODE_CLOSED_FORM;
+    // Coordinate descent reads the feature matrix one column at a time
+    if (settings.solver == SOLVER_COORDINATE)
+      settings.layout = LAYOUT_COLUMN_MAJOR;
+  }
+  if ((settings.l1 > 0 || settings.l2 > 0) &&
+      (settings.mode == MODE_SGD || settings.mode == MODE_ONLINE ||
+       settings.sweep[0] != '\0')) {
+    fprintf(stderr, "Error: l1 and l2 cannot be used with sgd, online or "
+                    "sweep\n");
+    return 1;
+  }
+  if (settings.l1 > 0 && settings.mode != MODE_CLOSED_FORM) {
+    fprintf(stderr, "Error: l1 needs solver coordinate or mode "
+                    "closed-form, gradient descent cannot reach its exact "
+                    "zeros\n");
+    return 1;
+  }
+  if (settings.path > 1 &&
+      (settings.solver != SOLVER_COORDINATE || !(settings.l1 > 0))) {
+    fprintf(stderr, "Error: path needs solver coordinate and l1 > 0\n");
+    return 1;
+  }
+  if (settings.sweep[0] != '\0' &&
+      ((settings.mode != MODE_GRADIENT_DESCENT &&
+        settings.mode != MODE_SUFFICIENT_STATS) ||
+       settings.optimizer.kind != OPT_GD || settings.normalize ||
+       settings.precision != PRECISION_F64)) {
+    fprintf(stderr, "Error: sweep needs mode gradient-descent or "
+                    "sufficient-stats, optimizer gd, no normalize and "
+                    "precision f64\n");
+    return 1;
+  }
+  if (settings.cv > 0 &&
+      ((settings.mode != MODE_GRADIENT_DESCENT &&
+        settings.mode != MODE_SUFFICIENT_STATS &&
+        settings.mode != MODE_CLOSED_FORM) ||
+       settings.sweep[0] != '\0' || settings.normalize ||
+       settings.checkpoint[0] != '\0' || settings.resume[0] != '\0' ||
+       settings.peers[0] != '\0' || settings.device != DEVICE_CPU)) {
+    fprintf(stderr, "Error: cv needs mode gradient-descent, "
+                    "sufficient-stats or closed-form without sweep, "
+                    "normalize, checkpoints, peers or device opencl\n");
+    return 1;
+  }
+  if ((settings.checkpoint[0] != '\0' || settings.resume[0] != '\0') &&
+      (settings.mode == MODE_SGD || settings.mode == MODE_CLOSED_FORM ||
+       settings.mode == MODE_ONLINE || settings.mode == MODE_PREDICT ||
+       settings.sweep[0] != '\0')) {
+    fprintf(stderr, "Error: checkpoint and resume only apply to "
+                    "gradient-descent and sufficient-stats without sweep\n");
+    return 1;
+  }
+  if (settings.model[0] != '\0') {
+    Weights model;
+    if (load_model(settings.model, &model) != 0)
+      return 1;
+    settings.w = model.w;
+    settings.b = model.b;
+  }
+  if (settings.peers[0] != '\0' &&
+      ((settings.mode != MODE_GRADIENT_DESCENT &&
+        settings.mode != MODE_SUFFICIENT_STATS &&
+        settings.mode != MODE_CLOSED_FORM) ||
+       settings.sweep[0] != '\0' || settings.checkpoint[0] != '\0' ||
+       settings.resume[0] != '\0')) {
+    fprintf(stderr, "Error: peers needs mode gradient-descent, "
+                    "sufficient-stats or closed-form without sweep or "
+                    "checkpoints\n");
+    return 1;
+  }
+  if (settings.device == DEVICE_OPENCL) {
+#ifndef LR_WITH_OPENCL
+    fprintf(stderr, "Error: device opencl needs a build with "
+                    "-DLR_WITH_OPENCL\n");
+    return 1;
+#endif
+    if (settings.mode != MODE_GRADIENT_DESCENT ||
+        settings.sweep[0] != '\0' || settings.peers[0] != '\0' ||
+        settings.precision != PRECISION_F64) {
+      fprintf(stderr, "Error: device opencl needs mode gradient-descent "
+                      "and precision f64 without sweep or peers\n");
+      return 1;
+    }
+  }
+  if (settings.window > 0 && settings.decay < 1) {
+    fprintf(stderr, "Error: window and decay cannot be used together\n");
+    return 1;
+  }
+  if (settings.mode == MODE_SGD &&
+      settings.optimizer.kind == OPT_LINE_SEARCH) {
+    fprintf(stderr, "Error: line-search needs the whole data set, it cannot "
+                    "be used with sgd\n");
+    return 1;
+  }
+
+  // Pick the gradient kernel once, before any data is touched
+  gradient_kernel = select_kernel(settings.kernel);
+  if (gradient_kernel == NULL) {
+    fprintf(stderr, "Error: kernel %s is not supported on this CPU\n",
+            kernel_names[settings.kernel]);
+    return 1;
+  }
+  vector_ops = select_vector_ops(gradient_kernel);
+  predict_kernel = select_predict_kernel(gradient_kernel);
+  gradient_kernel = select_precision(gradient_kernel, settings.precision);
+
+  // Start the threads once, they parse the input and then stay parked
+  // between the gradient iterations. A deterministic reduction needs 8
+  // range slots per thread behind the per-thread slots.
+  deterministic = settings.deterministic;
+  size_t ranges = deterministic ? 2 * REDUCE_RANGES * settings.threads : 0;
+  if (settings.threads > 1 || deterministic) {
+    gradient_partials = aligned_alloc(
+        64, (settings.threads + ranges) * sizeof(PartialSums));
+    reduce_partials =
+        gradient_partials != NULL ? gradient_partials + settings.threads
+                                  : NULL;
+    if (gradient_partials == NULL && deterministic) {
+      perror("Error allocating memory");
+      return 1;
+    }
+    if (settings.threads > 1 &&
+        (gradient_partials == NULL ||
+         pool_start(&thread_pool, settings.threads) != 0)) {
+      fprintf(stderr, "Warning: could not start %d threads, using one\n",
+              settings.threads);
+      pool_stop(&thread_pool);
+    }
+  }
+
+  // Predictions are written straight to the output, there is no log
+  if (settings.mode == MODE_PREDICT) {
+    Weights model = {.w = settings.w, .b = settings.b};
+    int status = run_predict(argv[1], &settings, &model);
+    pool_stop(&thread_pool);
+    free(gradient_partials);
+    return status;
+  }
+
+  // Join the other nodes of a distributed run before loading the shard,
+  // they start at about the same time
+  Ring ring = {.nodes = 1, .next = -1, .prev = -1};
+  if (settings.peers[0] != '\0' &&
+      ring_open(&ring, settings.peers, settings.rank) != 0) {
+    ring_close(&ring);
+    pool_stop(&thread_pool);
+    free(gradient_partials);
+    return 1;
+  }
+
+  // Load the input-target pairs, the sufficient statistics modes only keep
+  // the sums (cv needs the pairs to split them into folds), sgd and online
+  // stream the input themselves
+  int use_stats = settings.mode == MODE_SUFFICIENT_STATS ||
+                  settings.mode == MODE_CLOSED_FORM;
+  Dataset data = {0};
+  INSTRUMENT_START();
+  INSTRUMENT_BEGIN(PHASE_LOAD);
+  if (settings.mode != MODE_SGD && settings.mode != MODE_ONLINE &&
+      load_dataset(argv[1], use_stats && settings.cv == 0, settings.layout,
+                   settings.cache, &data) != 0) {
+    ring_close(&ring);
+    pool_stop(&thread_pool);
+    free(gradient_partials);
+    return 1;
+  }
+  INSTRUMENT_END(PHASE_LOAD);
+  IntVec x = data.x, y = data.y;
+  SuffStats stats = data.stats;
+
+  // Multivariate data sets only support full batch descent
+  size_t features = data.matrix.features;
+  const char *unsupported =
+      features == 0                                   ? NULL
+      : settings.mode == MODE_SUFFICIENT_STATS        ? "sufficient-stats"
+      : settings.optimizer.kind == OPT_LINE_SEARCH    ? "line-search"
+      : settings.normalize                            ? "normalize"
+      : settings.sweep[0] != '\0'                     ? "sweep"
+      : settings.precision != PRECISION_F64           ? "precision f32/mixed"
+      : ring.nodes > 1                                ? "peers"
+      : settings.device != DEVICE_CPU                 ? "device opencl"
+      : settings.cv > 0                               ? "cv"
+      : settings.l1 > 0 && settings.solver != SOLVER_COORDINATE
+          ? "l1 without solver coordinate"
+                                                      : NULL;
+  if (unsupported != NULL) {
+    fprintf(stderr, "Error: %s cannot be used with multivariate data\n",
+            unsupported);
+    free_dataset(&data);
+    ring_close(&ring);
+    pool_stop(&thread_pool);
+    free(gradient_partials);
+    return 1;
+  }
+  // The reductions of a sweep and of the direct solver are split by
+  // thread, a deterministic run keeps them on one
+  if (deterministic &&
+      (settings.sweep[0] != '\0' ||
+       (features > 0 && settings.mode == MODE_CLOSED_FORM &&
+        settings.solver != SOLVER_COORDINATE)))
+    pool_stop(&thread_pool);
+  if (features == 0 && settings.path > 1) {
+    fprintf(stderr, "Error: path needs multivariate data\n");
+    free_dataset(&data);
+    ring_close(&ring);
+    pool_stop(&thread_pool);
+    free(gradient_partials);
+    return 1;
+  }
+
+  // The exact cost change of min-delta, the line search, normalize and the
+  // costs of a sweep need the sums in every mode
+  if ((settings.stop.min_delta > 0 ||
+       settings.optimizer.kind == OPT_LINE_SEARCH || settings.normalize ||
+       settings.sweep[0] != '\0') &&
+      !use_stats && settings.cv == 0)
+    for (size_t i = 0; i < x.size; i++)
+      stats_add(&stats, x.data[i], y.data[i]);
+
+  // A distributed run trains on the statistics of all shards, one reduction
+  // replaces every pass over the data in the sufficient statistics modes
+  if (ring_stats(&ring, &stats) != 0) {
+    free_dataset(&data);
+    ring_close(&ring);
+    pool_stop(&thread_pool);
+    free(gradient_partials);
+    return 1;
+  }
+  stats.l1 = settings.l1;
+  stats.l2 = settings.l2;
+
+  // Small integers are stored in int16 or int8 so the gradient passes read
+  // less memory. The narrow kernels are double precision only, the sweep
+  // kernels read int32 and the scalar kernel is faster on int32.
+  if (settings.mode == MODE_GRADIENT_DESCENT && features == 0 &&
+      settings.sweep[0] == '\0' && settings.cv == 0 &&
+      settings.precision == PRECISION_F64 && settings.device == DEVICE_CPU &&
+      gradient_kernel != gradient_scalar) {
+    if (narrow_pairs(&data) != 0) {
+      free_dataset(&data);
+      ring_close(&ring);
+      pool_stop(&thread_pool);
+      free(gradient_partials);
+      return 1;
+    }
+    x = data.x;
+    y = data.y;
+    narrow_kernel = select_narrow(gradient_kernel, x.type);
+  }
+  cost_kernel = select_cost_kernel(gradient_kernel, x.type);
+
+  // Gradient descent runs in the standardized space, the statistics follow
+  Scaling scaling = {.mean = 0, .std = 1};
+  if (settings.normalize && settings.mode != MODE_SGD &&
+      settings.mode != MODE_CLOSED_FORM && settings.mode != MODE_ONLINE) {
+    if (scaling_from_stats(&stats, &scaling) != 0) {
+      fprintf(stderr, "Error: normalize needs at least two distinct inputs\n");
+      free_dataset(&data);
+      ring_close(&ring);
+      pool_stop(&thread_pool);
+      free(gradient_partials);
+      return 1;
+    }
+    stats = stats_standardize(&stats, &scaling);
+  }
+
+  // The GPU gets its copy of the pairs once, before the first iteration
+  GpuBackend gpu = {0};
+  if (settings.device == DEVICE_OPENCL && gpu_open(&gpu, &x, &y) != 0) {
+    gpu_close(&gpu);
+    free_dataset(&data);
+    ring_close(&ring);
+    pool_stop(&thread_pool);
+    free(gradient_partials);
+    return 1;
+  }
+
+  // Open the output file, the log writer thread runs until the end.
+  // Only rank 0 of a distributed run logs, the others train the same model
+  Logger *log = malloc(sizeof(*log));
+  if (log == NULL ||
+      logger_open(log, ring.rank == 0 ? settings.output : "/dev/null",
+                  settings.log_format, features, settings.resume[0] != '\0')) {
+    // Free allocated memeory before exiting
+    free(log);
+    free_dataset(&data);
+    gpu_close(&gpu);
+    ring_close(&ring);
+    pool_stop(&thread_pool);
+    free(gradient_partials);
+    return 1;
+  }
+
+  // A signal (e.g. the SIGTERM of a preempted instance) ends the run with a
+  // checkpoint instead of losing it
+  if (settings.checkpoint[0] != '\0') {
+    struct sigaction action = {.sa_handler = request_stop};
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGTERM, &action, NULL);
+    sigaction(SIGINT, &action, NULL);
+  }
+
+  // Initialize weights with the specified or default values
+  Weights weights = {.w = settings.w, .b = settings.b};
+  FastLoop fast;
+  int status = 0;
+
+  if (settings.cv > 0)
+    status = train_cv(&data, &settings, log);
+  else if (settings.solver == SOLVER_COORDINATE && features > 0)
+    status = train_coordinate(&data, &settings, log);
+  else if (settings.mode == MODE_CLOSED_FORM && features > 0) {
+    // One pass over the data and a solve of the normal equations
+    double *theta = malloc((features + 1) * sizeof(double)), cost;
+    if (theta == NULL) {
+      perror("Error allocating memory");
+      status = 1;
+    } else
+      status = solve_direct(&data.matrix, settings.l2, theta, &cost);
+    if (status == 0)
+      logger_push_vector(log, EVENT_CLOSED_FORM, 0, theta,
+                         settings.log_metrics ? cost : NAN,
+                         settings.log_metrics ? 0 : NAN);
+    free(theta);
+  } else if (settings.mode == MODE_CLOSED_FORM) {
+    // The closed form solution replaces the training loop entirely
+    status = closed_form(&stats, &weights);
+    if (status != 0)
+      fprintf(stderr,
+              "Error: closed-form needs at least two distinct inputs\n");
+    else
+      logger_push(log, EVENT_CLOSED_FORM, 0, &weights,
+                  settings.log_metrics ? stats_cost(&stats, &weights) : NAN,
+                  settings.log_metrics ? 0 : NAN);
+  } else if (features > 0)
+    status = train_multivariate(&data, &settings, log);
+  else if (settings.sweep[0] != '\0')
+    status = train_sweep(&data, &settings, &stats, log);
+  else if (settings.mode == MODE_SGD)
+    status = train_sgd(argv[1], &settings, &weights, log);
+  else if (settings.mode == MODE_ONLINE)
+    status = train_online(argv[1], &settings, &weights, log);
+  else if ((fast = select_fast_loop(&settings, &x, ring.nodes)) != NULL)
+    fast(&x, &y, &settings.optimizer, &weights, settings.iterations,
+         settings.every, log);
+  else {
+    // Training loop to update weights over the specified number of iterations
+    Optimizer *opt = &settings.optimizer;
+    weights = scale_weights(&scaling, &weights);
+
+    // Continue from the state a checkpoint holds
+    int first = 0;
+    if (settings.resume[0] != '\0') {
+      CheckpointHeader header;
+      double state[6];
+      status = read_checkpoint(settings.resume, &header, state, 2, 0,
+                               opt->kind, settings.normalize);
+      if (status == 0) {
+        weights = (Weights){.w = state[0], .b = state[1]};
+        opt->velocity = (Weights){.w = state[2], .b = state[3]};
+        opt->second = (Weights){.w = state[4], .b = state[5]};
+        opt->t = header.steps;
+        settings.stop.streak = header.streak;
+        first = header.iteration;
+      }
+    }
+
+    for (int i = first; status == 0 && i <= settings.iterations; i++) {
+      INSTRUMENT_POLL();
+
+      // Compute the gradient where the optimizer needs it, either from the
+      // data at the equivalent raw weights or from the (scaled) sums
+      // collected while loading. Iterations that log the cost take it from
+      // the same data pass, or from the sums when there are any.
+      INSTRUMENT_BEGIN(PHASE_GRADIENT);
+      int metrics = settings.log_metrics && i % settings.every == 0;
+      double cost = NAN;
+      Weights at = optimizer_lookahead(opt, &weights);
+      Weights ws;
+      if (use_stats)
+        ws = stats_gradient(&stats, &at);
+      else {
+        Weights raw = unscale_weights(&scaling, &at);
+        double *fused = metrics && !settings.normalize ? &cost : NULL;
+        if (ring.nodes > 1)
+          status = ring_gradient(&ring, &x, &y, &raw, &ws, fused);
+        else if (settings.device == DEVICE_OPENCL)
+          status = gpu_gradient(&gpu, &raw, &ws, fused);
+        else
+          ws = fused != NULL ? gradient_cost(&x, &y, &raw, fused)
+                             : gradient(&x, &y, &raw);
+        // The ridge penalty of the raw weight
+        ws.w += settings.l2 * raw.w;
+        if (fused != NULL)
+          cost += settings.l2 / 2 * raw.w * raw.w;
+        ws = scale_gradient(&scaling, &ws);
+      }
+      if (metrics && (use_stats || settings.normalize))
+        cost = stats_cost(&stats, &at);
+      INSTRUMENT_END(PHASE_GRADIENT);
+      if (status != 0)
+        break; // A peer of a distributed run or the device failed
+
+      // Update weights using the optimizer and gradient
+      INSTRUMENT_BEGIN(PHASE_UPDATE);
+      Weights before = weights;
+      optimizer_step(opt, &weights, &ws, &stats);
+      INSTRUMENT_END(PHASE_UPDATE);
+
+      // Print the weights every specified number of iterations for progress
+      // tracking
+      if (i % settings.every == 0) {
+        INSTRUMENT_BEGIN(PHASE_LOGGING);
+        Weights raw = unscale_weights(&scaling, &weights);
+        if (metrics)
+          logger_push(log, EVENT_ITERATION, i, &raw, cost, hypot(ws.w, ws.b));
+        else
+          logger_push(log, EVENT_ITERATION, i, &raw, NAN, NAN);
+        INSTRUMENT_END(PHASE_LOGGING);
+      }
+
+      // Stop as soon as the run has converged. The cost change needs the
+      // gradient at the old weights, which differs from ws by H * (at -
+      // before) when the gradient was taken at a lookahead point.
+      double delta = 0;
+      if (settings.stop.min_delta > 0) {
+        Weights ahead = {.w = at.w - before.w, .b = at.b - before.b};
+        Weights h_ahead = hessian_times(&stats, &ahead);
+        Weights g = {.w = ws.w - h_ahead.w, .b = ws.b - h_ahead.b};
+        Weights d = {.w = weights.w - before.w, .b = weights.b - before.b};
+        delta = cost_change(&stats, &g, &d);
+      }
+      if ((settings.stop.tolerance > 0 || settings.stop.min_delta > 0) &&
+          early_stop(&settings.stop, hypot(ws.w, ws.b), delta)) {
+        Weights raw = unscale_weights(&scaling, &weights);
+        logger_push(log, EVENT_CONVERGED, i, &raw, NAN, NAN);
+        break;
+      }
+
+      // Checkpoint the state the next iteration starts from
+      if (settings.checkpoint[0] != '\0' &&
+          ((i + 1) % settings.checkpoint_every == 0 || stop_requested)) {
+        CheckpointHeader header = {.optimizer = opt->kind,
+                                   .iteration = i + 1,
+                                   .steps = opt->t,
+                                   .streak = settings.stop.streak,
+                                   .normalize = settings.normalize,
+                                   .previous = NAN};
+        double state[6] = {weights.w,       weights.b,
+                           opt->velocity.w, opt->velocity.b,
+                           opt->second.w,   opt->second.b};
+        write_checkpoint(settings.checkpoint, &header, state, 2);
+      }
+      if (stop_requested) {
+        fprintf(stderr, "Stopped by a signal after iteration %d, resume "
+                        "from %s\n",
+                i, settings.checkpoint);
+        status = 1;
+      }
+    }
+    weights = unscale_weights(&scaling, &weights);
+  }
+
+  // Release the device, leave the ring and stop the gradient threads
+  gpu_close(&gpu);
+  ring_close(&ring);
+  pool_stop(&thread_pool);
+  free(gradient_partials);
+
+  // Write the queued records and close the output file
+  logger_close(log);
+  free(log);
+
+  // Free dynamically allocated memory for vectors
+  free_dataset(&data);
+
+  // Exit successfully unless training failed
+  return status;
+}
+#endif